@@ -0,0 +1,459 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * ouiche_fs - a simple educational filesystem for Linux
+ *
+ * Block and inode allocator. The free bitmaps are locked per allocation
+ * group, the free counts are per-CPU counters and every CPU hands out blocks
+ * from a small reservation, so that writers on different CPUs rarely touch
+ * the same lock or cache line.
+ */
+
+#define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/smp.h>
+
+#include "bitmap.h"
+
+/* Batch of the free counters, bounds the error of their fast reads */
+#define OUICHEFS_ALLOC_COUNTER_BATCH 32
+
+static struct ouichefs_alloc_group *groups_alloc(uint32_t nr)
+{
+	struct ouichefs_alloc_group *groups;
+
+	groups = kcalloc(nr, sizeof(*groups), GFP_KERNEL);
+	if (!groups)
+		return NULL;
+
+	for (uint32_t i = 0; i < nr; i++)
+		spin_lock_init(&groups[i].lock);
+
+	return groups;
+}
+
+/**
+ * ouichefs_alloc_init - sets up the allocator of a superblock.
+ *
+ * @sbi: superblock information, with the free bitmaps already read.
+ * @free_blocks: number of free blocks recorded in the superblock.
+ * @free_inodes: number of free inodes recorded in the superblock.
+ *
+ * Return: 0 on success, < 0 on error.
+ */
+int ouichefs_alloc_init(struct ouichefs_sb_info *sbi, uint32_t free_blocks,
+			uint32_t free_inodes)
+{
+	struct ouichefs_alloc *alloc;
+	int cpu, ret = -ENOMEM;
+
+	alloc = kzalloc(sizeof(*alloc), GFP_KERNEL);
+	if (!alloc)
+		return -ENOMEM;
+
+	alloc->nr_bgroups = DIV_ROUND_UP(sbi->nr_blocks,
+					 OUICHEFS_ALLOC_GROUP_BITS);
+	alloc->nr_igroups = DIV_ROUND_UP(sbi->nr_inodes,
+					 OUICHEFS_ALLOC_GROUP_BITS);
+	alloc->bgroups = groups_alloc(alloc->nr_bgroups);
+	if (!alloc->bgroups)
+		goto free_alloc;
+	alloc->igroups = groups_alloc(alloc->nr_igroups);
+	if (!alloc->igroups)
+		goto free_bgroups;
+
+	alloc->cache = alloc_percpu(struct ouichefs_alloc_cache);
+	if (!alloc->cache)
+		goto free_igroups;
+	for_each_possible_cpu(cpu) {
+		struct ouichefs_alloc_cache *cache =
+			per_cpu_ptr(alloc->cache, cpu);
+
+		spin_lock_init(&cache->lock);
+		/* Spread the CPUs over the groups */
+		cache->group = cpu % alloc->nr_bgroups;
+	}
+
+	ret = percpu_counter_init(&alloc->free_blocks, free_blocks,
+				  GFP_KERNEL);
+	if (ret)
+		goto free_cache;
+	ret = percpu_counter_init(&alloc->free_inodes, free_inodes,
+				  GFP_KERNEL);
+	if (ret)
+		goto destroy_free_blocks;
+
+	sbi->alloc = alloc;
+	return 0;
+
+destroy_free_blocks:
+	percpu_counter_destroy(&alloc->free_blocks);
+free_cache:
+	free_percpu(alloc->cache);
+free_igroups:
+	kfree(alloc->igroups);
+free_bgroups:
+	kfree(alloc->bgroups);
+free_alloc:
+	kfree(alloc);
+	return ret;
+}
+
+/**
+ * ouichefs_alloc_destroy - frees the allocator of a superblock.
+ *
+ * @sbi: superblock information.
+ *
+ * Reserved blocks are not given back, the caller syncs the bitmaps first.
+ */
+void ouichefs_alloc_destroy(struct ouichefs_sb_info *sbi)
+{
+	struct ouichefs_alloc *alloc = sbi->alloc;
+
+	if (!alloc)
+		return;
+
+	percpu_counter_destroy(&alloc->free_inodes);
+	percpu_counter_destroy(&alloc->free_blocks);
+	free_percpu(alloc->cache);
+	kfree(alloc->igroups);
+	kfree(alloc->bgroups);
+	kfree(alloc);
+	sbi->alloc = NULL;
+}
+
+/*
+ * Clear up to max free bits of a group and store their numbers in bits. The
+ * search starts at the hint of the group and wraps around to its start.
+ * Groups never share a word of the bitmap, so the non-atomic bit operations
+ * are safe under the group lock.
+ */
+static unsigned int group_take(unsigned long *freemap, unsigned long size,
+			       struct ouichefs_alloc_group *groups, uint32_t g,
+			       uint32_t *bits, unsigned int max)
+{
+	struct ouichefs_alloc_group *group = &groups[g];
+	unsigned long start = (unsigned long)g * OUICHEFS_ALLOC_GROUP_BITS;
+	unsigned long end = min_t(unsigned long, size,
+				  start + OUICHEFS_ALLOC_GROUP_BITS);
+	unsigned long from, bit;
+	unsigned int nr = 0;
+
+	spin_lock(&group->lock);
+	from = clamp(group->hint, start, end);
+	for (int pass = 0; pass < 2 && nr < max; pass++) {
+		unsigned long last = pass ? from : end;
+
+		bit = pass ? start : from;
+		while (nr < max) {
+			bit = find_next_bit(freemap, last, bit);
+			if (bit >= last)
+				break;
+			__clear_bit(bit, freemap);
+			bits[nr++] = bit++;
+			group->hint = bit;
+		}
+	}
+	spin_unlock(&group->lock);
+
+	return nr;
+}
+
+/*
+ * Mark the bit-th bit of freemap as free (i.e. 1).
+ */
+static void group_put(unsigned long *freemap,
+		      struct ouichefs_alloc_group *groups, uint32_t bit)
+{
+	struct ouichefs_alloc_group *group =
+		&groups[bit / OUICHEFS_ALLOC_GROUP_BITS];
+
+	spin_lock(&group->lock);
+	__set_bit(bit, freemap);
+	spin_unlock(&group->lock);
+}
+
+/*
+ * Copy the block-th block of a free bitmap, under the lock of its group.
+ */
+static void group_copy(unsigned long *freemap,
+		       struct ouichefs_alloc_group *groups, uint32_t nr_groups,
+		       uint32_t block, void *dst)
+{
+	void *src = (void *)freemap + block * OUICHEFS_BLOCK_SIZE;
+
+	/* Bitmap blocks past the last group only hold padding */
+	if (block >= nr_groups) {
+		memcpy(dst, src, OUICHEFS_BLOCK_SIZE);
+		return;
+	}
+
+	spin_lock(&groups[block].lock);
+	memcpy(dst, src, OUICHEFS_BLOCK_SIZE);
+	spin_unlock(&groups[block].lock);
+}
+
+/**
+ * ouichefs_alloc_copy_bfree - copies a block of the free blocks bitmap.
+ *
+ * @sbi: superblock information.
+ * @block: index of the block in the bitmap.
+ * @dst: buffer of OUICHEFS_BLOCK_SIZE bytes.
+ *
+ * Reserved blocks are marked used, ouichefs_alloc_drain() gives them back
+ * first.
+ */
+void ouichefs_alloc_copy_bfree(struct ouichefs_sb_info *sbi, uint32_t block,
+			       void *dst)
+{
+	group_copy(sbi->bfree_bitmap, sbi->alloc->bgroups,
+		   sbi->alloc->nr_bgroups, block, dst);
+}
+
+/**
+ * ouichefs_alloc_copy_ifree - copies a block of the free inodes bitmap.
+ *
+ * @sbi: superblock information.
+ * @block: index of the block in the bitmap.
+ * @dst: buffer of OUICHEFS_BLOCK_SIZE bytes.
+ */
+void ouichefs_alloc_copy_ifree(struct ouichefs_sb_info *sbi, uint32_t block,
+			       void *dst)
+{
+	group_copy(sbi->ifree_bitmap, sbi->alloc->igroups,
+		   sbi->alloc->nr_igroups, block, dst);
+}
+
+/**
+ * ouichefs_alloc_drain - gives the blocks reserved by all CPUs back to the
+ *			  bitmap.
+ *
+ * @sbi: superblock information.
+ *
+ * Called before the bitmap is written to disk, and when the bitmap runs out
+ * of free blocks while other CPUs still hold some.
+ */
+void ouichefs_alloc_drain(struct ouichefs_sb_info *sbi)
+{
+	struct ouichefs_alloc *alloc = sbi->alloc;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct ouichefs_alloc_cache *cache =
+			per_cpu_ptr(alloc->cache, cpu);
+
+		spin_lock(&cache->lock);
+		while (cache->first < cache->nr)
+			group_put(sbi->bfree_bitmap, alloc->bgroups,
+				  cache->blocks[cache->first++]);
+		cache->first = 0;
+		cache->nr = 0;
+		spin_unlock(&cache->lock);
+	}
+}
+
+/*
+ * Refill the reservation of a CPU, starting with the group it used last so
+ * that the blocks of a writer stay close to each other. Within a group, the
+ * search resumes where the last one stopped.
+ */
+static void cache_refill(struct ouichefs_sb_info *sbi,
+			 struct ouichefs_alloc_cache *cache)
+{
+	struct ouichefs_alloc *alloc = sbi->alloc;
+
+	for (uint32_t i = 0; i < alloc->nr_bgroups; i++) {
+		uint32_t g = (cache->group + i) % alloc->nr_bgroups;
+		unsigned int nr;
+
+		nr = group_take(sbi->bfree_bitmap, sbi->nr_blocks,
+				alloc->bgroups, g, cache->blocks,
+				OUICHEFS_ALLOC_RESERVE);
+		if (nr) {
+			cache->group = g;
+			cache->first = 0;
+			cache->nr = nr;
+			return;
+		}
+	}
+}
+
+/*
+ * Take a block from the reservation of the current CPU, refilling it if it
+ * is empty. Return 0 if the bitmap has no free block left.
+ */
+static uint32_t cache_get(struct ouichefs_sb_info *sbi)
+{
+	struct ouichefs_alloc_cache *cache = get_cpu_ptr(sbi->alloc->cache);
+	uint32_t bno = 0;
+
+	spin_lock(&cache->lock);
+	if (cache->first == cache->nr)
+		cache_refill(sbi, cache);
+	if (cache->first < cache->nr)
+		bno = cache->blocks[cache->first++];
+	spin_unlock(&cache->lock);
+	put_cpu_ptr(sbi->alloc->cache);
+
+	return bno;
+}
+
+/*
+ * Return an unused inode number and mark it used. The search starts in a
+ * group picked by the current CPU.
+ * Return 0 if no free inode was found (we assume that the first bit is never
+ * free because of the root inode, thus allowing us to use 0 as an error
+ * value).
+ */
+uint32_t get_free_inode(struct ouichefs_sb_info *sbi)
+{
+	struct ouichefs_alloc *alloc = sbi->alloc;
+	uint32_t start = raw_smp_processor_id() % alloc->nr_igroups;
+	uint32_t ino;
+
+	for (uint32_t i = 0; i < alloc->nr_igroups; i++) {
+		uint32_t g = (start + i) % alloc->nr_igroups;
+
+		if (!group_take(sbi->ifree_bitmap, sbi->nr_inodes,
+				alloc->igroups, g, &ino, 1))
+			continue;
+
+		percpu_counter_add_batch(&alloc->free_inodes, -1,
+					 OUICHEFS_ALLOC_COUNTER_BATCH);
+		pr_debug("allocated inode %u\n", ino);
+		return ino;
+	}
+
+	return 0;
+}
+
+/*
+ * Take the goal block if it is reserved by the current CPU or still free in
+ * the bitmap. Return 0 if it is not available.
+ */
+static uint32_t goal_get(struct ouichefs_sb_info *sbi, uint32_t goal)
+{
+	struct ouichefs_alloc *alloc = sbi->alloc;
+	struct ouichefs_alloc_cache *cache = get_cpu_ptr(alloc->cache);
+	struct ouichefs_alloc_group *group;
+	uint32_t bno = 0;
+
+	spin_lock(&cache->lock);
+	for (unsigned int i = cache->first; i < cache->nr; i++) {
+		if (cache->blocks[i] != goal)
+			continue;
+		/* Keep the order of the blocks reserved before the goal */
+		memmove(&cache->blocks[cache->first + 1],
+			&cache->blocks[cache->first],
+			(i - cache->first) * sizeof(cache->blocks[0]));
+		cache->first++;
+		bno = goal;
+		break;
+	}
+	spin_unlock(&cache->lock);
+	put_cpu_ptr(alloc->cache);
+	if (bno)
+		return bno;
+
+	group = &alloc->bgroups[goal / OUICHEFS_ALLOC_GROUP_BITS];
+	spin_lock(&group->lock);
+	if (test_bit(goal, sbi->bfree_bitmap)) {
+		__clear_bit(goal, sbi->bfree_bitmap);
+		bno = goal;
+	}
+	spin_unlock(&group->lock);
+
+	return bno;
+}
+
+/*
+ * Return an unused block number and mark it used.
+ * Return 0 if no free block was found (block 0 is the superblock).
+ */
+uint32_t get_free_block(struct ouichefs_sb_info *sbi)
+{
+	return get_free_block_goal(sbi, 0);
+}
+
+/*
+ * Return an unused block number, goal if it is free, and mark it used. A goal
+ * of 0 or a goal that is not free falls back to the blocks reserved by the
+ * current CPU.
+ * Return 0 if no free block was found.
+ */
+uint32_t get_free_block_goal(struct ouichefs_sb_info *sbi, uint32_t goal)
+{
+	uint32_t bno = 0;
+
+	if (goal && goal < sbi->nr_blocks)
+		bno = goal_get(sbi, goal);
+	if (!bno)
+		bno = cache_get(sbi);
+
+	/* The last free blocks may be reserved by other CPUs */
+	if (!bno) {
+		ouichefs_alloc_drain(sbi);
+		bno = cache_get(sbi);
+	}
+	if (!bno)
+		return 0;
+
+	percpu_counter_add_batch(&sbi->alloc->free_blocks, -1,
+				 OUICHEFS_ALLOC_COUNTER_BATCH);
+	pr_debug("allocated block %u\n", bno);
+	return bno;
+}
+
+/*
+ * Allocate a run of up to max contiguous blocks, starting at goal if it is
+ * free. Return the first block of the run and set nr to its length, or return
+ * 0 if no free block was found.
+ */
+uint32_t get_free_blocks(struct ouichefs_sb_info *sbi, uint32_t goal,
+			 uint32_t max, uint32_t *nr)
+{
+	uint32_t bno = get_free_block_goal(sbi, goal), n = 0;
+
+	if (bno) {
+		n = 1;
+		while (n < max && bno + n < sbi->nr_blocks &&
+		       goal_get(sbi, bno + n))
+			n++;
+		if (n > 1)
+			percpu_counter_add_batch(&sbi->alloc->free_blocks,
+						 -(s64)(n - 1),
+						 OUICHEFS_ALLOC_COUNTER_BATCH);
+	}
+
+	*nr = n;
+	return bno;
+}
+
+/*
+ * Mark an inode as unused.
+ */
+void put_inode(struct ouichefs_sb_info *sbi, uint32_t ino)
+{
+	if (!ino || ino >= sbi->nr_inodes)
+		return;
+
+	group_put(sbi->ifree_bitmap, sbi->alloc->igroups, ino);
+	percpu_counter_add_batch(&sbi->alloc->free_inodes, 1,
+				 OUICHEFS_ALLOC_COUNTER_BATCH);
+	pr_debug("freed inode %u\n", ino);
+}
+
+/*
+ * Mark a block as unused.
+ */
+void put_block(struct ouichefs_sb_info *sbi, uint32_t bno)
+{
+	if (!bno || bno >= sbi->nr_blocks)
+		return;
+
+	group_put(sbi->bfree_bitmap, sbi->alloc->bgroups, bno);
+	percpu_counter_add_batch(&sbi->alloc->free_blocks, 1,
+				 OUICHEFS_ALLOC_COUNTER_BATCH);
+	pr_debug("freed block %u\n", bno);
+}
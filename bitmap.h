@@ -8,100 +8,104 @@
 #define _OUICHEFS_BITMAP_H
 
 #include <linux/bitmap.h>
+#include <linux/spinlock.h>
+#include <linux/percpu.h>
+#include <linux/percpu_counter.h>
 #include "ouichefs.h"
 
 /*
- * Return the first free bit (set to 1) in a given in-memory bitmap spanning
- * over multiple blocks and clear it.
- * Return 0 if no free bit found (we assume that the first bit is never free
- * because of the superblock and the root inode, thus allowing us to use 0 as an
- * error value).
+ * The free bitmaps are split in allocation groups of one bitmap block each,
+ * every group has its own lock. Free bits are set to 1.
  */
-static inline uint32_t get_first_free_bit(unsigned long *freemap,
-					  unsigned long size)
-{
-	uint32_t ino;
-
-	ino = find_first_bit(freemap, size);
-	if (ino == size)
-		return 0;
-
-	bitmap_clear(freemap, ino, 1);
+#define OUICHEFS_ALLOC_GROUP_BITS (OUICHEFS_BLOCK_SIZE * 8)
 
-	return ino;
-}
+/* Free blocks each CPU takes from the bitmap at once */
+#define OUICHEFS_ALLOC_RESERVE 16
 
-/*
- * Return an unused inode number and mark it used.
- * Return 0 if no free inode was found.
+/**
+ * struct ouichefs_alloc_group - allocation group of a free bitmap.
+ *
+ * @lock: protects the bits of the group and @hint.
+ * @hint: bit the next search of the group starts from, so that searches do
+ *	  not rescan the allocated part of the group (next fit).
  */
-static inline uint32_t get_free_inode(struct ouichefs_sb_info *sbi)
-{
-	uint32_t ret;
-
-	ret = get_first_free_bit(sbi->ifree_bitmap, sbi->nr_inodes);
-	if (ret) {
-		sbi->nr_free_inodes--;
-		pr_debug("%s:%d: allocated inode %u\n", __func__, __LINE__,
-			 ret);
-	}
-	return ret;
-}
+struct ouichefs_alloc_group {
+	spinlock_t lock;
+	unsigned long hint;
+} ____cacheline_aligned_in_smp;
 
-/*
- * Return an unused block number and mark it used.
- * Return 0 if no free block was found.
+/**
+ * struct ouichefs_alloc_cache - free blocks reserved by a CPU.
+ *
+ * @lock: protects the cache, only contended when it is drained.
+ * @first: index of the next block to hand out.
+ * @nr: number of blocks in @blocks, the reserved ones are [first, nr).
+ * @group: group the cache was last refilled from.
+ * @blocks: the reserved blocks, in the order they were found.
+ *
+ * Reserved blocks are cleared in the bitmap but still counted as free.
  */
-static inline uint32_t get_free_block(struct ouichefs_sb_info *sbi)
-{
-	uint32_t ret;
-
-	ret = get_first_free_bit(sbi->bfree_bitmap, sbi->nr_blocks);
-	if (ret) {
-		sbi->nr_free_blocks--;
-		pr_debug("%s:%d: allocated block %u\n", __func__, __LINE__,
-			 ret);
-	}
-	return ret;
-}
-
-/*
- * Mark the i-th bit in freemap as free (i.e. 1)
+struct ouichefs_alloc_cache {
+	spinlock_t lock;
+	unsigned int first;
+	unsigned int nr;
+	uint32_t group;
+	uint32_t blocks[OUICHEFS_ALLOC_RESERVE];
+};
+
+/**
+ * struct ouichefs_alloc - block and inode allocator of a superblock.
+ *
+ * @free_blocks: number of free blocks, reserved ones included.
+ * @free_inodes: number of free inodes.
+ * @nr_bgroups: number of groups of the block bitmap.
+ * @nr_igroups: number of groups of the inode bitmap.
+ * @bgroups: groups of the block bitmap.
+ * @igroups: groups of the inode bitmap.
+ * @cache: per-CPU block reservations.
  */
-static inline int put_free_bit(unsigned long *freemap, unsigned long size,
-			       uint32_t i)
-{
-	/* i is greater than freemap size */
-	if (i > size)
-		return -1;
-
-	bitmap_set(freemap, i, 1);
-
-	return 0;
-}
+struct ouichefs_alloc {
+	struct percpu_counter free_blocks;
+	struct percpu_counter free_inodes;
+	uint32_t nr_bgroups;
+	uint32_t nr_igroups;
+	struct ouichefs_alloc_group *bgroups;
+	struct ouichefs_alloc_group *igroups;
+	struct ouichefs_alloc_cache __percpu *cache;
+};
+
+int ouichefs_alloc_init(struct ouichefs_sb_info *sbi, uint32_t free_blocks,
+			uint32_t free_inodes);
+void ouichefs_alloc_destroy(struct ouichefs_sb_info *sbi);
+void ouichefs_alloc_drain(struct ouichefs_sb_info *sbi);
+void ouichefs_alloc_copy_bfree(struct ouichefs_sb_info *sbi, uint32_t block,
+			       void *dst);
+void ouichefs_alloc_copy_ifree(struct ouichefs_sb_info *sbi, uint32_t block,
+			       void *dst);
+
+uint32_t get_free_inode(struct ouichefs_sb_info *sbi);
+uint32_t get_free_block(struct ouichefs_sb_info *sbi);
+uint32_t get_free_block_goal(struct ouichefs_sb_info *sbi, uint32_t goal);
+uint32_t get_free_blocks(struct ouichefs_sb_info *sbi, uint32_t goal,
+			 uint32_t max, uint32_t *nr);
+void put_inode(struct ouichefs_sb_info *sbi, uint32_t ino);
+void put_block(struct ouichefs_sb_info *sbi, uint32_t bno);
 
 /*
- * Mark an inode as unused.
+ * Return the number of free blocks. The value may be off by a few blocks per
+ * CPU, which is fine for the eviction watermarks.
  */
-static inline void put_inode(struct ouichefs_sb_info *sbi, uint32_t ino)
+static inline uint32_t ouichefs_free_blocks(struct ouichefs_sb_info *sbi)
 {
-	if (put_free_bit(sbi->ifree_bitmap, sbi->nr_inodes, ino))
-		return;
-
-	sbi->nr_free_inodes++;
-	pr_debug("%s:%d: freed inode %u\n", __func__, __LINE__, ino);
+	return percpu_counter_read_positive(&sbi->alloc->free_blocks);
 }
 
 /*
- * Mark a block as unused.
+ * Return the number of free inodes, with the same precision.
  */
-static inline void put_block(struct ouichefs_sb_info *sbi, uint32_t bno)
+static inline uint32_t ouichefs_free_inodes(struct ouichefs_sb_info *sbi)
 {
-	if (put_free_bit(sbi->bfree_bitmap, sbi->nr_blocks, bno))
-		return;
-
-	sbi->nr_free_blocks++;
-	pr_debug("%s:%d: freed block %u\n", __func__, __LINE__, bno);
+	return percpu_counter_read_positive(&sbi->alloc->free_inodes);
 }
 
 #endif /* _OUICHEFS_BITMAP_H */
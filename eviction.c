@@ -8,41 +8,54 @@
 #include <linux/audit.h>
 #include <linux/security.h>
 #include <linux/mount.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+#include <linux/wait.h>
+#include <linux/ktime.h>
 
 #include "policy.h"
 #include "eviction.h"
 #include "ouichefs.h"
+#include "bitmap.h"
 
-static int is_threshold_met(struct inode *dir);
+static int is_threshold_met(struct super_block *sb);
 static int evict_file(struct inode *dir, struct inode *file);
 static struct dentry *inode_to_dentry(struct inode *, struct inode *);
 static char *get_name_of_inode(struct inode *dir, struct inode *inode);
-static struct inode *search_parent_inode_store(struct inode *inode);
-static struct inode *search_parent_isb(struct inode *, uint32_t);
-static bool dir_contains_ino(struct super_block *superblock,
-			     struct ouichefs_inode *dir, uint32_t ino);
 static u16 list_count(struct hlist_head *list);
 
 /**
- * Percentage threshold at which the eviction of a file is triggered.
+ * Maximum number of files chosen by a single pass of the policy.
  */
-const u16 eviction_threshhold = 20;
+#define EVICTION_BATCH_MAX 64
 
 /**
- * check_for_eviction - Checks the remaining space and evicts a file based on
- *		        the current policy, if a certin threshold is met.
+ * Maximum time a write waits for the reclaim worker when the file system is
+ * out of space.
+ */
+#define RECLAIM_THROTTLE_TIMEOUT (5 * HZ)
+
+/**
+ * check_for_eviction - Checks the remaining space and wakes the background
+ *			reclaim worker if the low watermark is crossed.
  *
  * @dir: Directory where a new node was created.
  *
+ * The eviction itself runs asynchronously, so this is cheap enough to be
+ * called on every create and write.
+ *
  * Return: EVICTION_NOT_NECESSARY if the general eviction was not necessary,
- *	   0 if it could be performed
- *	   and < 0 if the eviction was failed.
+ *	   0 if the reclaim worker was woken
+ *	   and < 0 if the threshold check failed.
  */
 int check_for_eviction(struct inode *dir)
 {
 	int errc = 0;
 
-	errc = is_threshold_met(dir);
+	if (!dir)
+		return -1;
+
+	errc = is_threshold_met(dir->i_sb);
 	if (errc == 0)
 		return EVICTION_NOT_NECESSARY;
 
@@ -51,85 +64,416 @@ int check_for_eviction(struct inode *dir)
 		return errc;
 	}
 
-	pr_debug("The threshold was met. Finding file to evict.\n");
+	pr_debug("The threshold was met. Waking reclaim worker.\n");
 
-	errc = trigger_eviction(dir->i_sb);
-	return errc;
+	ouichefs_reclaim_wake(dir->i_sb);
+	return 0;
 }
 
 /**
- * trigger_eviction - triggers the search for and eviction of a file based
- *		      on the current policy.
+ * reclaim_work_fn - runs a reclaim pass of the background worker.
  *
- * @dir: Directory where a new node was created.
+ * @work: reclaim work of the superblock.
  *
- * Return: 0 if it could be performed
- *	   and < 0 if the eviction was failed.
+ * A pass evicts a batch of files if the low watermark is crossed or if a
+ * writer is throttled, then wakes the throttled writers.
  */
-int trigger_eviction(struct super_block *sb)
+static void reclaim_work_fn(struct work_struct *work)
 {
-	int errc = 0;
-	struct inode *evict = get_file_to_evict(sb);
+	struct ouichefs_reclaim *rc =
+		container_of(work, struct ouichefs_reclaim, work);
+	u64 start = ktime_get_ns();
+
+	if (is_threshold_met(rc->sb) > 0 ||
+	    atomic_read(&rc->nr_throttled) > 0) {
+		if (trigger_eviction(rc->sb))
+			pr_debug("The reclaim pass did not evict any file.\n");
+	}
 
-	pr_debug("Found inode with ino %lu.\n", evict->i_ino);
+	atomic64_inc(&rc->nr_runs);
+	atomic64_add(ktime_get_ns() - start, &rc->runtime_ns);
 
-	if (!evict) {
-		pr_warn("Could not find a file to evict.\n");
-		return -1;
-	}
+	/* Let throttled writers check the free space again */
+	WRITE_ONCE(rc->seq, rc->seq + 1);
+	wake_up_all(&rc->wait);
+}
 
-	if (IS_ERR(evict)) {
-		pr_warn("get_file_to_evict return an error.\n");
-		return PTR_ERR(evict);
+/**
+ * ouichefs_reclaim_init - sets up the background reclaim worker of a
+ *			   superblock.
+ *
+ * @sb: superblock of the file system being mounted.
+ *
+ * Return: 0 on success, < 0 on error.
+ */
+int ouichefs_reclaim_init(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_reclaim *rc;
+
+	rc = kzalloc(sizeof(*rc), GFP_KERNEL);
+	if (!rc)
+		return -ENOMEM;
+
+	rc->sb = sb;
+	INIT_WORK(&rc->work, reclaim_work_fn);
+	init_waitqueue_head(&rc->wait);
+	spin_lock_init(&rc->lock);
+	sbi->reclaim = rc;
+
+	return 0;
+}
+
+/**
+ * ouichefs_reclaim_stop - stops the background reclaim worker of a
+ *			   superblock and waits for a running pass.
+ *
+ * @sb: superblock of the file system being unmounted.
+ *
+ * Must be called before the inodes of the superblock are evicted, since a
+ * running pass holds references to them.
+ */
+void ouichefs_reclaim_stop(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+
+	if (!sbi || !sbi->reclaim)
+		return;
+
+	/* Once stopped is set, wakeups cannot queue the work again */
+	spin_lock(&sbi->reclaim->lock);
+	WRITE_ONCE(sbi->reclaim->stopped, true);
+	spin_unlock(&sbi->reclaim->lock);
+	cancel_work_sync(&sbi->reclaim->work);
+}
+
+/**
+ * ouichefs_reclaim_destroy - frees the background reclaim worker of a
+ *			      superblock.
+ *
+ * @sb: superblock of the file system.
+ */
+void ouichefs_reclaim_destroy(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+
+	ouichefs_reclaim_stop(sb);
+	kfree(sbi->reclaim);
+	sbi->reclaim = NULL;
+}
+
+/**
+ * ouichefs_reclaim_wake - queues a reclaim pass on the background worker.
+ *
+ * @sb: superblock of the file system.
+ *
+ * Wakeups are coalesced while a pass is pending.
+ */
+void ouichefs_reclaim_wake(struct super_block *sb)
+{
+	struct ouichefs_reclaim *rc = OUICHEFS_SB(sb)->reclaim;
+
+	if (!rc)
+		return;
+
+	spin_lock(&rc->lock);
+	if (!rc->stopped && queue_work(system_unbound_wq, &rc->work))
+		atomic64_inc(&rc->nr_wakeups);
+	spin_unlock(&rc->lock);
+}
+
+/**
+ * ouichefs_reclaim_throttle - waits for the reclaim worker to free space if
+ *			       the file system is out of space.
+ *
+ * @sb: superblock of the file system.
+ * @nr_blocks: number of free blocks the caller needs.
+ *
+ * Only blocks if fewer than nr_blocks are free. Waits for at most one full
+ * reclaim pass, so callers holding locks the worker needs do not hang.
+ *
+ * Return: 0 if nr_blocks are free, -ENOSPC otherwise.
+ */
+int ouichefs_reclaim_throttle(struct super_block *sb, uint32_t nr_blocks)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_reclaim *rc = sbi->reclaim;
+	unsigned long seq;
+
+	if (ouichefs_free_blocks(sbi) >= nr_blocks)
+		return 0;
+	if (!rc || READ_ONCE(rc->stopped))
+		return -ENOSPC;
+
+	pr_debug("Out of space, waiting for the reclaim worker.\n");
+
+	atomic_inc(&rc->nr_throttled);
+	seq = READ_ONCE(rc->seq);
+	ouichefs_reclaim_wake(sb);
+	wait_event_killable_timeout(rc->wait,
+				    ouichefs_free_blocks(sbi) >= nr_blocks ||
+				    (READ_ONCE(rc->seq) != seq &&
+				     !work_pending(&rc->work)),
+				    RECLAIM_THROTTLE_TIMEOUT);
+	atomic_dec(&rc->nr_throttled);
+
+	return ouichefs_free_blocks(sbi) >= nr_blocks ? 0 : -ENOSPC;
+}
+
+/**
+ * account_eviction - updates the statistics with the outcome of an eviction.
+ *
+ * @sb: Superblock of the file system.
+ * @errc: Result of the eviction.
+ * @bytes: Size of the evicted file.
+ */
+static void account_eviction(struct super_block *sb, int errc, loff_t bytes)
+{
+	switch (errc) {
+	case 0:
+		ouichefs_stat_add(sb, OUICHEFS_STAT_FILES_EVICTED, 1);
+		ouichefs_stat_add(sb, OUICHEFS_STAT_BYTES_FREED, bytes);
+		break;
+	case -EBUSY:
+		ouichefs_stat_add(sb, OUICHEFS_STAT_FAIL_BUSY, 1);
+		break;
+	case -EIO:
+		ouichefs_stat_add(sb, OUICHEFS_STAT_FAIL_IO, 1);
+		break;
+	case -ENOENT:
+		ouichefs_stat_add(sb, OUICHEFS_STAT_FAIL_NO_PARENT, 1);
+		break;
+	default:
+		ouichefs_stat_add(sb, OUICHEFS_STAT_FAIL_OTHER, 1);
 	}
+}
 
-	if (!S_ISREG(evict->i_mode)) {
-		pr_warn("Eviction search did not return a reg file.\n");
-		errc = -1;
-		goto general_put;
+/**
+ * evict_victim - evicts a file chosen by the policy from its parent.
+ *
+ * @sb: Superblock of the file system.
+ * @evict: File to evict.
+ * @parent: Parent inode of the previous victim, replaced by the parent of
+ *	    this one if they differ.
+ *
+ * The parent is known from the back-pointer of the victim, consecutive
+ * victims of the same directory share its inode.
+ *
+ * Return: 0 if the file was evicted, < 0 otherwise.
+ */
+static int evict_victim(struct super_block *sb, struct inode *evict,
+			struct inode **parent)
+{
+	uint32_t parent_ino = ouichefs_index_parent(sb, evict->i_ino);
+	loff_t evicted_bytes = evict->i_size;
+	int errc;
+
+	pr_debug("Evicting inode with ino %lu.\n", evict->i_ino);
+
+	/* Do not look for files without a known parent in the root */
+	if (parent_ino == OUICHEFS_PARENT_UNKNOWN) {
+		pr_warn("Parent of inode %lu is unknown.\n", evict->i_ino);
+		ouichefs_stat_add(sb, OUICHEFS_STAT_FAIL_NO_PARENT, 1);
+		return -ENOENT;
 	}
 
-	struct inode *parent = search_parent_inode_store(evict);
+	if (!*parent || (*parent)->i_ino != parent_ino) {
+		if (*parent)
+			iput(*parent);
+		*parent = ouichefs_iget(sb, parent_ino);
+		if (IS_ERR(*parent)) {
+			pr_warn("Find parent return an error.\n");
+			ouichefs_stat_add(sb, OUICHEFS_STAT_FAIL_NO_PARENT, 1);
+			errc = PTR_ERR(*parent);
+			*parent = NULL;
+			return errc;
+		}
+	}
 
-	if (!parent) {
-		pr_warn("Could not find parent of file to evict.\n");
-		errc = -1;
-		goto general_put;
+	/*
+	 * Lock the parent and the victim as for an unlink. Busy files are
+	 * skipped rather than waited for, as the caller may already hold the
+	 * lock of a directory or file being written.
+	 */
+	if (!inode_trylock(*parent)) {
+		account_eviction(sb, -EBUSY, 0);
+		return -EBUSY;
 	}
-	if (IS_ERR(parent)) {
-		pr_warn("Find parent return an error.\n");
-		errc = PTR_ERR(parent);
-		goto general_put;
+	if (!inode_trylock(evict)) {
+		inode_unlock(*parent);
+		account_eviction(sb, -EBUSY, 0);
+		return -EBUSY;
 	}
 
-	loff_t evicted_bytes = evict->i_size;
+	errc = evict_file(*parent, evict);
+
+	inode_unlock(evict);
+	inode_unlock(*parent);
+	account_eviction(sb, errc, evicted_bytes);
 
-	errc = evict_file(parent, evict);
 	if (!errc)
 		pr_debug("Successfully evicted %lld bytes.\n", evicted_bytes);
 	else
 		pr_debug("An error occured in eviction.\n");
 
-	iput(parent);
-general_put:
-	iput(evict);
 	return errc;
 }
+
+/**
+ * ouichefs_evict_would_stall - Checks whether evicting a file would wait on
+ *				or throw away I/O.
+ *
+ * @inode: File to check.
+ *
+ * Mapped files are not checked here, they are busy and never evicted.
+ *
+ * Return: true if the file has dirty pages or pages under writeback.
+ */
+bool ouichefs_evict_would_stall(struct inode *inode)
+{
+	struct address_space *mapping = inode->i_mapping;
+
+	if (!mapping->nrpages)
+		return false;
+
+	return mapping_tagged(mapping, PAGECACHE_TAG_DIRTY) ||
+	       mapping_tagged(mapping, PAGECACHE_TAG_WRITEBACK);
+}
+
+/**
+ * evict_batch - evicts a batch of files chosen by the current policy.
+ *
+ * @sb: Superblock of the file system to evict from.
+ *
+ * The policy is asked for twice the blocks needed, so that victims with
+ * dirty pages or pages under writeback can be passed over for clean ones.
+ * They are only evicted, in policy order, if the clean victims do not reach
+ * the high watermark.
+ *
+ * Called with the eviction lock of the superblock held.
+ *
+ * Return: 0 if at least one file was evicted
+ *	   and < 0 if the eviction was failed.
+ */
+static int evict_batch(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	u32 target = ((u64)sbi->nr_blocks *
+		      READ_ONCE(sbi->evict_high_watermark)) / 100;
+	u32 needed = 1;
+	struct inode **victims;
+	struct inode *parent = NULL;
+	int errc = 0, nr, nr_stalled = 0, evicted = 0;
+	u64 start;
+
+	if (ouichefs_free_blocks(sbi) < target)
+		needed = target - ouichefs_free_blocks(sbi);
+
+	ouichefs_stat_add(sb, OUICHEFS_STAT_THRESHOLD_EVICTIONS, 1);
+
+	victims = kmalloc_array(EVICTION_BATCH_MAX, sizeof(*victims),
+				GFP_KERNEL);
+	if (!victims)
+		return -ENOMEM;
+
+	start = ktime_get_ns();
+	nr = get_files_to_evict(sb, victims, EVICTION_BATCH_MAX,
+				min_t(u64, 2ULL * needed, sbi->nr_blocks));
+	ouichefs_stats_hist_add(sb, OUICHEFS_HIST_SCAN, ktime_get_ns() - start);
+	if (nr < 0) {
+		pr_warn("get_files_to_evict return an error.\n");
+		errc = nr;
+		goto free_victims;
+	}
+	if (nr == 0) {
+		pr_warn("Could not find a file to evict.\n");
+		errc = -1;
+		goto free_victims;
+	}
+
+	for (int i = 0; i < nr; i++) {
+		/* Stop once the high watermark is reached */
+		if (evicted && ouichefs_free_blocks(sbi) >= target) {
+			iput(victims[i]);
+			continue;
+		}
+
+		/* Keep the victims that would stall for the second pass */
+		if (ouichefs_evict_would_stall(victims[i])) {
+			ouichefs_stat_add(sb, OUICHEFS_STAT_DEFERRED_DIRTY, 1);
+			victims[nr_stalled++] = victims[i];
+			continue;
+		}
+
+		errc = evict_victim(sb, victims[i], &parent);
+		if (!errc)
+			evicted++;
+		iput(victims[i]);
+	}
+
+	for (int i = 0; i < nr_stalled; i++) {
+		if (evicted && ouichefs_free_blocks(sbi) >= target) {
+			iput(victims[i]);
+			continue;
+		}
+
+		errc = evict_victim(sb, victims[i], &parent);
+		if (!errc)
+			evicted++;
+		iput(victims[i]);
+	}
+
+	if (parent)
+		iput(parent);
+
+	pr_debug("Evicted %d of %d files, %u blocks free.\n", evicted, nr,
+		 ouichefs_free_blocks(sbi));
+	if (evicted)
+		errc = 0;
+	else if (!errc)
+		errc = -1;
+
+free_victims:
+	kfree(victims);
+	return errc;
+}
+
+/**
+ * trigger_eviction - triggers the search for and eviction of a batch of files
+ *		      based on the current policy.
+ *
+ * @sb: Superblock of the file system to evict from.
+ *
+ * The victims are chosen in a single pass of the policy and evicted in order
+ * until the free blocks are back above the high watermark. At least one file
+ * is evicted. Batch evictions of a superblock are serialized, those of
+ * different superblocks run concurrently.
+ *
+ * Return: 0 if at least one file was evicted
+ *	   and < 0 if the eviction was failed.
+ */
+int trigger_eviction(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	int errc;
+
+	mutex_lock(&sbi->evict_lock);
+	errc = evict_batch(sb);
+	mutex_unlock(&sbi->evict_lock);
+
+	return errc;
+}
+
 /**
  * is_threshold_met - Checks whether the threshold for a general eviction
  * is met.
  *
- * @dir: Directory where a new node was created.
+ * @sb: Superblock of the file system.
  *
  * Return: 0 if threshold is not met, > 0 if it is met, < 0 on error.
  */
-static int is_threshold_met(struct inode *dir)
+static int is_threshold_met(struct super_block *sb)
 {
-	if (dir == NULL)
-		return -1;
-
-	struct super_block *sb = dir->i_sb;
-
 	if (sb == NULL)
 		return -1;
 
@@ -139,9 +483,9 @@ static int is_threshold_met(struct inode *dir)
 		return -1;
 
 
-	u32 threshold_number =
-		(sbi->nr_blocks * (eviction_threshhold)) / 100;
-	if (sbi->nr_free_blocks < threshold_number)
+	u32 threshold_number = ((u64)sbi->nr_blocks *
+				READ_ONCE(sbi->evict_low_watermark)) / 100;
+	if (ouichefs_free_blocks(sbi) < threshold_number)
 		return 1;
 
 	return 0;
@@ -158,6 +502,8 @@ static int is_threshold_met(struct inode *dir)
 int dir_eviction(struct inode *dir)
 {
 	int errc = 0;
+	u64 start = ktime_get_ns();
+	loff_t evicted_bytes;
 
 	/* Should we be locking dir? */
 	/* Module hangs if i try to */
@@ -169,13 +515,24 @@ int dir_eviction(struct inode *dir)
 		return errc;
 	}
 
+	ouichefs_stat_add(dir->i_sb, OUICHEFS_STAT_DIR_EVICTIONS, 1);
+
 	/* Check if dir_get_file_to_evict returned an error */
 	if (IS_ERR(remove)) {
 		long errc = PTR_ERR(remove);
+
+		account_eviction(dir->i_sb, errc, 0);
 		return errc;
 	}
 
+	/* Pinned files are never evicted, whatever picked them */
+	if (OUICHEFS_INODE(remove)->evict_class == OUICHEFS_EVICT_PINNED) {
+		iput(remove);
+		return ONLY_CONTAINS_DIR;
+	}
+
 	/* Check if the node is locked */
+	evicted_bytes = remove->i_size;
 	if (inode_is_locked(remove)) {
 		errc = -EBUSY;
 		goto dir_put;
@@ -186,6 +543,9 @@ int dir_eviction(struct inode *dir)
 
 dir_put:
 	iput(remove);
+	account_eviction(dir->i_sb, errc, evicted_bytes);
+	ouichefs_stats_hist_add(dir->i_sb, OUICHEFS_HIST_DIR_EVICTION,
+				ktime_get_ns() - start);
 	return errc;
 }
 
@@ -195,17 +555,18 @@ dir_put:
  * @parent: Parent directory of file.
  * @file: File to evict.
  *
- * Rerturn: 0 if the eviction was successful, < 0 if it failed.
+ * Rerturn: 0 if the eviction was successful, -EBUSY if the file is in use,
+ *	    -ENOENT if it is not in dir, < 0 if it failed otherwise.
  */
 static int evict_file(struct inode *dir, struct inode *file)
 {
 	if (!dir) {
 		pr_warn("The given parent is NULL.\n");
-		return -1;
+		return -EINVAL;
 	}
 	if (!file) {
 		pr_warn("The given file is NULL.\n");
-		return -1;
+		return -EINVAL;
 	}
 
 	u16 dentries_count = list_count(&file->i_dentry);
@@ -221,17 +582,27 @@ static int evict_file(struct inode *dir, struct inode *file)
 	 */
 	if (file->i_count.counter > dentries_count + 1) {
 		pr_warn("The file is still in use by another process.\n");
-		return -1;
+		return -EBUSY;
+	}
+
+	/* Unlinking would free blocks that mapped pages still write back to */
+	if (mapping_mapped(file->i_mapping)) {
+		pr_debug("The file is mapped in memory.\n");
+		return -EBUSY;
 	}
 
 	struct dentry *dentry = inode_to_dentry(dir, file);
 
-	if (!dentry || IS_ERR(dentry)) {
+	/* The file is not in the directory its parent pointer names */
+	if (!dentry) {
 		pr_warn("The dentry could not be found.\n");
-		return -1;
+		return -ENOENT;
 	}
+	if (IS_ERR(dentry))
+		return PTR_ERR(dentry);
 
-	int error = dir->i_op->unlink(dir, dentry);
+	/* Remembered by policies that track evicted files once it is gone */
+	int error = ouichefs_evict_unlink(dir, dentry);
 
 	if (error)
 		pr_err("(unlink): Could not unlink file.\n");
@@ -379,143 +750,6 @@ static char *get_name_of_inode(struct inode *dir, struct inode *inode)
 	return name;
 }
 
-/**
- * search_parent_inode_store - searches for the parent of a given inode in the
- *			       inode store
- *
- * @inode: inode for which to find the parent.
- *
- * Return: pointer to the parent if found, NULL otherwise.
- */
-static struct inode *search_parent_inode_store(struct inode *inode)
-{
-	if (!inode) {
-		pr_warn("The given inode was NULL.\n");
-		return NULL;
-	}
-
-	/* Search inode store for inode to evict */
-	struct super_block *superblock = inode->i_sb;
-	struct ouichefs_sb_info *sbi = OUICHEFS_SB(superblock);
-
-	pr_debug("Number of istore blocks: %d.\n", sbi->nr_istore_blocks);
-	for (int inode_block = 0; inode_block < sbi->nr_istore_blocks;
-		 inode_block++) {
-		pr_debug("Checking inode store block %d.\n", inode_block);
-		struct inode *parent = search_parent_isb(inode,
-							 inode_block + 1);
-		if (parent)
-			return parent;
-	}
-
-	return NULL;
-}
-/**
- * search_parent_isb - searches for the parent of an inode in a block of the
- *		       inode store
- *
- * @inode: inode of which to find the parent
- * @inode_block: index of the block in the inode store to search
- *
- * Return: pointer to the parent if it was found, NULL otherwise.
- */
-static struct inode *search_parent_isb(struct inode *inode,
-				       uint32_t inode_block)
-{
-	if (!inode)
-		return NULL;
-
-	if (inode_block < 1)
-		return NULL;
-
-	struct super_block *superblock = inode->i_sb;
-	struct buffer_head *bh = sb_bread(superblock, inode_block);
-
-	if (!bh)
-		return ERR_PTR(-EIO);
-
-	struct ouichefs_inode *disk_inode = (struct ouichefs_inode *)bh->b_data;
-	struct inode *parent = NULL;
-
-	uint32_t ino;
-	struct ouichefs_sb_info *sbi = OUICHEFS_SB(superblock);
-
-	istore_for_each_inode(ino, sbi, inode_block) {
-		pr_debug("Checking inode with ino %d\n", ino);
-		uint32_t inode_shift = ino -
-				(inode_block - 1) * OUICHEFS_INODES_PER_BLOCK;
-		struct ouichefs_inode *current_inode = disk_inode + inode_shift;
-
-		/* Something would be very wrong if this happened. */
-		if (!current_inode) {
-			pr_debug("Skipping NULL inode.\n");
-			continue;
-		}
-
-		/* Skip empty inodes */
-		if (current_inode->index_block == 0)
-			continue;
-
-
-		/* Only regular files can be evicted. */
-		if (!S_ISDIR(current_inode->i_mode))
-			continue;
-
-
-		if (dir_contains_ino(superblock, current_inode, inode->i_ino)) {
-			pr_debug("Found parent inode with ino %d.\n", ino);
-			parent = ouichefs_iget(superblock, ino);
-			break;
-		}
-	}
-
-	brelse(bh);
-	return parent;
-}
-
-/**
- * dir_contains_ino - checks whether an inode with given i_no is contained
- *		      in a given directory
- *
- * @superblock: superblock of directory and inode
- * @dir: directory to search
- * @ino: i_no of inode to search
- *
- * Return: true if the inode is contained, false otherwise.
- */
-static bool dir_contains_ino(struct super_block *superblock,
-			     struct ouichefs_inode *dir, uint32_t ino)
-{
-	if (!dir)
-		return false;
-
-	struct buffer_head *bh = sb_bread(superblock, dir->index_block);
-
-	if (!bh) {
-		pr_warn("could not read buffer head.\n");
-		return false;
-	}
-
-	bool contains = false;
-
-	struct ouichefs_dir_block *dblock =
-		(struct ouichefs_dir_block *)bh->b_data;
-
-	struct ouichefs_file *f = NULL;
-
-	for (int i = 0; i < OUICHEFS_MAX_SUBFILES; i++) {
-		f = &dblock->files[i];
-		if (!f->inode)
-			break;
-		if (f->inode == ino) {
-			contains = true;
-			break;
-		}
-	}
-	brelse(bh);
-	return contains;
-}
-
 /**
  *  list_count - counts the number of elements in a list
  *
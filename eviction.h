@@ -2,12 +2,265 @@
 #ifndef _OUICHEFS_EVICTION_H
 #define _OUICHEFS_EVICTION_H
 
+#include <linux/rbtree.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/wait.h>
+#include <linux/atomic.h>
+
+#include "policy.h"
+#include "ouichefs.h"
+
 #define ONLY_CONTAINS_DIR 1
 #define EVICTION_NOT_NECESSARY 2
 
+/* Default percentages of free blocks starting and ending a batch eviction */
+#define EVICTION_LOW_WATERMARK 20
+#define EVICTION_HIGH_WATERMARK 30
+
+/* Largest number of candidates the sampled eviction mode may draw */
+#define EVICTION_SAMPLE_MAX 4096
+
 int check_for_eviction(struct inode *dir);
 int dir_eviction(struct inode *dir);
 int trigger_eviction(struct super_block *sb);
+bool ouichefs_evict_would_stall(struct inode *inode);
+
+/**
+ * struct ouichefs_reclaim - background reclaim worker of a superblock.
+ *
+ * @sb: superblock to reclaim space from.
+ * @work: reclaim pass, queued when the low watermark is crossed.
+ * @wait: writers throttled until a pass frees enough space.
+ * @nr_throttled: number of throttled writers.
+ * @seq: incremented at the end of every pass.
+ * @lock: serializes queueing a pass with stopping the worker.
+ * @stopped: set at unmount under @lock, no more passes are queued.
+ * @nr_wakeups: number of passes queued.
+ * @nr_runs: number of passes run.
+ * @runtime_ns: total time spent in passes.
+ */
+struct ouichefs_reclaim {
+	struct super_block *sb;
+	struct work_struct work;
+	wait_queue_head_t wait;
+	atomic_t nr_throttled;
+	unsigned long seq;
+	spinlock_t lock;
+	bool stopped;
+	atomic64_t nr_wakeups;
+	atomic64_t nr_runs;
+	atomic64_t runtime_ns;
+};
+
+int ouichefs_reclaim_init(struct super_block *sb);
+void ouichefs_reclaim_stop(struct super_block *sb);
+void ouichefs_reclaim_destroy(struct super_block *sb);
+void ouichefs_reclaim_wake(struct super_block *sb);
+int ouichefs_reclaim_throttle(struct super_block *sb, uint32_t nr_blocks);
+
+/* Eviction counters of a superblock */
+enum ouichefs_stat {
+	OUICHEFS_STAT_THRESHOLD_EVICTIONS, /* Batch evictions run */
+	OUICHEFS_STAT_DIR_EVICTIONS, /* Evictions from a full directory */
+	OUICHEFS_STAT_FILES_EVICTED,
+	OUICHEFS_STAT_BYTES_FREED,
+	OUICHEFS_STAT_FAIL_BUSY, /* Victim or parent locked or in use */
+	OUICHEFS_STAT_FAIL_NO_PARENT, /* Parent or name of the victim not found */
+	OUICHEFS_STAT_FAIL_IO,
+	OUICHEFS_STAT_FAIL_OTHER,
+	OUICHEFS_STAT_INODES_SCANNED, /* Candidates looked at by a policy */
+	OUICHEFS_STAT_ISTORE_READS, /* Inode store blocks read by eviction */
+	OUICHEFS_STAT_DEFERRED_DIRTY, /* Victims passed over for dirty pages */
+	OUICHEFS_NR_STATS,
+};
+
+/* Latency histograms of a superblock */
+enum ouichefs_hist {
+	OUICHEFS_HIST_SCAN, /* Choosing the victims of a batch eviction */
+	OUICHEFS_HIST_DIR_EVICTION, /* A whole directory eviction */
+	OUICHEFS_NR_HISTS,
+};
+
+/* Buckets of a log2 latency histogram in microseconds */
+#define OUICHEFS_HIST_BUCKETS 24
+
+/**
+ * struct ouichefs_evict_stats - eviction statistics of a superblock.
+ *
+ * @counters: counters indexed by enum ouichefs_stat.
+ * @hists: log2 histograms indexed by enum ouichefs_hist.
+ * @debugfs: debugfs directory of the superblock.
+ */
+struct ouichefs_evict_stats {
+	atomic64_t counters[OUICHEFS_NR_STATS];
+	atomic64_t hists[OUICHEFS_NR_HISTS][OUICHEFS_HIST_BUCKETS];
+	struct dentry *debugfs;
+};
+
+int ouichefs_stats_init(struct super_block *sb);
+void ouichefs_stats_destroy(struct super_block *sb);
+void ouichefs_stats_register(void);
+void ouichefs_stats_unregister(void);
+void ouichefs_stats_hist_add(struct super_block *sb, enum ouichefs_hist hist,
+			     u64 ns);
+
+/**
+ * ouichefs_stat_add - adds to an eviction counter of a superblock.
+ *
+ * @sb: superblock of the file system.
+ * @stat: counter to add to.
+ * @n: value to add.
+ */
+static inline void ouichefs_stat_add(struct super_block *sb,
+				     enum ouichefs_stat stat, s64 n)
+{
+	struct ouichefs_evict_stats *stats = OUICHEFS_SB(sb)->stats;
+
+	if (stats)
+		atomic64_add(n, &stats->counters[stat]);
+}
+
+/**
+ * struct ouichefs_dir_child - regular-file child of a directory.
+ *
+ * @key: key of the child when it was sorted.
+ * @ino: inode number of the child.
+ * @rank: rank of the eviction class of the child.
+ */
+struct ouichefs_dir_child {
+	u64 key;
+	uint32_t ino;
+	int rank;
+};
+
+/**
+ * struct ouichefs_dir_order - children of a directory sorted by eviction
+ *			       class and policy key, the first one is evicted
+ *			       first. Pinned children are left out.
+ *
+ * @generation: policy generation the keys were computed with.
+ * @child_seq: child sequence of the directory when it was sorted.
+ * @nr: number of children, < 0 if the order needs to be rebuilt.
+ * @children: the children, in eviction order.
+ *
+ * Protected by the lock of the directory.
+ */
+struct ouichefs_dir_order {
+	unsigned int generation;
+	uint32_t child_seq;
+	int nr;
+	struct ouichefs_dir_child children[OUICHEFS_MAX_SUBFILES];
+};
+
+void ouichefs_dir_order_insert(struct inode *dir, struct inode *inode);
+void ouichefs_dir_order_remove(struct inode *dir, uint32_t ino);
+
+/**
+ * struct ouichefs_evict_entry - eviction candidate, one per inode number.
+ *
+ * @node: node in the index tree, empty if the inode is not a candidate.
+ * @key: key of the inode under the policy the index was keyed with.
+ * @summary: cached fields of the inode the policies rank by.
+ * @parent: inode number of the parent directory, OUICHEFS_PARENT_UNKNOWN if
+ *	    it is not known.
+ * @cand_pos: position of the inode in the candidate list, if it is in the
+ *	      tree.
+ * @child_seq: for directories, changed when a child moves forward in the
+ *	       eviction order.
+ */
+struct ouichefs_evict_entry {
+	struct rb_node node;
+	u64 key;
+	struct ouichefs_evict_summary summary;
+	uint32_t parent;
+	uint32_t cand_pos;
+	uint32_t child_seq;
+};
+
+/**
+ * struct ouichefs_evict_index - in-memory index of the eviction candidates
+ *				 of a superblock, sorted by policy key.
+ *
+ * @lock: protects the tree and the entries.
+ * @tree: regular files sorted by (class, key, ino), leftmost is the next
+ *	  victim. Pinned files are not in it.
+ * @entries: array of nr_inodes entries indexed by inode number.
+ * @nr_entries: number of entries in the array.
+ * @generation: policy generation the keys were computed with.
+ * @stale: set if some keys were not computed with @generation.
+ * @referenced: CLOCK reference bits indexed by inode number, set without
+ *		@lock on read, write and lookup.
+ * @candidates: bits of the inode numbers in @tree, for the CLOCK hand to
+ *		skip the other inodes.
+ * @cand_list: inode numbers of the entries in @tree in no particular order,
+ *	       to draw candidates uniformly in sampled mode.
+ * @nr_candidates: number of entries in @tree.
+ * @hand: next inode number the CLOCK hand looks at.
+ * @pinned_bytes: total size of the pinned regular files.
+ */
+struct ouichefs_evict_index {
+	struct mutex lock;
+	struct rb_root_cached tree;
+	struct ouichefs_evict_entry *entries;
+	uint32_t nr_entries;
+	unsigned int generation;
+	bool stale;
+	unsigned long *referenced;
+	unsigned long *candidates;
+	uint32_t *cand_list;
+	uint32_t nr_candidates;
+	uint32_t hand;
+	u64 pinned_bytes;
+};
+
+/**
+ * ouichefs_evict_class_rank - rank of an eviction class in the eviction
+ *			       order, preferred files come first.
+ */
+static inline int ouichefs_evict_class_rank(uint8_t evict_class)
+{
+	return evict_class == OUICHEFS_EVICT_PREFERRED ? 0 : 1;
+}
+
+struct ouichefs_inode;
+
+void ouichefs_disk_summary(struct ouichefs_sb_info *sbi,
+			   const struct ouichefs_inode *disk_inode,
+			   struct ouichefs_evict_summary *summary);
+void ouichefs_inode_summary(struct inode *inode,
+			    struct ouichefs_evict_summary *summary);
+
+int ouichefs_index_init(struct super_block *sb);
+void ouichefs_index_destroy(struct super_block *sb);
+void ouichefs_index_update(struct inode *inode);
+void ouichefs_index_remove(struct super_block *sb, uint32_t ino);
+bool ouichefs_index_summary(struct super_block *sb, uint32_t ino,
+			    struct ouichefs_evict_summary *summary);
+uint32_t ouichefs_index_parent(struct super_block *sb, uint32_t ino);
+void ouichefs_index_set_parent(struct super_block *sb, uint32_t ino,
+			       uint32_t parent);
+int ouichefs_index_collect(struct super_block *sb,
+			   u64 (*key)(const struct ouichefs_evict_summary *),
+			   unsigned int generation, uint32_t *inos, int max,
+			   uint32_t nr_blocks);
+int ouichefs_index_preferred(struct super_block *sb, uint32_t *inos, int max,
+			     uint32_t nr_blocks, uint32_t *blocks);
+uint8_t ouichefs_index_class(struct super_block *sb, uint32_t ino);
+int ouichefs_index_draw(struct super_block *sb, uint32_t *inos,
+			struct ouichefs_evict_summary *summaries, int nr);
+u64 ouichefs_index_pinned_bytes(struct super_block *sb);
+void ouichefs_index_for_each(struct super_block *sb,
+			     void (*fn)(struct super_block *sb, uint32_t ino,
+					void *data),
+			     void *data);
+uint32_t ouichefs_index_child_seq(struct super_block *sb, uint32_t dir);
+void ouichefs_index_reference(struct inode *inode);
+void ouichefs_index_access(struct inode *inode);
+bool ouichefs_index_referenced(struct inode *inode);
+int ouichefs_index_clock(struct super_block *sb, uint32_t *inos, int max,
+			 uint32_t nr_blocks);
 
 /**
  *  istore_for_each_inode - iterates over all (alive) inodes of a inode store.
@@ -19,8 +272,8 @@ int trigger_eviction(struct super_block *sb);
 #define istore_for_each_inode(ino, sbi, block_index)			  \
 for ((ino) = find_next_zero_bit((sbi)->ifree_bitmap,			  \
 			(sbi)->nr_inodes,				  \
-			((inode_block) - 1) * OUICHEFS_INODES_PER_BLOCK); \
-	((ino) < (block_index) * OUICHEFS_INODES_PER_BLOCK) &&		  \
+			((block_index) - 1) * OUICHEFS_INODES_PER_BLOCK(sbi)); \
+	((ino) < (block_index) * OUICHEFS_INODES_PER_BLOCK(sbi)) &&	  \
 	((ino) < (sbi)->nr_inodes);					  \
 	(ino) = find_next_zero_bit(sbi->ifree_bitmap,			  \
 			      sbi->nr_inodes,				  \
@@ -0,0 +1,856 @@
+// SPDX-License-Identifier: GPL-2.0
+#define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
+
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/rbtree.h>
+#include <linux/bitmap.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/random.h>
+#include <linux/timekeeping.h>
+
+#include "policy.h"
+#include "eviction.h"
+#include "ouichefs.h"
+
+/**
+ * ouichefs_disk_summary - fills an eviction summary from an on-disk inode.
+ *
+ * @sbi: superblock information of the inode.
+ * @disk_inode: inode read from the inode store.
+ * @summary: summary to fill.
+ */
+void ouichefs_disk_summary(struct ouichefs_sb_info *sbi,
+			   const struct ouichefs_inode *disk_inode,
+			   struct ouichefs_evict_summary *summary)
+{
+	summary->atime = le32_to_cpu(disk_inode->i_atime);
+	summary->mtime = le32_to_cpu(disk_inode->i_mtime);
+	summary->size = le32_to_cpu(disk_inode->i_size);
+	summary->blocks = le32_to_cpu(disk_inode->i_blocks);
+
+	/* Access counts are only persisted in extended inodes */
+	if (sbi->features & OUICHEFS_FEATURE_EXT_INODE) {
+		summary->freq = le32_to_cpu(disk_inode->i_freq);
+		summary->freq_epoch = le32_to_cpu(disk_inode->i_freq_epoch);
+		summary->evict_class = le32_to_cpu(disk_inode->i_evict_class);
+	} else {
+		summary->freq = 0;
+		summary->freq_epoch = 0;
+		summary->evict_class = OUICHEFS_EVICT_NORMAL;
+	}
+}
+
+/**
+ * ouichefs_inode_summary - fills an eviction summary from an in-memory inode.
+ *
+ * @inode: inode to summarize.
+ * @summary: summary to fill.
+ */
+void ouichefs_inode_summary(struct inode *inode,
+			    struct ouichefs_evict_summary *summary)
+{
+	summary->atime = inode->i_atime.tv_sec;
+	summary->mtime = inode->i_mtime.tv_sec;
+	summary->size = inode->i_size;
+	summary->blocks = inode->i_blocks;
+	summary->freq = READ_ONCE(OUICHEFS_INODE(inode)->freq);
+	summary->freq_epoch = READ_ONCE(OUICHEFS_INODE(inode)->freq_epoch);
+	summary->evict_class = READ_ONCE(OUICHEFS_INODE(inode)->evict_class);
+}
+
+/**
+ * entry_less - orders entries by class and key, ties are broken by inode
+ *		number.
+ */
+static bool entry_less(struct rb_node *a, const struct rb_node *b)
+{
+	const struct ouichefs_evict_entry *first =
+		rb_entry(a, struct ouichefs_evict_entry, node);
+	const struct ouichefs_evict_entry *second =
+		rb_entry(b, struct ouichefs_evict_entry, node);
+	int first_rank, second_rank;
+
+	first_rank = ouichefs_evict_class_rank(first->summary.evict_class);
+	second_rank = ouichefs_evict_class_rank(second->summary.evict_class);
+	if (first_rank != second_rank)
+		return first_rank < second_rank;
+	if (first->key != second->key)
+		return first->key < second->key;
+
+	/* Entries are stored by inode number in a single array */
+	return first < second;
+}
+
+/**
+ * index_insert - (re)inserts an entry in the tree with a new key.
+ *
+ * Note: We assume that the index is locked.
+ */
+static void index_insert(struct ouichefs_evict_index *idx,
+			 struct ouichefs_evict_entry *entry, u64 key)
+{
+	if (!RB_EMPTY_NODE(&entry->node)) {
+		rb_erase_cached(&entry->node, &idx->tree);
+	} else {
+		__set_bit(entry - idx->entries, idx->candidates);
+		entry->cand_pos = idx->nr_candidates;
+		idx->cand_list[idx->nr_candidates++] = entry - idx->entries;
+	}
+
+	entry->key = key;
+	rb_add_cached(&entry->node, &idx->tree, entry_less);
+}
+
+/**
+ * index_account - adds the size of a pinned file to the pinned bytes, or
+ *		   removes it.
+ *
+ * @idx: index of the file.
+ * @summary: summary of the file.
+ * @add: whether the file becomes pinned or stops being pinned.
+ *
+ * Note: We assume that the index is locked.
+ */
+static void index_account(struct ouichefs_evict_index *idx,
+			  const struct ouichefs_evict_summary *summary,
+			  bool add)
+{
+	if (summary->evict_class != OUICHEFS_EVICT_PINNED)
+		return;
+
+	if (add)
+		idx->pinned_bytes += summary->size;
+	else
+		idx->pinned_bytes -= summary->size;
+}
+
+/**
+ * index_erase - removes an entry from the tree if it is in it.
+ *
+ * Note: We assume that the index is locked.
+ */
+static void index_erase(struct ouichefs_evict_index *idx,
+			struct ouichefs_evict_entry *entry)
+{
+	uint32_t last;
+
+	if (RB_EMPTY_NODE(&entry->node))
+		return;
+
+	rb_erase_cached(&entry->node, &idx->tree);
+	RB_CLEAR_NODE(&entry->node);
+	__clear_bit(entry - idx->entries, idx->candidates);
+
+	/* Fill the hole in the candidate list with its last entry */
+	last = idx->cand_list[--idx->nr_candidates];
+	idx->cand_list[entry->cand_pos] = last;
+	idx->entries[last].cand_pos = entry->cand_pos;
+}
+
+/**
+ * index_rekey - recomputes the key of every candidate from its cached summary
+ *		 and rebuilds the tree. No inode is read from disk.
+ *
+ * Note: We assume that the index is locked.
+ */
+static void index_rekey(struct ouichefs_evict_index *idx,
+			u64 (*key)(const struct ouichefs_evict_summary *))
+{
+	struct ouichefs_evict_entry *entry, *next;
+	struct rb_root old = idx->tree.rb_root;
+
+	idx->tree = RB_ROOT_CACHED;
+
+	/*
+	 * Post-order visits children before their parent, so the next node
+	 * is always computed from links that have not been rewritten yet.
+	 */
+	rbtree_postorder_for_each_entry_safe(entry, next, &old, node) {
+		entry->key = key(&entry->summary);
+		rb_add_cached(&entry->node, &idx->tree, entry_less);
+	}
+}
+
+/**
+ * read_dir_parents - records a directory as the parent of all its children.
+ *
+ * @sb: superblock of the file system.
+ * @dir: inode number of the directory.
+ * @dir_inode: on-disk inode of the directory.
+ *
+ * Only needed for images without on-disk parent pointers.
+ *
+ * Return: 0 on success, < 0 on error.
+ */
+static int read_dir_parents(struct super_block *sb, uint32_t dir,
+			    const struct ouichefs_inode *dir_inode)
+{
+	struct ouichefs_evict_index *idx = OUICHEFS_SB(sb)->evict_index;
+	struct ouichefs_dir_block *dblock;
+	struct buffer_head *bh;
+
+	bh = sb_bread(sb, le32_to_cpu(dir_inode->index_block));
+	if (!bh)
+		return -EIO;
+	dblock = (struct ouichefs_dir_block *)bh->b_data;
+
+	for (int i = 0; i < OUICHEFS_MAX_SUBFILES; i++) {
+		uint32_t ino = dblock->files[i].inode;
+
+		if (!ino)
+			break;
+		if (ino < idx->nr_entries)
+			idx->entries[ino].parent = dir;
+	}
+	brelse(bh);
+
+	return 0;
+}
+
+/**
+ * ouichefs_index_init - builds the eviction index of a superblock by reading
+ *			 the inode store once.
+ *
+ * @sb: superblock of the file system being mounted.
+ *
+ * Return: 0 on success, < 0 on error.
+ */
+int ouichefs_index_init(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_evict_index *idx;
+	struct buffer_head *bh;
+	uint32_t inode_block, ino;
+	bool ext_inode = sbi->features & OUICHEFS_FEATURE_EXT_INODE;
+	int ret;
+
+	idx = kzalloc(sizeof(*idx), GFP_KERNEL);
+	if (!idx)
+		return -ENOMEM;
+
+	idx->entries = kvcalloc(sbi->nr_inodes, sizeof(*idx->entries),
+				GFP_KERNEL);
+	if (!idx->entries) {
+		kfree(idx);
+		return -ENOMEM;
+	}
+
+	idx->referenced = bitmap_zalloc(sbi->nr_inodes, GFP_KERNEL);
+	idx->candidates = bitmap_zalloc(sbi->nr_inodes, GFP_KERNEL);
+	idx->cand_list = kvmalloc_array(sbi->nr_inodes,
+					sizeof(*idx->cand_list), GFP_KERNEL);
+	if (!idx->referenced || !idx->candidates || !idx->cand_list) {
+		kvfree(idx->cand_list);
+		bitmap_free(idx->candidates);
+		bitmap_free(idx->referenced);
+		kvfree(idx->entries);
+		kfree(idx);
+		return -ENOMEM;
+	}
+
+	mutex_init(&idx->lock);
+	idx->tree = RB_ROOT_CACHED;
+	idx->nr_entries = sbi->nr_inodes;
+	for (ino = 0; ino < idx->nr_entries; ino++) {
+		RB_CLEAR_NODE(&idx->entries[ino].node);
+		idx->entries[ino].parent = OUICHEFS_PARENT_UNKNOWN;
+	}
+	sbi->evict_index = idx;
+
+	for (inode_block = 1; inode_block <= sbi->nr_istore_blocks;
+	     inode_block++) {
+		uint32_t first = (inode_block - 1) * OUICHEFS_INODES_PER_BLOCK(sbi);
+		uint32_t end = min_t(uint32_t, sbi->nr_inodes,
+				     first + OUICHEFS_INODES_PER_BLOCK(sbi));
+
+		/* Do not read blocks without any allocated inode */
+		if (find_next_zero_bit(sbi->ifree_bitmap, end, first) >= end)
+			continue;
+
+		bh = sb_bread(sb, inode_block);
+		if (!bh) {
+			ret = -EIO;
+			goto destroy;
+		}
+		ouichefs_stat_add(sb, OUICHEFS_STAT_ISTORE_READS, 1);
+
+		istore_for_each_inode(ino, sbi, inode_block) {
+			struct ouichefs_inode *cinode =
+				ouichefs_istore_inode(sbi, bh, ino);
+			struct ouichefs_evict_entry *entry;
+			umode_t mode = le32_to_cpu(cinode->i_mode);
+			u64 key = 0;
+
+			/* Skip empty inodes */
+			if (cinode->index_block == 0)
+				continue;
+
+			entry = &idx->entries[ino];
+			if (ext_inode)
+				entry->parent = le32_to_cpu(cinode->i_parent);
+
+			/* Older images only know parents from directories */
+			if (!ext_inode && S_ISDIR(mode)) {
+				ret = read_dir_parents(sb, ino, cinode);
+				if (ret) {
+					brelse(bh);
+					goto destroy;
+				}
+			}
+
+			/* Only regular files are evicted */
+			if (!S_ISREG(mode))
+				continue;
+
+			ouichefs_disk_summary(sbi, cinode, &entry->summary);
+			index_account(idx, &entry->summary, true);
+			if (entry->summary.evict_class == OUICHEFS_EVICT_PINNED)
+				continue;
+			if (!policy_key(sb, &entry->summary, &key,
+					&idx->generation))
+				idx->stale = true;
+			index_insert(idx, entry, key);
+		}
+		brelse(bh);
+	}
+
+	return 0;
+
+destroy:
+	ouichefs_index_destroy(sb);
+	return ret;
+}
+
+/**
+ * ouichefs_index_destroy - frees the eviction index of a superblock.
+ *
+ * @sb: superblock of the file system.
+ */
+void ouichefs_index_destroy(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_evict_index *idx = sbi->evict_index;
+
+	if (!idx)
+		return;
+
+	kvfree(idx->cand_list);
+	bitmap_free(idx->candidates);
+	bitmap_free(idx->referenced);
+	kvfree(idx->entries);
+	kfree(idx);
+	sbi->evict_index = NULL;
+}
+
+/**
+ * ouichefs_index_update - inserts a regular file in the eviction index or
+ *			   moves it to the position of its current key.
+ *
+ * @inode: inode that was created, written, accessed or whose eviction class
+ *	   changed.
+ *
+ * Pinned files are removed from the tree, but their summary is kept up to
+ * date for the pinned bytes.
+ */
+void ouichefs_index_update(struct inode *inode)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+	struct ouichefs_evict_index *idx = sbi->evict_index;
+	struct ouichefs_evict_summary summary;
+	struct ouichefs_evict_entry *entry;
+	unsigned int generation = 0;
+	u64 key = 0;
+	bool keyed;
+
+	if (!idx || !S_ISREG(inode->i_mode) || inode->i_ino >= idx->nr_entries)
+		return;
+
+	ouichefs_inode_summary(inode, &summary);
+	keyed = policy_key(inode->i_sb, &summary, &key, &generation);
+
+	mutex_lock(&idx->lock);
+	entry = &idx->entries[inode->i_ino];
+	index_account(idx, &entry->summary, false);
+	index_account(idx, &summary, true);
+	if (!keyed || generation != idx->generation)
+		idx->stale = true;
+
+	/* The sorted children of the parent are only invalid if it moves up */
+	if (entry->parent < idx->nr_entries &&
+	    (summary.evict_class != entry->summary.evict_class ||
+	     (!RB_EMPTY_NODE(&entry->node) &&
+	      (idx->stale || key < entry->key))))
+		idx->entries[entry->parent].child_seq++;
+	entry->summary = summary;
+	if (summary.evict_class == OUICHEFS_EVICT_PINNED)
+		index_erase(idx, entry);
+	else
+		index_insert(idx, entry, key);
+	mutex_unlock(&idx->lock);
+}
+
+/**
+ * ouichefs_index_remove - removes an inode from the eviction index.
+ *
+ * @sb: superblock of the inode.
+ * @ino: inode number of the removed inode.
+ */
+void ouichefs_index_remove(struct super_block *sb, uint32_t ino)
+{
+	struct ouichefs_evict_index *idx = OUICHEFS_SB(sb)->evict_index;
+
+	if (!idx || ino >= idx->nr_entries)
+		return;
+
+	mutex_lock(&idx->lock);
+	index_erase(idx, &idx->entries[ino]);
+	index_account(idx, &idx->entries[ino].summary, false);
+	idx->entries[ino].summary.evict_class = OUICHEFS_EVICT_NORMAL;
+	mutex_unlock(&idx->lock);
+	clear_bit(ino, idx->referenced);
+}
+
+/**
+ * ouichefs_index_summary - gets the cached summary of an eviction candidate.
+ *
+ * @sb: superblock of the inode.
+ * @ino: inode number of the inode.
+ * @summary: set to the cached summary of the inode.
+ *
+ * Return: true if the inode is a candidate, false otherwise.
+ */
+bool ouichefs_index_summary(struct super_block *sb, uint32_t ino,
+			    struct ouichefs_evict_summary *summary)
+{
+	struct ouichefs_evict_index *idx = OUICHEFS_SB(sb)->evict_index;
+	bool found = false;
+
+	if (!idx || ino >= idx->nr_entries)
+		return false;
+
+	mutex_lock(&idx->lock);
+	if (!RB_EMPTY_NODE(&idx->entries[ino].node)) {
+		*summary = idx->entries[ino].summary;
+		found = true;
+	}
+	mutex_unlock(&idx->lock);
+
+	return found;
+}
+EXPORT_SYMBOL(ouichefs_index_summary);
+
+/**
+ * ouichefs_index_parent - gets the parent directory of an inode.
+ *
+ * @sb: superblock of the inode.
+ * @ino: inode number of the inode.
+ *
+ * Return: inode number of the parent directory, OUICHEFS_PARENT_UNKNOWN if it
+ * is not known.
+ */
+uint32_t ouichefs_index_parent(struct super_block *sb, uint32_t ino)
+{
+	struct ouichefs_evict_index *idx = OUICHEFS_SB(sb)->evict_index;
+	uint32_t parent;
+
+	if (!idx || ino >= idx->nr_entries)
+		return OUICHEFS_PARENT_UNKNOWN;
+
+	mutex_lock(&idx->lock);
+	parent = idx->entries[ino].parent;
+	mutex_unlock(&idx->lock);
+
+	return parent;
+}
+
+/**
+ * ouichefs_index_set_parent - records the parent directory of an inode.
+ *
+ * @sb: superblock of the inode.
+ * @ino: inode number of the inode.
+ * @parent: inode number of the new parent directory.
+ *
+ * Note: The caller is responsible for marking the inode dirty so that the
+ * on-disk back-pointer is updated.
+ */
+void ouichefs_index_set_parent(struct super_block *sb, uint32_t ino,
+			       uint32_t parent)
+{
+	struct ouichefs_evict_index *idx = OUICHEFS_SB(sb)->evict_index;
+
+	if (!idx || ino >= idx->nr_entries)
+		return;
+
+	mutex_lock(&idx->lock);
+	idx->entries[ino].parent = parent;
+	mutex_unlock(&idx->lock);
+}
+
+/**
+ * ouichefs_index_collect - gets the next files to evict from the index.
+ *
+ * @sb: superblock of the file system.
+ * @key: key function of the current policy.
+ * @generation: generation of the current policy.
+ * @inos: array filled with the inode numbers of the files to evict.
+ * @max: size of the inos array.
+ * @nr_blocks: number of blocks the files should free together.
+ *
+ * If the index was keyed with another policy, all keys are recomputed from
+ * the cached summaries first. The files are collected in eviction order
+ * until they cover nr_blocks or max files were found.
+ *
+ * Return: number of inode numbers in inos.
+ */
+int ouichefs_index_collect(struct super_block *sb,
+			   u64 (*key)(const struct ouichefs_evict_summary *),
+			   unsigned int generation, uint32_t *inos, int max,
+			   uint32_t nr_blocks)
+{
+	struct ouichefs_evict_index *idx = OUICHEFS_SB(sb)->evict_index;
+	struct ouichefs_evict_entry *entry;
+	struct rb_node *node;
+	uint32_t blocks = 0;
+	int nr = 0;
+
+	if (!idx)
+		return 0;
+
+	mutex_lock(&idx->lock);
+	if (idx->stale || idx->generation != generation) {
+		pr_debug("Rekeying eviction index.\n");
+		index_rekey(idx, key);
+		idx->generation = generation;
+		idx->stale = false;
+	}
+
+	for (node = rb_first_cached(&idx->tree); node && nr < max;
+	     node = rb_next(node)) {
+		entry = rb_entry(node, struct ouichefs_evict_entry, node);
+		inos[nr++] = entry - idx->entries;
+
+		blocks += entry->summary.blocks;
+		if (blocks >= nr_blocks)
+			break;
+	}
+	mutex_unlock(&idx->lock);
+	ouichefs_stat_add(sb, OUICHEFS_STAT_INODES_SCANNED, nr);
+
+	return nr;
+}
+
+/**
+ * ouichefs_index_preferred - gets the preferred files to evict from the index.
+ *
+ * @sb: superblock of the file system.
+ * @inos: array filled with the inode numbers of the preferred files.
+ * @max: size of the inos array.
+ * @nr_blocks: number of blocks the files should free together.
+ * @blocks: set to the number of blocks of the files.
+ *
+ * Preferred files are the first ones in the tree whatever the keys, so they
+ * are found without rekeying the index. Used by the policies that choose
+ * their victims themselves.
+ *
+ * Return: number of inode numbers in inos.
+ */
+int ouichefs_index_preferred(struct super_block *sb, uint32_t *inos, int max,
+			     uint32_t nr_blocks, uint32_t *blocks)
+{
+	struct ouichefs_evict_index *idx = OUICHEFS_SB(sb)->evict_index;
+	struct ouichefs_evict_entry *entry;
+	struct rb_node *node;
+	int nr = 0;
+
+	*blocks = 0;
+	if (!idx)
+		return 0;
+
+	mutex_lock(&idx->lock);
+	for (node = rb_first_cached(&idx->tree);
+	     node && nr < max && *blocks < nr_blocks; node = rb_next(node)) {
+		entry = rb_entry(node, struct ouichefs_evict_entry, node);
+		if (entry->summary.evict_class != OUICHEFS_EVICT_PREFERRED)
+			break;
+
+		inos[nr++] = entry - idx->entries;
+		*blocks += entry->summary.blocks;
+	}
+	mutex_unlock(&idx->lock);
+
+	return nr;
+}
+
+/**
+ * ouichefs_index_class - gets the eviction class of a regular file.
+ *
+ * @sb: superblock of the file.
+ * @ino: inode number of the file.
+ *
+ * Return: the class of the file, normal for inodes that are not regular files.
+ */
+uint8_t ouichefs_index_class(struct super_block *sb, uint32_t ino)
+{
+	struct ouichefs_evict_index *idx = OUICHEFS_SB(sb)->evict_index;
+
+	if (!idx || ino >= idx->nr_entries)
+		return OUICHEFS_EVICT_NORMAL;
+
+	return READ_ONCE(idx->entries[ino].summary.evict_class);
+}
+
+/**
+ * ouichefs_index_pinned_bytes - gets the total size of the pinned files.
+ *
+ * @sb: superblock of the file system.
+ */
+u64 ouichefs_index_pinned_bytes(struct super_block *sb)
+{
+	struct ouichefs_evict_index *idx = OUICHEFS_SB(sb)->evict_index;
+	u64 bytes;
+
+	if (!idx)
+		return 0;
+
+	mutex_lock(&idx->lock);
+	bytes = idx->pinned_bytes;
+	mutex_unlock(&idx->lock);
+
+	return bytes;
+}
+
+/**
+ * ouichefs_index_for_each - calls a function for every eviction candidate, in
+ *			     eviction order.
+ *
+ * @sb: superblock of the file system.
+ * @fn: function to call, must not sleep or use the index.
+ * @data: passed to fn.
+ *
+ * The order is the one of the last keys computed, which may belong to a
+ * previous policy of the mount.
+ */
+void ouichefs_index_for_each(struct super_block *sb,
+			     void (*fn)(struct super_block *sb, uint32_t ino,
+					void *data),
+			     void *data)
+{
+	struct ouichefs_evict_index *idx = OUICHEFS_SB(sb)->evict_index;
+	struct ouichefs_evict_entry *entry;
+	struct rb_node *node;
+
+	if (!idx)
+		return;
+
+	mutex_lock(&idx->lock);
+	for (node = rb_first_cached(&idx->tree); node; node = rb_next(node)) {
+		entry = rb_entry(node, struct ouichefs_evict_entry, node);
+		fn(sb, entry - idx->entries, data);
+	}
+	mutex_unlock(&idx->lock);
+}
+
+/**
+ * ouichefs_index_child_seq - gets the child sequence of a directory.
+ *
+ * @sb: superblock of the directory.
+ * @dir: inode number of the directory.
+ *
+ * Return: the child sequence, which changes when a child of the directory
+ *	   moves forward in the eviction order.
+ */
+uint32_t ouichefs_index_child_seq(struct super_block *sb, uint32_t dir)
+{
+	struct ouichefs_evict_index *idx = OUICHEFS_SB(sb)->evict_index;
+	uint32_t seq;
+
+	if (!idx || dir >= idx->nr_entries)
+		return 0;
+
+	mutex_lock(&idx->lock);
+	seq = idx->entries[dir].child_seq;
+	mutex_unlock(&idx->lock);
+
+	return seq;
+}
+
+/**
+ * ouichefs_index_draw - draws random eviction candidates.
+ *
+ * @sb: superblock of the file system.
+ * @inos: array filled with the inode numbers of the drawn candidates.
+ * @summaries: array filled with the summaries of the drawn candidates.
+ * @nr: number of candidates to draw.
+ *
+ * The candidates are drawn uniformly and without replacement from the files
+ * in the index, pinned files excluded, by a partial shuffle of the candidate
+ * list. The summaries are the ones the index is keyed with.
+ *
+ * Return: number of candidates drawn, less than nr if the index has fewer.
+ */
+int ouichefs_index_draw(struct super_block *sb, uint32_t *inos,
+			struct ouichefs_evict_summary *summaries, int nr)
+{
+	struct ouichefs_evict_index *idx = OUICHEFS_SB(sb)->evict_index;
+	uint32_t *list;
+
+	if (!idx)
+		return 0;
+
+	mutex_lock(&idx->lock);
+	list = idx->cand_list;
+	nr = min_t(uint32_t, nr, idx->nr_candidates);
+	for (int i = 0; i < nr; i++) {
+		uint32_t pick;
+
+		pick = i + get_random_u32_below(idx->nr_candidates - i);
+
+		swap(list[i], list[pick]);
+		idx->entries[list[i]].cand_pos = i;
+		idx->entries[list[pick]].cand_pos = pick;
+
+		inos[i] = list[i];
+		summaries[i] = idx->entries[list[i]].summary;
+	}
+	mutex_unlock(&idx->lock);
+
+	return nr;
+}
+
+/**
+ * ouichefs_index_reference - sets the CLOCK reference bit of an inode.
+ *
+ * @inode: inode that was read, written or looked up.
+ *
+ * The inode is not dirtied, the bit only lives in memory.
+ */
+void ouichefs_index_reference(struct inode *inode)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+	struct ouichefs_evict_index *idx = sbi->evict_index;
+
+	if (!idx || inode->i_ino >= idx->nr_entries)
+		return;
+
+	/* Avoid dirtying the cache line of hot files */
+	if (!test_bit(inode->i_ino, idx->referenced))
+		set_bit(inode->i_ino, idx->referenced);
+}
+
+/**
+ * ouichefs_index_access - counts an access to a regular file for the
+ *			   frequency-based policies.
+ *
+ * @inode: inode that was read or written.
+ *
+ * The count is halved every OUICHEFS_FREQ_PERIOD seconds and updated without
+ * locks, so concurrent accesses may be counted once. The inode is only
+ * dirtied and moved in the index when a new period starts or the count
+ * reaches a power of two, so hot files do not pay for it on every access.
+ */
+void ouichefs_index_access(struct inode *inode)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	uint32_t now = div_u64(ktime_get_real_seconds(), OUICHEFS_FREQ_PERIOD);
+	uint32_t epoch = READ_ONCE(ci->freq_epoch);
+	uint32_t freq = READ_ONCE(ci->freq);
+
+	if (!S_ISREG(inode->i_mode))
+		return;
+
+	/* Do not age the count backwards if the clock was set back */
+	if (now < epoch)
+		now = epoch;
+	freq = policy_freq_decay(freq, now - epoch);
+	if (freq < OUICHEFS_FREQ_MAX)
+		freq++;
+
+	WRITE_ONCE(ci->freq, freq);
+	WRITE_ONCE(ci->freq_epoch, now);
+	if (now == epoch && !is_power_of_2(freq))
+		return;
+
+	mark_inode_dirty(inode);
+	ouichefs_index_update(inode);
+}
+
+/**
+ * ouichefs_index_referenced - tests the CLOCK reference bit of an inode.
+ *
+ * @inode: inode to test.
+ *
+ * Return: true if the inode was referenced since the hand last passed it.
+ */
+bool ouichefs_index_referenced(struct inode *inode)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+	struct ouichefs_evict_index *idx = sbi->evict_index;
+
+	if (!idx || inode->i_ino >= idx->nr_entries)
+		return false;
+
+	return test_bit(inode->i_ino, idx->referenced);
+}
+
+/**
+ * ouichefs_index_clock - gets the next files to evict with the CLOCK hand.
+ *
+ * @sb: superblock of the file system.
+ * @inos: array filled with the inode numbers of the files to evict.
+ * @max: size of the inos array.
+ * @nr_blocks: number of blocks the files should free together.
+ *
+ * The hand sweeps the candidates in inode number order, skipping the other
+ * inodes with the candidate bitmap. A referenced file gets a second chance:
+ * its bit is cleared and the hand moves on. The sweep stops when the files
+ * cover nr_blocks, max files were found, or the hand comes back to the first
+ * file it picked.
+ *
+ * Return: number of inode numbers in inos.
+ */
+int ouichefs_index_clock(struct super_block *sb, uint32_t *inos, int max,
+			 uint32_t nr_blocks)
+{
+	struct ouichefs_evict_index *idx = OUICHEFS_SB(sb)->evict_index;
+	struct ouichefs_evict_entry *entry;
+	uint32_t ino, blocks = 0;
+	u64 scanned, limit;
+	int nr = 0;
+
+	if (!idx)
+		return 0;
+
+	mutex_lock(&idx->lock);
+	/* Two turns: the first one may only clear reference bits */
+	limit = 2ULL * idx->nr_candidates;
+	for (scanned = 0; scanned < limit && nr < max; scanned++) {
+		ino = find_next_bit(idx->candidates, idx->nr_entries,
+				    idx->hand);
+		if (ino >= idx->nr_entries)
+			ino = find_first_bit(idx->candidates,
+					     idx->nr_entries);
+		idx->hand = ino + 1 < idx->nr_entries ? ino + 1 : 0;
+		entry = &idx->entries[ino];
+
+		/* Do not pick the same file twice */
+		if (nr && ino == inos[0])
+			break;
+
+		if (test_and_clear_bit(ino, idx->referenced))
+			continue;
+
+		inos[nr++] = ino;
+		blocks += entry->summary.blocks;
+		if (blocks >= nr_blocks)
+			break;
+	}
+	mutex_unlock(&idx->lock);
+	ouichefs_stat_add(sb, OUICHEFS_STAT_INODES_SCANNED, scanned);
+
+	return nr;
+}
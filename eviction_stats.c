@@ -0,0 +1,153 @@
+// SPDX-License-Identifier: GPL-2.0
+#define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
+
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+
+#include "eviction.h"
+#include "ouichefs.h"
+
+/* Directory holding the statistics of every mount in debugfs */
+static struct dentry *ouichefs_debugfs_root;
+
+static const char * const stat_names[OUICHEFS_NR_STATS] = {
+	[OUICHEFS_STAT_THRESHOLD_EVICTIONS] = "threshold_evictions",
+	[OUICHEFS_STAT_DIR_EVICTIONS] = "dir_evictions",
+	[OUICHEFS_STAT_FILES_EVICTED] = "files_evicted",
+	[OUICHEFS_STAT_BYTES_FREED] = "bytes_freed",
+	[OUICHEFS_STAT_FAIL_BUSY] = "failed_busy",
+	[OUICHEFS_STAT_FAIL_NO_PARENT] = "failed_no_parent",
+	[OUICHEFS_STAT_FAIL_IO] = "failed_io",
+	[OUICHEFS_STAT_FAIL_OTHER] = "failed_other",
+	[OUICHEFS_STAT_INODES_SCANNED] = "inodes_scanned",
+	[OUICHEFS_STAT_ISTORE_READS] = "istore_blocks_read",
+	[OUICHEFS_STAT_DEFERRED_DIRTY] = "deferred_dirty",
+};
+
+static const char * const hist_names[OUICHEFS_NR_HISTS] = {
+	[OUICHEFS_HIST_SCAN] = "victim_scan_us",
+	[OUICHEFS_HIST_DIR_EVICTION] = "dir_eviction_us",
+};
+
+/**
+ * ouichefs_stats_hist_add - records a duration in a latency histogram.
+ *
+ * @sb: superblock of the file system.
+ * @hist: histogram to record the duration in.
+ * @ns: duration in nanoseconds.
+ *
+ * Bucket 0 counts durations below 1us, bucket i > 0 durations in
+ * [2^(i-1), 2^i) us. The last bucket also counts all longer durations.
+ */
+void ouichefs_stats_hist_add(struct super_block *sb, enum ouichefs_hist hist,
+			     u64 ns)
+{
+	struct ouichefs_evict_stats *stats = OUICHEFS_SB(sb)->stats;
+	u64 us = div_u64(ns, NSEC_PER_USEC);
+	int bucket = 0;
+
+	if (!stats)
+		return;
+
+	if (us)
+		bucket = min_t(int, ilog2(us) + 1, OUICHEFS_HIST_BUCKETS - 1);
+	atomic64_inc(&stats->hists[hist][bucket]);
+}
+
+static int stats_show(struct seq_file *m, void *v)
+{
+	struct ouichefs_evict_stats *stats = m->private;
+
+	for (int i = 0; i < OUICHEFS_NR_STATS; i++)
+		seq_printf(m, "%s: %lld\n", stat_names[i],
+			   atomic64_read(&stats->counters[i]));
+
+	for (int i = 0; i < OUICHEFS_NR_HISTS; i++) {
+		seq_printf(m, "%s:\n", hist_names[i]);
+		for (int b = 0; b < OUICHEFS_HIST_BUCKETS; b++) {
+			s64 count = atomic64_read(&stats->hists[i][b]);
+
+			if (!count)
+				continue;
+			if (!b)
+				seq_printf(m, "  [0, 1): %lld\n", count);
+			else if (b == OUICHEFS_HIST_BUCKETS - 1)
+				seq_printf(m, "  [%llu, inf): %lld\n",
+					   1ULL << (b - 1), count);
+			else
+				seq_printf(m, "  [%llu, %llu): %lld\n",
+					   1ULL << (b - 1), 1ULL << b, count);
+		}
+	}
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(stats);
+
+/**
+ * ouichefs_stats_init - allocates the eviction statistics of a superblock and
+ *			 exposes them in debugfs.
+ *
+ * @sb: superblock of the file system being mounted.
+ *
+ * The statistics are shown in /sys/kernel/debug/ouichefs/<device>/stats.
+ *
+ * Return: 0 on success, < 0 on error.
+ */
+int ouichefs_stats_init(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_evict_stats *stats;
+
+	stats = kzalloc(sizeof(*stats), GFP_KERNEL);
+	if (!stats)
+		return -ENOMEM;
+
+	/* debugfs is optional, failures are not reported */
+	stats->debugfs = debugfs_create_dir(sb->s_id, ouichefs_debugfs_root);
+	debugfs_create_file("stats", 0444, stats->debugfs, stats,
+			    &stats_fops);
+	sbi->stats = stats;
+
+	return 0;
+}
+
+/**
+ * ouichefs_stats_destroy - removes and frees the eviction statistics of a
+ *			    superblock.
+ *
+ * @sb: superblock of the file system.
+ */
+void ouichefs_stats_destroy(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+
+	if (!sbi->stats)
+		return;
+
+	debugfs_remove(sbi->stats->debugfs);
+	kfree(sbi->stats);
+	sbi->stats = NULL;
+}
+
+/**
+ * ouichefs_stats_register - creates the debugfs directory of the module.
+ */
+void ouichefs_stats_register(void)
+{
+	ouichefs_debugfs_root = debugfs_create_dir("ouichefs", NULL);
+}
+
+/**
+ * ouichefs_stats_unregister - removes the debugfs directory of the module.
+ */
+void ouichefs_stats_unregister(void)
+{
+	debugfs_remove(ouichefs_debugfs_root);
+	ouichefs_debugfs_root = NULL;
+}
@@ -0,0 +1,853 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * ouiche_fs - a simple educational filesystem for Linux
+ *
+ * Block mapping of regular files. With OUICHEFS_FEATURE_EXTENTS, the index
+ * block of a file holds a sorted list of extents, chained to more extent
+ * blocks when it is full. Older images keep one block number per block in
+ * the index block.
+ *
+ * Whatever the layout, the map is cached in the inode as a sorted array of
+ * extents. Lookups only use the cache, the index is read when the cache is
+ * first loaded and written when blocks are added or freed.
+ */
+
+#define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
+
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/iomap.h>
+
+#include "ouichefs.h"
+#include "bitmap.h"
+#include "extent.h"
+
+/* Last logical block of a file, bound by the 32-bit i_size */
+#define OUICHEFS_EXTENT_MAX_BLOCK \
+	(OUICHEFS_MAX_FILESIZE_EXTENTS / OUICHEFS_BLOCK_SIZE)
+
+/* Last logical block of a file mapped by a block array */
+#define OUICHEFS_ARRAY_MAX_BLOCK ((OUICHEFS_BLOCK_SIZE >> 2) - 1)
+
+/* Initial capacity of the cached map */
+#define OUICHEFS_MAP_MIN 16
+
+static inline uint32_t extent_count(struct ouichefs_extent_block *eb)
+{
+	return min_t(uint32_t, eb->nr_extents, OUICHEFS_EXTENTS_PER_BLOCK);
+}
+
+static inline uint32_t map_max_block(struct inode *inode)
+{
+	if (ouichefs_has_extents(OUICHEFS_SB(inode->i_sb)))
+		return OUICHEFS_EXTENT_MAX_BLOCK;
+	return OUICHEFS_ARRAY_MAX_BLOCK;
+}
+
+/*
+ * Return the index of the first cached extent starting after iblock.
+ */
+static uint32_t cache_find(struct ouichefs_inode_info *ci, uint32_t iblock)
+{
+	uint32_t lo = 0, hi = ci->map_nr;
+
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+
+		if (ci->map[mid].ee_block <= iblock)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/*
+ * Add a run of len blocks to the cached map, merging it with its neighbours
+ * when they are contiguous.
+ */
+static int cache_add(struct ouichefs_inode_info *ci, uint32_t iblock,
+		     uint32_t bno, uint32_t len)
+{
+	uint32_t pos = cache_find(ci, iblock);
+	struct ouichefs_extent *prev = pos ? &ci->map[pos - 1] : NULL;
+	struct ouichefs_extent *succ = pos < ci->map_nr ? &ci->map[pos] : NULL;
+
+	if (prev && prev->ee_block + prev->ee_len == iblock &&
+	    prev->ee_start + prev->ee_len == bno) {
+		prev->ee_len += len;
+		/* The run may close the gap to the next extent */
+		if (succ && prev->ee_block + prev->ee_len == succ->ee_block &&
+		    prev->ee_start + prev->ee_len == succ->ee_start) {
+			prev->ee_len += succ->ee_len;
+			memmove(succ, succ + 1,
+				(ci->map_nr - pos - 1) * sizeof(*succ));
+			ci->map_nr--;
+		}
+		return 0;
+	}
+	if (succ && iblock + len == succ->ee_block &&
+	    bno + len == succ->ee_start) {
+		succ->ee_block = iblock;
+		succ->ee_start = bno;
+		succ->ee_len += len;
+		return 0;
+	}
+
+	if (ci->map_nr == ci->map_max) {
+		uint32_t max = max_t(uint32_t, OUICHEFS_MAP_MIN,
+				     2 * ci->map_max);
+		struct ouichefs_extent *map;
+
+		map = kvmalloc_array(max, sizeof(*map), GFP_NOFS);
+		if (!map)
+			return -ENOMEM;
+		if (ci->map)
+			memcpy(map, ci->map, ci->map_nr * sizeof(*map));
+		kvfree(ci->map);
+		ci->map = map;
+		ci->map_max = max;
+	}
+
+	memmove(&ci->map[pos + 1], &ci->map[pos],
+		(ci->map_nr - pos) * sizeof(*ci->map));
+	ci->map[pos].ee_block = iblock;
+	ci->map[pos].ee_start = bno;
+	ci->map[pos].ee_len = len;
+	ci->map_nr++;
+
+	return 0;
+}
+
+/*
+ * Drop the blocks from logical block from on from the cached map.
+ */
+static void cache_cut(struct ouichefs_inode_info *ci, uint32_t from)
+{
+	uint32_t pos = cache_find(ci, from);
+
+	if (pos) {
+		struct ouichefs_extent *prev = &ci->map[pos - 1];
+
+		if (prev->ee_block + prev->ee_len > from)
+			prev->ee_len = from - prev->ee_block;
+		if (!prev->ee_len)
+			pos--;
+	}
+	ci->map_nr = pos;
+}
+
+/*
+ * Read the index of a file into its cached map. Called with map_sem held
+ * for writing.
+ */
+static int cache_load(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct buffer_head *bh;
+	uint32_t next = ci->index_block;
+	int ret = 0;
+
+	ci->map_nr = 0;
+	ci->map_chained = 0;
+
+	if (!ouichefs_has_extents(OUICHEFS_SB(sb))) {
+		struct ouichefs_file_index_block *index;
+
+		bh = sb_bread(sb, ci->index_block);
+		if (!bh)
+			return -EIO;
+		index = (struct ouichefs_file_index_block *)bh->b_data;
+		for (uint32_t i = 0; i <= OUICHEFS_ARRAY_MAX_BLOCK && !ret; i++)
+			if (index->blocks[i])
+				ret = cache_add(ci, i, index->blocks[i], 1);
+		brelse(bh);
+		goto out;
+	}
+
+	while (next && !ret) {
+		struct ouichefs_extent_block *eb;
+
+		bh = sb_bread(sb, next);
+		if (!bh) {
+			ret = -EIO;
+			break;
+		}
+		eb = (struct ouichefs_extent_block *)bh->b_data;
+		for (uint32_t i = 0; i < extent_count(eb) && !ret; i++)
+			ret = cache_add(ci, eb->extents[i].ee_block,
+					eb->extents[i].ee_start,
+					eb->extents[i].ee_len);
+		next = eb->next;
+		if (next)
+			ci->map_chained++;
+		brelse(bh);
+	}
+
+out:
+	ci->map_loaded = !ret;
+	return ret;
+}
+
+/*
+ * Take map_sem for reading, with the cached map of the file loaded.
+ */
+static int map_read_lock(struct inode *inode)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	int ret = 0;
+
+	down_read(&ci->map_sem);
+	if (likely(ci->map_loaded))
+		return 0;
+	up_read(&ci->map_sem);
+
+	down_write(&ci->map_sem);
+	if (!ci->map_loaded)
+		ret = cache_load(inode);
+	if (ret) {
+		up_write(&ci->map_sem);
+		return ret;
+	}
+	downgrade_write(&ci->map_sem);
+
+	return 0;
+}
+
+/*
+ * Look iblock up in the cached map, see ouichefs_extent_map(). Called with
+ * map_sem held and the map loaded.
+ */
+static void cache_lookup(struct inode *inode, uint32_t iblock, uint32_t *bno,
+			 uint32_t *len, uint32_t *goal)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	uint32_t pos, prev_goal = 0;
+
+	*bno = 0;
+	*len = 0;
+
+	pos = cache_find(ci, iblock);
+	if (pos) {
+		struct ouichefs_extent *ext = &ci->map[pos - 1];
+
+		if (iblock < ext->ee_block + ext->ee_len) {
+			*bno = ext->ee_start + iblock - ext->ee_block;
+			*len = ext->ee_block + ext->ee_len - iblock;
+		} else {
+			prev_goal = ext->ee_start + iblock - ext->ee_block;
+		}
+	}
+	if (!*bno) {
+		/* A hole after the last extent lasts until the end of file */
+		if (pos < ci->map_nr)
+			*len = ci->map[pos].ee_block - iblock;
+		else
+			*len = map_max_block(inode) - iblock + 1;
+	}
+
+	if (goal)
+		*goal = prev_goal;
+}
+
+/**
+ * ouichefs_extent_map - maps a logical block of a file.
+ *
+ * @inode: regular file.
+ * @iblock: logical block to map.
+ * @bno: set to the physical block, 0 if iblock is not allocated.
+ * @len: set to the number of blocks from iblock that are mapped contiguously,
+ *	 or that are not mapped if iblock is not.
+ * @goal: if not NULL, set to the physical block iblock would have if the
+ *	  extent before it went on, 0 if there is none.
+ *
+ * Return: 0 on success, < 0 on error.
+ */
+int ouichefs_extent_map(struct inode *inode, uint32_t iblock, uint32_t *bno,
+			uint32_t *len, uint32_t *goal)
+{
+	int ret;
+
+	*bno = 0;
+	*len = 0;
+
+	ret = map_read_lock(inode);
+	if (ret)
+		return ret;
+	cache_lookup(inode, iblock, bno, len, goal);
+	up_read(&OUICHEFS_INODE(inode)->map_sem);
+
+	return 0;
+}
+
+/*
+ * Move the upper half of the full extent block bh to a new block chained
+ * right after it. Return the new block, or NULL on error.
+ */
+static struct buffer_head *extent_split(struct inode *inode,
+					struct buffer_head *bh)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_extent_block *eb, *neb;
+	struct buffer_head *nbh;
+	uint32_t half = OUICHEFS_EXTENTS_PER_BLOCK / 2, nr, nb;
+
+	nb = get_free_block_goal(sbi, bh->b_blocknr + 1);
+	if (!nb)
+		return NULL;
+	nbh = sb_getblk(sb, nb);
+	if (!nbh) {
+		put_block(sbi, nb);
+		return NULL;
+	}
+
+	eb = (struct ouichefs_extent_block *)bh->b_data;
+	nr = extent_count(eb);
+
+	lock_buffer(nbh);
+	neb = (struct ouichefs_extent_block *)nbh->b_data;
+	memset(neb, 0, OUICHEFS_BLOCK_SIZE);
+	neb->nr_extents = nr - half;
+	neb->next = eb->next;
+	memcpy(neb->extents, &eb->extents[half],
+	       (nr - half) * sizeof(struct ouichefs_extent));
+	set_buffer_uptodate(nbh);
+	unlock_buffer(nbh);
+	mark_buffer_dirty(nbh);
+
+	memset(&eb->extents[half], 0,
+	       (nr - half) * sizeof(struct ouichefs_extent));
+	eb->nr_extents = half;
+	eb->next = nb;
+	mark_buffer_dirty(bh);
+	OUICHEFS_INODE(inode)->map_chained++;
+
+	return nbh;
+}
+
+/*
+ * Add a run to the extent blocks of a file. The run is merged into the
+ * extent before or after it when they are contiguous. A full extent block is
+ * split in two.
+ */
+static int chain_insert(struct inode *inode, uint32_t iblock, uint32_t bno,
+			uint32_t len)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_extent new = {
+		.ee_block = iblock,
+		.ee_start = bno,
+		.ee_len = len,
+	};
+	struct ouichefs_extent *prev = NULL, *succ = NULL;
+	struct ouichefs_extent_block *eb = NULL;
+	struct buffer_head *bh = NULL, *prev_bh = NULL, *nbh;
+	uint32_t next = ci->index_block, nr = 0, pos = 0;
+	int ret = 0;
+
+	/* Find the block and the position the run goes to */
+	while (next) {
+		brelse(prev_bh);
+		prev_bh = bh;
+		bh = sb_bread(inode->i_sb, next);
+		if (!bh) {
+			ret = -EIO;
+			goto out;
+		}
+		eb = (struct ouichefs_extent_block *)bh->b_data;
+		nr = extent_count(eb);
+		for (pos = 0; pos < nr && eb->extents[pos].ee_block < iblock;
+		     pos++)
+			;
+		if (pos < nr || !eb->next)
+			break;
+		next = eb->next;
+	}
+	if (!bh) {
+		ret = -EIO;
+		goto out;
+	}
+
+	/* Extend a neighbour if the run is contiguous with it */
+	if (pos) {
+		prev = &eb->extents[pos - 1];
+	} else if (prev_bh) {
+		struct ouichefs_extent_block *peb =
+			(struct ouichefs_extent_block *)prev_bh->b_data;
+
+		if (extent_count(peb))
+			prev = &peb->extents[extent_count(peb) - 1];
+	}
+	if (pos < nr)
+		succ = &eb->extents[pos];
+
+	if (prev && prev->ee_block + prev->ee_len == iblock &&
+	    prev->ee_start + prev->ee_len == bno) {
+		prev->ee_len += len;
+		mark_buffer_dirty(pos ? bh : prev_bh);
+		goto out;
+	}
+	if (succ && iblock + len == succ->ee_block &&
+	    bno + len == succ->ee_start) {
+		succ->ee_block = iblock;
+		succ->ee_start = bno;
+		succ->ee_len += len;
+		mark_buffer_dirty(bh);
+		goto out;
+	}
+
+	if (nr == OUICHEFS_EXTENTS_PER_BLOCK) {
+		nbh = extent_split(inode, bh);
+		if (!nbh) {
+			ret = -ENOSPC;
+			goto out;
+		}
+		if (pos > eb->nr_extents) {
+			pos -= eb->nr_extents;
+			brelse(bh);
+			bh = nbh;
+			eb = (struct ouichefs_extent_block *)bh->b_data;
+		} else {
+			brelse(nbh);
+		}
+		nr = eb->nr_extents;
+	}
+
+	memmove(&eb->extents[pos + 1], &eb->extents[pos],
+		(nr - pos) * sizeof(struct ouichefs_extent));
+	eb->extents[pos] = new;
+	eb->nr_extents = nr + 1;
+	mark_buffer_dirty(bh);
+
+out:
+	brelse(bh);
+	brelse(prev_bh);
+	return ret;
+}
+
+/*
+ * Add a run to the block array of a file.
+ */
+static int array_insert(struct inode *inode, uint32_t iblock, uint32_t bno,
+			uint32_t len)
+{
+	struct ouichefs_file_index_block *index;
+	struct buffer_head *bh;
+
+	bh = sb_bread(inode->i_sb, OUICHEFS_INODE(inode)->index_block);
+	if (!bh)
+		return -EIO;
+	index = (struct ouichefs_file_index_block *)bh->b_data;
+
+	for (uint32_t i = 0; i < len; i++)
+		index->blocks[iblock + i] = bno + i;
+
+	mark_buffer_dirty(bh);
+	brelse(bh);
+	return 0;
+}
+
+/*
+ * Add a run to the index of a file and to its cached map. Called with map_sem
+ * held for writing.
+ */
+static int extent_insert_locked(struct inode *inode, uint32_t iblock,
+				uint32_t bno, uint32_t len)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	int ret;
+
+	if (ouichefs_has_extents(OUICHEFS_SB(inode->i_sb)))
+		ret = chain_insert(inode, iblock, bno, len);
+	else
+		ret = array_insert(inode, iblock, bno, len);
+
+	/* Reload the cached map from the index if it cannot follow */
+	if (!ret && ci->map_loaded && cache_add(ci, iblock, bno, len))
+		ci->map_loaded = false;
+	return ret;
+}
+
+/**
+ * ouichefs_extent_insert - maps len blocks of a file starting at a logical
+ *			    block to physical blocks starting at bno.
+ *
+ * @inode: regular file.
+ * @iblock: first logical block, not mapped yet.
+ * @bno: first physical block.
+ * @len: number of blocks.
+ *
+ * Return: 0 on success, < 0 on error.
+ */
+int ouichefs_extent_insert(struct inode *inode, uint32_t iblock, uint32_t bno,
+			   uint32_t len)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	int ret;
+
+	down_write(&ci->map_sem);
+	ret = extent_insert_locked(inode, iblock, bno, len);
+	up_write(&ci->map_sem);
+
+	return ret;
+}
+
+/*
+ * Give len blocks starting at start back to the allocator, zeroing them first
+ * if scrub is set.
+ */
+static void extent_free(struct super_block *sb, uint32_t start, uint32_t len,
+			bool scrub)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+
+	for (uint32_t i = 0; i < len; i++) {
+		struct buffer_head *bh;
+
+		if (scrub) {
+			bh = sb_getblk(sb, start + i);
+			if (bh) {
+				lock_buffer(bh);
+				memset(bh->b_data, 0, OUICHEFS_BLOCK_SIZE);
+				set_buffer_uptodate(bh);
+				unlock_buffer(bh);
+				mark_buffer_dirty(bh);
+				brelse(bh);
+			}
+		}
+		put_block(sbi, start + i);
+	}
+}
+
+/*
+ * Free the blocks of a file from logical block from on, in its extent blocks.
+ * Extent blocks left empty are freed, except for the index block.
+ */
+static int chain_truncate(struct inode *inode, uint32_t from, bool scrub)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_extent_block *eb;
+	struct buffer_head *bh, *prev_bh = NULL;
+	uint32_t next = ci->index_block;
+	bool cut = false;
+	int ret = 0;
+
+	while (next) {
+		uint32_t nr, i;
+
+		bh = sb_bread(sb, next);
+		if (!bh) {
+			ret = -EIO;
+			break;
+		}
+		eb = (struct ouichefs_extent_block *)bh->b_data;
+		nr = extent_count(eb);
+
+		/* Past the cut, whole extent blocks go */
+		if (cut) {
+			for (i = 0; i < nr; i++)
+				extent_free(sb, eb->extents[i].ee_start,
+					    eb->extents[i].ee_len, scrub);
+			next = eb->next;
+			memset(eb, 0, OUICHEFS_BLOCK_SIZE);
+			mark_buffer_dirty(bh);
+			put_block(OUICHEFS_SB(sb), bh->b_blocknr);
+			ci->map_chained--;
+			brelse(bh);
+			continue;
+		}
+
+		for (i = 0; i < nr; i++) {
+			struct ouichefs_extent *ext = &eb->extents[i];
+			uint32_t keep;
+
+			if (ext->ee_block + ext->ee_len <= from)
+				continue;
+			cut = true;
+			if (ext->ee_block < from) {
+				keep = from - ext->ee_block;
+				extent_free(sb, ext->ee_start + keep,
+					    ext->ee_len - keep, scrub);
+				ext->ee_len = keep;
+				i++;
+			}
+			break;
+		}
+
+		next = eb->next;
+		if (cut) {
+			for (uint32_t j = i; j < nr; j++)
+				extent_free(sb, eb->extents[j].ee_start,
+					    eb->extents[j].ee_len, scrub);
+			memset(&eb->extents[i], 0,
+			       (nr - i) * sizeof(struct ouichefs_extent));
+			eb->nr_extents = i;
+			eb->next = 0;
+			mark_buffer_dirty(bh);
+
+			/* Unchain an overflow block left empty */
+			if (!i && prev_bh) {
+				struct ouichefs_extent_block *peb =
+					(struct ouichefs_extent_block *)
+						prev_bh->b_data;
+
+				peb->next = 0;
+				mark_buffer_dirty(prev_bh);
+				put_block(OUICHEFS_SB(sb), bh->b_blocknr);
+				ci->map_chained--;
+			}
+		}
+		brelse(prev_bh);
+		prev_bh = bh;
+	}
+	brelse(prev_bh);
+
+	return ret;
+}
+
+/*
+ * Free the blocks of a file from logical block from on, in its block array.
+ */
+static int array_truncate(struct inode *inode, uint32_t from, bool scrub)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_file_index_block *index;
+	struct buffer_head *bh;
+
+	bh = sb_bread(sb, OUICHEFS_INODE(inode)->index_block);
+	if (!bh)
+		return -EIO;
+	index = (struct ouichefs_file_index_block *)bh->b_data;
+
+	for (uint32_t i = from; i <= OUICHEFS_ARRAY_MAX_BLOCK; i++) {
+		if (!index->blocks[i])
+			continue;
+		extent_free(sb, index->blocks[i], 1, scrub);
+		index->blocks[i] = 0;
+	}
+
+	mark_buffer_dirty(bh);
+	brelse(bh);
+	return 0;
+}
+
+/**
+ * ouichefs_extent_truncate - frees the blocks of a file from a logical block
+ *			      on.
+ *
+ * @inode: regular file.
+ * @from: first logical block to free.
+ * @scrub: zero the freed blocks.
+ *
+ * Return: 0 on success, < 0 on error.
+ */
+int ouichefs_extent_truncate(struct inode *inode, uint32_t from, bool scrub)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	int ret;
+
+	down_write(&ci->map_sem);
+	if (ouichefs_has_extents(OUICHEFS_SB(inode->i_sb)))
+		ret = chain_truncate(inode, from, scrub);
+	else
+		ret = array_truncate(inode, from, scrub);
+
+	/* A partly truncated index is read again */
+	if (ret)
+		ci->map_loaded = false;
+	else if (ci->map_loaded)
+		cache_cut(ci, from);
+	up_write(&ci->map_sem);
+
+	return ret;
+}
+
+/**
+ * ouichefs_extent_release - frees the cached map of an inode.
+ *
+ * @inode: inode being destroyed.
+ */
+void ouichefs_extent_release(struct inode *inode)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+
+	kvfree(ci->map);
+	ci->map = NULL;
+	ci->map_nr = 0;
+	ci->map_max = 0;
+	ci->map_chained = 0;
+	ci->map_loaded = false;
+}
+
+/**
+ * ouichefs_extent_meta_blocks - counts the blocks holding the map of a file.
+ *
+ * @inode: regular file.
+ *
+ * Return: 1 for the index block, plus the extent blocks chained to it. Only
+ * the index block is counted if the chain cannot be read.
+ */
+uint32_t ouichefs_extent_meta_blocks(struct inode *inode)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	uint32_t nr;
+
+	if (map_read_lock(inode))
+		return 1;
+	nr = 1 + ci->map_chained;
+	up_read(&ci->map_sem);
+
+	return nr;
+}
+
+/*
+ * Map up to max blocks of inode from iblock on into bno and len, bno is 0 for
+ * a hole. If create is true, holes are filled with a contiguous run placed
+ * right after the physical block of the logical block before iblock, so that
+ * sequential writes extend the same extent, and new is set.
+ *
+ * The hole is looked up again, allocated and inserted under map_sem held for
+ * writing: buffered writes, O_DIRECT writes and page_mkwrite() do not share a
+ * lock and may fill the same hole at once.
+ */
+static int map_blocks(struct inode *inode, uint32_t iblock, uint32_t max,
+		      bool create, uint32_t *bno, uint32_t *len, bool *new)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	uint32_t goal;
+	int ret;
+
+	*new = false;
+	ret = ouichefs_extent_map(inode, iblock, bno, len, NULL);
+	if (ret)
+		return ret;
+
+	*len = clamp_t(uint32_t, *len, 1, max);
+	if (*bno || !create)
+		return 0;
+
+	down_write(&ci->map_sem);
+	if (!ci->map_loaded) {
+		ret = cache_load(inode);
+		if (ret)
+			goto out;
+	}
+	cache_lookup(inode, iblock, bno, len, &goal);
+	*len = clamp_t(uint32_t, *len, 1, max);
+	if (*bno)
+		goto out;
+
+	if (!goal)
+		goal = ci->index_block + 1;
+	*bno = get_free_blocks(sbi, goal, *len, len);
+	if (!*bno) {
+		ret = -ENOSPC;
+		goto out;
+	}
+	ret = extent_insert_locked(inode, iblock, *bno, *len);
+	if (ret) {
+		for (uint32_t i = 0; i < *len; i++)
+			put_block(sbi, *bno + i);
+		*bno = 0;
+		goto out;
+	}
+	*new = true;
+
+out:
+	up_write(&ci->map_sem);
+	return ret;
+}
+
+/**
+ * ouichefs_extent_get_block - get_block_t of regular files.
+ *
+ * @inode: regular file.
+ * @iblock: first logical block to map.
+ * @bh_result: buffer_head to map, b_size is the most the caller can take.
+ * @create: allocate the blocks if they are not mapped yet.
+ *
+ * Maps as many blocks as b_size covers while they are contiguous on disk and
+ * sets b_size to what was mapped, see map_blocks().
+ *
+ * Return: 0 on success, < 0 on error.
+ */
+int ouichefs_extent_get_block(struct inode *inode, sector_t iblock,
+			      struct buffer_head *bh_result, int create)
+{
+	uint32_t bno, len, max, max_block = map_max_block(inode);
+	bool new;
+	int ret;
+
+	if (iblock > max_block)
+		return -EFBIG;
+
+	max = min_t(u64, bh_result->b_size >> inode->i_blkbits,
+		    max_block - iblock + 1);
+	ret = map_blocks(inode, iblock, max, create, &bno, &len, &new);
+	if (ret || !bno)
+		return ret;
+
+	if (new)
+		set_buffer_new(bh_result);
+	map_bh(bh_result, inode->i_sb, bno);
+	bh_result->b_size = (size_t)len << inode->i_blkbits;
+	return 0;
+}
+
+/*
+ * iomap_begin of regular files, used by O_DIRECT. Maps the blocks covering
+ * [pos, pos + length) while they are contiguous on disk, and allocates the
+ * holes of a write like ouichefs_extent_get_block().
+ */
+static int ouichefs_iomap_begin(struct inode *inode, loff_t pos, loff_t length,
+				unsigned int flags, struct iomap *iomap,
+				struct iomap *srcmap)
+{
+	uint32_t bno, len, max, max_block = map_max_block(inode);
+	u64 iblock = pos >> inode->i_blkbits;
+	u64 last = (pos + length - 1) >> inode->i_blkbits;
+	bool new;
+	int ret;
+
+	if (iblock > max_block)
+		return -EFBIG;
+
+	max = min_t(u64, last, max_block) - iblock + 1;
+	ret = map_blocks(inode, iblock, max, flags & IOMAP_WRITE, &bno, &len,
+			 &new);
+	if (ret)
+		return ret;
+
+	/*
+	 * Freed blocks are scrubbed through the block device cache. Drop any
+	 * buffer left there before the direct write lands, or its writeback
+	 * would overwrite the new data later on.
+	 */
+	if (new)
+		clean_bdev_aliases(inode->i_sb->s_bdev, bno, len);
+
+	iomap->flags = new ? IOMAP_F_NEW : 0;
+	iomap->bdev = inode->i_sb->s_bdev;
+	iomap->offset = iblock << inode->i_blkbits;
+	iomap->length = (u64)len << inode->i_blkbits;
+	if (bno) {
+		iomap->type = IOMAP_MAPPED;
+		iomap->addr = (u64)bno << inode->i_blkbits;
+	} else {
+		iomap->type = IOMAP_HOLE;
+		iomap->addr = IOMAP_NULL_ADDR;
+	}
+	return 0;
+}
+
+const struct iomap_ops ouichefs_iomap_ops = {
+	.iomap_begin = ouichefs_iomap_begin,
+};
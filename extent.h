@@ -0,0 +1,30 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _OUICHEFS_EXTENT_H
+#define _OUICHEFS_EXTENT_H
+
+#include <linux/iomap.h>
+
+#include "ouichefs.h"
+
+/*
+ * Return true if the regular files of sbi are mapped by extents instead of a
+ * block array.
+ */
+static inline bool ouichefs_has_extents(struct ouichefs_sb_info *sbi)
+{
+	return sbi->features & OUICHEFS_FEATURE_EXTENTS;
+}
+
+int ouichefs_extent_map(struct inode *inode, uint32_t iblock, uint32_t *bno,
+			uint32_t *len, uint32_t *goal);
+int ouichefs_extent_insert(struct inode *inode, uint32_t iblock, uint32_t bno,
+			   uint32_t len);
+int ouichefs_extent_truncate(struct inode *inode, uint32_t from, bool scrub);
+void ouichefs_extent_release(struct inode *inode);
+uint32_t ouichefs_extent_meta_blocks(struct inode *inode);
+int ouichefs_extent_get_block(struct inode *inode, sector_t iblock,
+			      struct buffer_head *bh_result, int create);
+
+extern const struct iomap_ops ouichefs_iomap_ops;
+
+#endif /* _OUICHEFS_EXTENT_H */
@@ -10,64 +10,40 @@
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/fs.h>
+#include <linux/mm.h>
 #include <linux/buffer_head.h>
 #include <linux/mpage.h>
+#include <linux/mount.h>
+#include <linux/uaccess.h>
+#include <linux/capability.h>
+#include <linux/iomap.h>
+#include <linux/splice.h>
 
 #include "ouichefs.h"
 #include "eviction.h"
 #include "bitmap.h"
+#include "extent.h"
 
 /*
  * Map the buffer_head passed in argument with the iblock-th block of the file
- * represented by inode. If the requested block is not allocated and create is
- * true, allocate a new block on disk and map it.
+ * represented by inode, and as many of the following blocks as
+ * bh_result->b_size covers while they are contiguous on disk. If the block is
+ * not allocated and create is true, allocate it. The block map is cached in
+ * the inode, see extent.c.
  */
 static int ouichefs_file_get_block(struct inode *inode, sector_t iblock,
 				   struct buffer_head *bh_result, int create)
 {
-	struct super_block *sb = inode->i_sb;
-	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
-	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
-	struct ouichefs_file_index_block *index;
-	struct buffer_head *bh_index;
-	int ret = 0, bno;
-
-	/* If block number exceeds filesize, fail */
-	if (iblock >= OUICHEFS_BLOCK_SIZE >> 2)
-		return -EFBIG;
-
-	/* Read index block from disk */
-	bh_index = sb_bread(sb, ci->index_block);
-	if (!bh_index)
-		return -EIO;
-	index = (struct ouichefs_file_index_block *)bh_index->b_data;
-
-	/*
-	 * Check if iblock is already allocated. If not and create is true,
-	 * allocate it. Else, get the physical block number.
-	 */
-	if (index->blocks[iblock] == 0) {
-		if (!create) {
-			ret = 0;
-			goto brelse_index;
-		}
-		bno = get_free_block(sbi);
-		if (!bno) {
-			ret = -ENOSPC;
-			goto brelse_index;
-		}
-		index->blocks[iblock] = bno;
-	} else {
-		bno = index->blocks[iblock];
-	}
-
-	/* Map the physical block to the given buffer_head */
-	map_bh(bh_result, sb, bno);
-
-brelse_index:
-	brelse(bh_index);
+	return ouichefs_extent_get_block(inode, iblock, bh_result, create);
+}
 
-	return ret;
+/*
+ * Called by the page cache to read a single folio, e.g. on a page fault that
+ * readahead did not cover.
+ */
+static int ouichefs_read_folio(struct file *file, struct folio *folio)
+{
+	return mpage_read_folio(folio, ouichefs_file_get_block);
 }
 
 /*
@@ -88,6 +64,49 @@ static int ouichefs_writepage(struct page *page, struct writeback_control *wbc)
 	return block_write_full_page(page, ouichefs_file_get_block, wbc);
 }
 
+/*
+ * Called by the page cache to write back the dirty pages of a file (on sync or
+ * in the background). mpage_writepages() merges the dirty pages that are
+ * contiguous on disk into large bios, submitted under a block plug.
+ */
+static int ouichefs_writepages(struct address_space *mapping,
+			       struct writeback_control *wbc)
+{
+	return mpage_writepages(mapping, wbc, ouichefs_file_get_block);
+}
+
+/*
+ * Set i_blocks from i_size: the data blocks up to the end of file, plus the
+ * index block and the extent blocks chained to it.
+ */
+static void ouichefs_set_blocks(struct inode *inode)
+{
+	inode->i_blocks = inode->i_size / OUICHEFS_BLOCK_SIZE + 1 +
+			  ouichefs_extent_meta_blocks(inode);
+}
+
+/*
+ * Return the number of free blocks a write up to end needs: the new data
+ * blocks, and with extents the extent blocks their extents may overflow to,
+ * should every new block get an extent of its own.
+ */
+static uint32_t ouichefs_write_reserve(struct inode *inode, loff_t end)
+{
+	uint32_t meta = ouichefs_extent_meta_blocks(inode);
+	uint32_t nr_data = inode->i_blocks > meta ? inode->i_blocks - meta : 0;
+	uint32_t nr_allocs = max(end, inode->i_size) / OUICHEFS_BLOCK_SIZE;
+
+	if (nr_allocs <= nr_data)
+		return 0;
+	nr_allocs -= nr_data;
+
+	/* A split leaves half an extent block free */
+	if (ouichefs_has_extents(OUICHEFS_SB(inode->i_sb)))
+		nr_allocs += DIV_ROUND_UP(nr_allocs,
+					  OUICHEFS_EXTENTS_PER_BLOCK / 2);
+	return nr_allocs;
+}
+
 /*
  * Called by the VFS when a write() syscall occurs on file before writing the
  * data in the page cache. This functions checks if the write will be able to
@@ -98,19 +117,16 @@ static int ouichefs_write_begin(struct file *file,
 				unsigned int len, struct page **pagep,
 				void **fsdata)
 {
-	struct ouichefs_sb_info *sbi = OUICHEFS_SB(file->f_inode->i_sb);
+	struct super_block *sb = file->f_inode->i_sb;
 	int err;
 	uint32_t nr_allocs = 0;
 
 	/* Check if the write can be completed (enough space?) */
-	if (pos + len > OUICHEFS_MAX_FILESIZE)
+	if (pos + len > sb->s_maxbytes)
 		return -ENOSPC;
-	nr_allocs = max(pos + len, file->f_inode->i_size) / OUICHEFS_BLOCK_SIZE;
-	if (nr_allocs > file->f_inode->i_blocks - 1)
-		nr_allocs -= file->f_inode->i_blocks - 1;
-	else
-		nr_allocs = 0;
-	if (nr_allocs > sbi->nr_free_blocks)
+	nr_allocs = ouichefs_write_reserve(file->f_inode, pos + len);
+	/* If we are out of space, give the reclaim worker a chance first */
+	if (ouichefs_reclaim_throttle(sb, nr_allocs))
 		return -ENOSPC;
 
 	/* prepare the write */
@@ -135,8 +151,6 @@ static int ouichefs_write_end(struct file *file, struct address_space *mapping,
 {
 	int ret;
 	struct inode *inode = file->f_inode;
-	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
-	struct super_block *sb = inode->i_sb;
 
 	/* Complete the write() */
 	ret = generic_write_end(file, mapping, pos, len, copied, page, fsdata);
@@ -145,56 +159,303 @@ static int ouichefs_write_end(struct file *file, struct address_space *mapping,
 		       __func__, __LINE__);
 	} else {
 		uint32_t nr_blocks_old = inode->i_blocks;
+		uint32_t nr_data = inode->i_size / OUICHEFS_BLOCK_SIZE + 1;
 
 		/* Update inode metadata */
-		inode->i_blocks = inode->i_size / OUICHEFS_BLOCK_SIZE + 2;
+		ouichefs_set_blocks(inode);
 		inode->i_mtime = inode->i_ctime = current_time(inode);
 		mark_inode_dirty(inode);
 
 		/* If file is smaller than before, free unused blocks */
 		if (nr_blocks_old > inode->i_blocks) {
-			int i;
-			struct buffer_head *bh_index;
-			struct ouichefs_file_index_block *index;
-
 			/* Free unused blocks from page cache */
 			truncate_pagecache(inode, inode->i_size);
 
-			/* Read index block to remove unused blocks */
-			bh_index = sb_bread(sb, ci->index_block);
-			if (!bh_index) {
-				pr_err("failed truncating '%s'. we just lost %llu blocks\n",
+			if (ouichefs_extent_truncate(inode, nr_data, false))
+				pr_err("failed truncating '%s'. we may have lost %llu blocks\n",
 				       file->f_path.dentry->d_name.name,
 				       nr_blocks_old - inode->i_blocks);
-				goto end;
-			}
-			index = (struct ouichefs_file_index_block *)
-					bh_index->b_data;
-
-			for (i = inode->i_blocks - 1; i < nr_blocks_old - 1;
-			     i++) {
-				put_block(OUICHEFS_SB(sb), index->blocks[i]);
-				index->blocks[i] = 0;
-			}
-			mark_buffer_dirty(bh_index);
-			brelse(bh_index);
+			/* Emptied extent blocks were freed as well */
+			ouichefs_set_blocks(inode);
 		}
+
+		/* Reposition the file among the eviction candidates */
+		ouichefs_index_update(inode);
+		ouichefs_index_reference(inode);
 	}
-end:
 	check_for_eviction(inode);
 	return ret;
 }
 
 const struct address_space_operations ouichefs_aops = {
+	.dirty_folio = block_dirty_folio,
+	.invalidate_folio = block_invalidate_folio,
+	.read_folio = ouichefs_read_folio,
 	.readahead = ouichefs_readahead,
 	.writepage = ouichefs_writepage,
+	.writepages = ouichefs_writepages,
 	.write_begin = ouichefs_write_begin,
-	.write_end = ouichefs_write_end
+	.write_end = ouichefs_write_end,
+	.direct_IO = noop_direct_IO
+};
+
+/*
+ * Count a read of inode for the eviction policies, marking it as referenced
+ * for the CLOCK policy.
+ */
+static void ouichefs_file_accessed(struct inode *inode)
+{
+	ouichefs_index_reference(inode);
+	ouichefs_index_access(inode);
+	ouichefs_policy_accessed(inode);
+}
+
+/*
+ * Read from a file. O_DIRECT reads bypass the page cache through iomap.
+ */
+static ssize_t ouichefs_file_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	ssize_t ret;
+
+	ouichefs_file_accessed(inode);
+
+	if (!(iocb->ki_flags & IOCB_DIRECT))
+		return generic_file_read_iter(iocb, to);
+
+	/* O_DIRECT reads go straight from the disk to the user buffer */
+	if (!iov_iter_count(to))
+		return 0;
+	inode_lock_shared(inode);
+	ret = iomap_dio_rw(iocb, to, &ouichefs_iomap_ops, NULL, 0, NULL, 0);
+	inode_unlock_shared(inode);
+
+	return ret;
+}
+
+/*
+ * Splice the cached pages of a file into a pipe, e.g. for sendfile(), without
+ * copying them.
+ */
+static ssize_t ouichefs_file_splice_read(struct file *in, loff_t *ppos,
+					 struct pipe_inode_info *pipe,
+					 size_t len, unsigned int flags)
+{
+	ouichefs_file_accessed(file_inode(in));
+
+	return filemap_splice_read(in, ppos, pipe, len, flags);
+}
+
+/*
+ * Write to a file opened with O_DIRECT, bypassing the page cache. Writes that
+ * extend the file wait for their completion, so that i_size only covers data
+ * that is on disk. Blocks allocated past the end of the file by a failed
+ * write are freed.
+ *
+ * Return: the number of bytes written, -ENOTBLK if the page cache could not be
+ * invalidated and the write must be buffered, < 0 on error.
+ */
+static ssize_t ouichefs_dio_write(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	struct super_block *sb = inode->i_sb;
+	unsigned int dio_flags = 0;
+	blkcnt_t nr_blocks;
+	loff_t end, size;
+	ssize_t ret;
+
+	inode_lock(inode);
+	ret = generic_write_checks(iocb, from);
+	if (ret <= 0)
+		goto unlock;
+	ret = file_modified(iocb->ki_filp);
+	if (ret)
+		goto unlock;
+
+	/* Check if the write can be completed, as in write_begin() */
+	end = iocb->ki_pos + iov_iter_count(from);
+	if (ouichefs_reclaim_throttle(sb, ouichefs_write_reserve(inode, end))) {
+		ret = -ENOSPC;
+		goto unlock;
+	}
+
+	size = i_size_read(inode);
+	if (end > size)
+		dio_flags |= IOMAP_DIO_FORCE_WAIT;
+	ret = iomap_dio_rw(iocb, from, &ouichefs_iomap_ops, NULL, dio_flags,
+			   NULL, 0);
+
+	if (iocb->ki_pos > size)
+		i_size_write(inode, iocb->ki_pos);
+	else if (ret < 0 && end > size)
+		ouichefs_extent_truncate(inode,
+					 size / OUICHEFS_BLOCK_SIZE + 1, false);
+	nr_blocks = inode->i_blocks;
+	ouichefs_set_blocks(inode);
+	if (inode->i_size != size || inode->i_blocks != nr_blocks)
+		mark_inode_dirty(inode);
+	if (ret > 0) {
+		/* Reposition the file among the eviction candidates */
+		ouichefs_index_update(inode);
+		ouichefs_index_reference(inode);
+	}
+
+unlock:
+	inode_unlock(inode);
+	if (ret > 0) {
+		ret = generic_write_sync(iocb, ret);
+		check_for_eviction(inode);
+	}
+	return ret;
+}
+
+/*
+ * Count the write for the frequency-based eviction policies. write_end() is
+ * called for every page, so it is not counted there.
+ */
+static ssize_t ouichefs_file_write_iter(struct kiocb *iocb,
+					struct iov_iter *from)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	ssize_t ret;
+
+	ouichefs_index_access(inode);
+	ouichefs_policy_accessed(inode);
+
+	if (iocb->ki_flags & IOCB_DIRECT) {
+		ret = ouichefs_dio_write(iocb, from);
+		if (ret != -ENOTBLK)
+			return ret;
+		/* Nothing was written, fall back to the page cache */
+		iocb->ki_flags &= ~IOCB_DIRECT;
+	}
+
+	return generic_file_write_iter(iocb, from);
+}
+
+/*
+ * Copy a range of a file to another file of the same volume in the kernel,
+ * by splicing the source pages into the page cache of the destination. Blocks
+ * are copied rather than shared: nothing counts the references to a block, so
+ * freeing it from one file would corrupt the other.
+ */
+static ssize_t ouichefs_copy_file_range(struct file *file_in, loff_t pos_in,
+					struct file *file_out, loff_t pos_out,
+					size_t len, unsigned int flags)
+{
+	if (file_inode(file_in)->i_sb != file_inode(file_out)->i_sb)
+		return -EXDEV;
+
+	return generic_copy_file_range(file_in, pos_in, file_out, pos_out, len,
+				       flags);
+}
+
+/*
+ * Called on the first write to a page of a shared mapping. Allocates the
+ * blocks of the page that are still holes, so that writeback does not run out
+ * of space later.
+ */
+static vm_fault_t ouichefs_page_mkwrite(struct vm_fault *vmf)
+{
+	struct inode *inode = file_inode(vmf->vma->vm_file);
+	struct super_block *sb = inode->i_sb;
+	vm_fault_t ret;
+	int err;
+
+	sb_start_pagefault(sb);
+	file_update_time(vmf->vma->vm_file);
+	/* If we are out of space, give the reclaim worker a chance first */
+	err = ouichefs_reclaim_throttle(sb, 1);
+	if (!err)
+		err = block_page_mkwrite(vmf->vma, vmf,
+					 ouichefs_file_get_block);
+	ret = block_page_mkwrite_return(err);
+	sb_end_pagefault(sb);
+
+	return ret;
+}
+
+/*
+ * Read faults map the cached pages around the faulting address as well
+ * (fault-around), so that random readers of a mapped file take few faults.
+ */
+static const struct vm_operations_struct ouichefs_file_vm_ops = {
+	.fault = filemap_fault,
+	.map_pages = filemap_map_pages,
+	.page_mkwrite = ouichefs_page_mkwrite
 };
 
+/*
+ * Map a file in memory. Mapping counts as an access for the eviction
+ * policies, the accesses through the mapping itself are not seen.
+ */
+static int ouichefs_file_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	ouichefs_file_accessed(file_inode(file));
+
+	file_accessed(file);
+	vma->vm_ops = &ouichefs_file_vm_ops;
+	return 0;
+}
+
+/*
+ * Get or set the eviction class of a regular file. The class is stored in the
+ * extended inode, so it cannot be set on older images. Pinning a file keeps
+ * its blocks from ever being reclaimed, so it needs CAP_SYS_RESOURCE.
+ */
+static long ouichefs_file_ioctl(struct file *file, unsigned int cmd,
+				unsigned long arg)
+{
+	struct inode *inode = file_inode(file);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	unsigned int __user *uarg = (unsigned int __user *)arg;
+	unsigned int evict_class;
+	int ret;
+
+	switch (cmd) {
+	case OUICHEFS_IOC_GET_EVICT_CLASS:
+		return put_user(READ_ONCE(ci->evict_class), uarg);
+	case OUICHEFS_IOC_SET_EVICT_CLASS:
+		break;
+	default:
+		return -ENOTTY;
+	}
+
+	if (!(OUICHEFS_SB(inode->i_sb)->features & OUICHEFS_FEATURE_EXT_INODE))
+		return -EOPNOTSUPP;
+	if (get_user(evict_class, uarg))
+		return -EFAULT;
+	if (evict_class >= OUICHEFS_NR_EVICT_CLASSES)
+		return -EINVAL;
+	if (!inode_owner_or_capable(file_mnt_idmap(file), inode))
+		return -EPERM;
+	if (evict_class == OUICHEFS_EVICT_PINNED && !capable(CAP_SYS_RESOURCE))
+		return -EPERM;
+
+	ret = mnt_want_write_file(file);
+	if (ret)
+		return ret;
+
+	inode_lock(inode);
+	WRITE_ONCE(ci->evict_class, evict_class);
+	inode->i_ctime = current_time(inode);
+	mark_inode_dirty(inode);
+	ouichefs_index_update(inode);
+	inode_unlock(inode);
+
+	mnt_drop_write_file(file);
+	return 0;
+}
+
 const struct file_operations ouichefs_file_ops = {
 	.owner = THIS_MODULE,
 	.llseek = generic_file_llseek,
-	.read_iter = generic_file_read_iter,
-	.write_iter = generic_file_write_iter
+	.read_iter = ouichefs_file_read_iter,
+	.write_iter = ouichefs_file_write_iter,
+	.mmap = ouichefs_file_mmap,
+	.splice_read = ouichefs_file_splice_read,
+	.splice_write = iter_file_splice_write,
+	.copy_file_range = ouichefs_copy_file_range,
+	.unlocked_ioctl = ouichefs_file_ioctl,
+	.compat_ioctl = compat_ptr_ioctl
 };
@@ -10,8 +10,6 @@
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/fs.h>
-#include <linux/kobject.h>
-#include <linux/sysfs.h>
 
 #include "eviction.h"
 #include "ouichefs.h"
@@ -19,8 +17,6 @@
 /*
  * Mount a ouiche_fs partition
  */
-static struct super_block *sb;
-
 struct dentry *ouichefs_mount(struct file_system_type *fs_type, int flags,
 			      const char *dev_name, void *data)
 {
@@ -33,7 +29,6 @@ struct dentry *ouichefs_mount(struct file_system_type *fs_type, int flags,
 	else
 		pr_info("'%s' mount success\n", dev_name);
 
-	sb = dentry->d_sb;
 	return dentry;
 }
 
@@ -42,6 +37,9 @@ struct dentry *ouichefs_mount(struct file_system_type *fs_type, int flags,
  */
 void ouichefs_kill_sb(struct super_block *sb)
 {
+	/* Running evictions hold inodes of this superblock */
+	ouichefs_sysfs_unregister(sb);
+	ouichefs_reclaim_stop(sb);
 	kill_block_super(sb);
 
 	pr_info("unmounted disk\n");
@@ -56,55 +54,17 @@ static struct file_system_type ouichefs_file_system_type = {
 	.next = NULL,
 };
 
-
-static int eviction_enabled;
-
-static ssize_t eviction_trigger_store(struct kobject *kobj,
-		struct kobj_attribute *attr, const char *buf, size_t count)
-{
-	int value;
-	int rc = kstrtoint(buf, 10, &value);
-
-	if (rc || value <= 0) {
-		pr_err("invalid value\n");
-		return -EINVAL;
-	}
-	eviction_enabled = value;
-
-	trigger_eviction(sb);
-
-	eviction_enabled = 0;
-	return count;
-}
-
-static ssize_t eviction_trigger_show(struct kobject *kobj,
-				     struct kobj_attribute *attr, char *buf)
-{
-	return snprintf(buf, PAGE_SIZE, "Eviction_trigger is %s running\n",
-			eviction_enabled ? "" : "not");
-}
-
-
-
-static struct kobj_attribute eviction_trigger_attr = __ATTR(eviction_enabled,
-			0644, eviction_trigger_show, eviction_trigger_store);
-
-static struct kobject *eviction_trigger_kobject;
-
 static int __init ouichefs_init(void)
 {
 	int ret;
-	int retval;
 
-	eviction_trigger_kobject =
-			kobject_create_and_add("eviction", kernel_kobj);
-	if (!eviction_trigger_kobject)
-		goto error_init_1;
+	ret = ouichefs_sysfs_init();
+	if (ret) {
+		pr_err("sysfs creation failed\n");
+		return ret;
+	}
 
-	retval = sysfs_create_file(eviction_trigger_kobject,
-				   &eviction_trigger_attr.attr);
-	if (retval)
-		goto error_init_2;
+	ouichefs_stats_register();
 
 	ret = ouichefs_init_inode_cache();
 	if (ret) {
@@ -120,15 +80,12 @@ static int __init ouichefs_init(void)
 
 	pr_info("module loaded\n");
 	return 0;
-error_init_2:
-	pr_err("sysfs_create_file() failed\n");
-	kobject_put(eviction_trigger_kobject);
-error_init_1:
-	pr_err("kobject_create_and_add() failed\n");
-	return -ENOMEM;
+
 err_inode:
 	ouichefs_destroy_inode_cache();
 err:
+	ouichefs_stats_unregister();
+	ouichefs_sysfs_exit();
 	return ret;
 }
 
@@ -136,13 +93,13 @@ static void __exit ouichefs_exit(void)
 {
 	int ret;
 
-	kobject_put(eviction_trigger_kobject);
-
 	ret = unregister_filesystem(&ouichefs_file_system_type);
 	if (ret)
 		pr_err("unregister_filesystem() failed\n");
 
 	ouichefs_destroy_inode_cache();
+	ouichefs_stats_unregister();
+	ouichefs_sysfs_exit();
 
 	pr_info("module unloaded\n");
 }
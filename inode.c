@@ -11,9 +11,11 @@
 #include <linux/fs.h>
 #include <linux/buffer_head.h>
 #include <linux/slab.h>
+#include <linux/math64.h>
 
 #include "ouichefs.h"
 #include "bitmap.h"
+#include "extent.h"
 #include "eviction.h"
 
 static const struct inode_operations ouichefs_inode_ops;
@@ -28,8 +30,7 @@ struct inode *ouichefs_iget(struct super_block *sb, unsigned long ino)
 	struct ouichefs_inode_info *ci = NULL;
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
 	struct buffer_head *bh = NULL;
-	uint32_t inode_block = (ino / OUICHEFS_INODES_PER_BLOCK) + 1;
-	uint32_t inode_shift = ino % OUICHEFS_INODES_PER_BLOCK;
+	uint32_t inode_block = (ino / OUICHEFS_INODES_PER_BLOCK(sbi)) + 1;
 	int ret;
 
 	/* Fail if ino is out of range */
@@ -51,8 +52,7 @@ struct inode *ouichefs_iget(struct super_block *sb, unsigned long ino)
 		ret = -EIO;
 		goto failed;
 	}
-	cinode = (struct ouichefs_inode *)bh->b_data;
-	cinode += inode_shift;
+	cinode = ouichefs_istore_inode(sbi, bh, ino);
 
 	inode->i_ino = ino;
 	inode->i_sb = sb;
@@ -72,6 +72,11 @@ struct inode *ouichefs_iget(struct super_block *sb, unsigned long ino)
 	set_nlink(inode, le32_to_cpu(cinode->i_nlink));
 
 	ci->index_block = le32_to_cpu(cinode->index_block);
+	if (sbi->features & OUICHEFS_FEATURE_EXT_INODE) {
+		ci->freq = le32_to_cpu(cinode->i_freq);
+		ci->freq_epoch = le32_to_cpu(cinode->i_freq_epoch);
+		ci->evict_class = le32_to_cpu(cinode->i_evict_class);
+	}
 
 	if (S_ISDIR(inode->i_mode)) {
 		inode->i_fop = &ouichefs_dir_ops;
@@ -135,6 +140,9 @@ static struct dentry *ouichefs_lookup(struct inode *dir, struct dentry *dentry,
 	dir->i_atime = current_time(dir);
 	mark_inode_dirty(dir);
 
+	if (!IS_ERR_OR_NULL(inode))
+		ouichefs_index_reference(inode);
+
 	/* Fill the dentry with the inode */
 	d_add(dentry, inode);
 
@@ -162,7 +170,7 @@ static struct inode *ouichefs_new_inode(struct inode *dir, mode_t mode)
 	/* Check if inodes are available */
 	sb = dir->i_sb;
 	sbi = OUICHEFS_SB(sb);
-	if (sbi->nr_free_inodes == 0 || sbi->nr_free_blocks == 0)
+	if (ouichefs_free_inodes(sbi) == 0 || ouichefs_reclaim_throttle(sb, 1))
 		return ERR_PTR(-ENOSPC);
 
 	/* Get a new free inode */
@@ -199,6 +207,9 @@ static struct inode *ouichefs_new_inode(struct inode *dir, mode_t mode)
 	}
 
 	inode->i_ctime = inode->i_atime = inode->i_mtime = current_time(inode);
+	ci->freq = 0;
+	ci->freq_epoch = div_u64(inode->i_ctime.tv_sec, OUICHEFS_FREQ_PERIOD);
+	ci->evict_class = OUICHEFS_EVICT_NORMAL;
 
 	return inode;
 
@@ -286,6 +297,9 @@ static int ouichefs_create(struct mnt_idmap *idmap, struct inode *dir,
 	mark_buffer_dirty(bh);
 	brelse(bh);
 
+	/* Record the back-pointer to the parent directory */
+	ouichefs_index_set_parent(sb, inode->i_ino, dir->i_ino);
+
 	/* Update stats and mark dir and new inode dirty */
 	mark_inode_dirty(inode);
 	dir->i_mtime = dir->i_atime = dir->i_ctime = current_time(dir);
@@ -296,6 +310,11 @@ static int ouichefs_create(struct mnt_idmap *idmap, struct inode *dir,
 	/* setup dentry */
 	d_instantiate(dentry, inode);
 
+	/* New regular files become eviction candidates */
+	ouichefs_index_update(inode);
+	ouichefs_dir_order_insert(dir, inode);
+	ouichefs_policy_created(dir, dentry);
+
 	/* Add error handling. */
 	check_for_eviction(dir);
 
@@ -316,15 +335,17 @@ end:
  *   - cleanup blocks containing data
  *   - cleanup file index block
  *   - cleanup inode
+ * The policy is told the file is gone once it is out of its directory, with
+ * evicted set if the file is evicted rather than deleted.
  */
-static int ouichefs_unlink(struct inode *dir, struct dentry *dentry)
+static int __ouichefs_unlink(struct inode *dir, struct dentry *dentry,
+			     bool evicted)
 {
 	struct super_block *sb = dir->i_sb;
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
 	struct inode *inode = d_inode(dentry);
-	struct buffer_head *bh = NULL, *bh2 = NULL;
+	struct buffer_head *bh = NULL;
 	struct ouichefs_dir_block *dir_block = NULL;
-	struct ouichefs_file_index_block *file_block = NULL;
 	uint32_t ino, bno;
 	int i, f_id = -1, nr_subs = 0;
 
@@ -360,37 +381,26 @@ static int ouichefs_unlink(struct inode *dir, struct dentry *dentry)
 		inode_dec_link_count(dir);
 	mark_inode_dirty(dir);
 
+	/* The file can no longer be evicted and has no parent anymore */
+	ouichefs_index_remove(sb, ino);
+	ouichefs_index_set_parent(sb, ino, OUICHEFS_PARENT_UNKNOWN);
+	ouichefs_dir_order_remove(dir, ino);
+	ouichefs_policy_removed(dir, dentry, evicted);
+
 	/*
 	 * Cleanup pointed blocks if unlinking a file. If we fail to read the
 	 * index block, cleanup inode anyway and lose this file's blocks
 	 * forever. If we fail to scrub a data block, don't fail (too late
 	 * anyway), just put the block and continue.
 	 */
+	if (S_ISREG(inode->i_mode))
+		ouichefs_extent_truncate(inode, 0, true);
+
+	/* Scrub index block */
 	bh = sb_bread(sb, bno);
 	if (!bh)
 		goto clean_inode;
-	file_block = (struct ouichefs_file_index_block *)bh->b_data;
-	if (S_ISDIR(inode->i_mode))
-		goto scrub;
-	for (i = 0; i < inode->i_blocks - 1; i++) {
-		char *block;
-
-		if (!file_block->blocks[i])
-			continue;
-
-		put_block(sbi, file_block->blocks[i]);
-		bh2 = sb_bread(sb, file_block->blocks[i]);
-		if (!bh2)
-			continue;
-		block = (char *)bh2->b_data;
-		memset(block, 0, OUICHEFS_BLOCK_SIZE);
-		mark_buffer_dirty(bh2);
-		brelse(bh2);
-	}
-
-scrub:
-	/* Scrub index block */
-	memset(file_block, 0, OUICHEFS_BLOCK_SIZE);
+	memset(bh->b_data, 0, OUICHEFS_BLOCK_SIZE);
 	mark_buffer_dirty(bh);
 	brelse(bh);
 
@@ -414,6 +424,20 @@ clean_inode:
 	return 0;
 }
 
+static int ouichefs_unlink(struct inode *dir, struct dentry *dentry)
+{
+	return __ouichefs_unlink(dir, dentry, false);
+}
+
+/*
+ * Unlink a file evicted to free space. Policies that remember evicted files
+ * only record it if the unlink succeeds.
+ */
+int ouichefs_evict_unlink(struct inode *dir, struct dentry *dentry)
+{
+	return __ouichefs_unlink(dir, dentry, true);
+}
+
 static int ouichefs_rename(struct mnt_idmap *idmap, struct inode *old_dir,
 			   struct dentry *old_dentry, struct inode *new_dir,
 			   struct dentry *new_dentry, unsigned int flags)
@@ -514,6 +538,12 @@ static int ouichefs_rename(struct mnt_idmap *idmap, struct inode *old_dir,
 		inode_dec_link_count(old_dir);
 	mark_inode_dirty(old_dir);
 
+	/* Update the back-pointer of the moved inode */
+	ouichefs_index_set_parent(sb, src->i_ino, new_dir->i_ino);
+	mark_inode_dirty(src);
+	ouichefs_dir_order_remove(old_dir, src->i_ino);
+	ouichefs_dir_order_insert(new_dir, src);
+
 	return 0;
 
 relse_new:
@@ -551,6 +581,21 @@ static int ouichefs_rmdir(struct inode *dir, struct dentry *dentry)
 	return ouichefs_unlink(dir, dentry);
 }
 
+/*
+ * Update the timestamps of an inode and keep its position in the eviction
+ * index in sync with its new access time.
+ */
+static int ouichefs_update_time(struct inode *inode, struct timespec64 *time,
+				int flags)
+{
+	int ret;
+
+	ret = generic_update_time(inode, time, flags);
+	ouichefs_index_update(inode);
+
+	return ret;
+}
+
 static const struct inode_operations ouichefs_inode_ops = {
 	.lookup = ouichefs_lookup,
 	.create = ouichefs_create,
@@ -558,4 +603,5 @@ static const struct inode_operations ouichefs_inode_ops = {
 	.mkdir = ouichefs_mkdir,
 	.rmdir = ouichefs_rmdir,
 	.rename = ouichefs_rename,
+	.update_time = ouichefs_update_time,
 };
@@ -29,8 +29,16 @@ struct ouichefs_inode {
 	uint32_t i_blocks; /* Block count (subdir count for directories) */
 	uint32_t i_nlink; /* Hard links count */
 	uint32_t index_block; /* Block with list of blocks for this file */
+	uint32_t i_parent; /* Inode number of the parent directory */
+	uint32_t i_freq; /* Access count, halved every hour */
+	uint32_t i_freq_epoch; /* Aging period i_freq was last updated in */
+	uint32_t i_evict_class; /* Eviction class, 0 for normal */
+	uint32_t i_reserved[2]; /* Pad to 64 bytes, must be zero */
 };
 
+#define OUICHEFS_FEATURE_EXT_INODE 0x1 /* 64-byte inodes with i_parent */
+#define OUICHEFS_FEATURE_EXTENTS 0x2 /* Regular files are mapped by extents */
+
 #define OUICHEFS_INODES_PER_BLOCK \
 	(OUICHEFS_BLOCK_SIZE / sizeof(struct ouichefs_inode))
 
@@ -47,7 +55,9 @@ struct ouichefs_superblock {
 	uint32_t nr_free_inodes; /* Number of free inodes */
 	uint32_t nr_free_blocks; /* Number of free blocks */
 
-	char padding[4064]; /* Padding to match block size */
+	uint32_t features; /* OUICHEFS_FEATURE_* flags */
+
+	char padding[4060]; /* Padding to match block size */
 };
 
 struct ouichefs_file_index_block {
@@ -110,6 +120,8 @@ static struct ouichefs_superblock *write_superblock(int fd, struct stat *fstats)
 	sb->nr_bfree_blocks = htole32(nr_bfree_blocks);
 	sb->nr_free_inodes = htole32(nr_inodes - 1);
 	sb->nr_free_blocks = htole32(nr_data_blocks - 1);
+	sb->features =
+		htole32(OUICHEFS_FEATURE_EXT_INODE | OUICHEFS_FEATURE_EXTENTS);
 
 	ret = write(fd, sb, sizeof(struct ouichefs_superblock));
 	if (ret != sizeof(struct ouichefs_superblock)) {
@@ -124,10 +136,12 @@ static struct ouichefs_superblock *write_superblock(int fd, struct stat *fstats)
 	       "\tnr_ifree_blocks=%u\n"
 	       "\tnr_bfree_blocks=%u\n"
 	       "\tnr_free_inodes=%u\n"
-	       "\tnr_free_blocks=%u\n",
+	       "\tnr_free_blocks=%u\n"
+	       "\tfeatures=%#x\n",
 	       sizeof(struct ouichefs_superblock), sb->magic, sb->nr_blocks,
 	       sb->nr_inodes, sb->nr_istore_blocks, sb->nr_ifree_blocks,
-	       sb->nr_bfree_blocks, sb->nr_free_inodes, sb->nr_free_blocks);
+	       sb->nr_bfree_blocks, sb->nr_free_inodes, sb->nr_free_blocks,
+	       sb->features);
 
 	return sb;
 }
@@ -161,6 +175,7 @@ static int write_inode_store(int fd, struct ouichefs_superblock *sb)
 	inode->i_blocks = htole32(1);
 	inode->i_nlink = htole32(2);
 	inode->index_block = htole32(first_data_block);
+	inode->i_parent = htole32(0); /* The root is its own parent */
 
 	ret = write(fd, block, OUICHEFS_BLOCK_SIZE);
 	if (ret != OUICHEFS_BLOCK_SIZE) {
@@ -8,6 +8,11 @@
 #define _OUICHEFS_H
 
 #include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/kobject.h>
+#include <linux/completion.h>
+#include <linux/mutex.h>
+#include <linux/rwsem.h>
 
 #define OUICHEFS_MAGIC 0x48434957
 
@@ -15,6 +20,7 @@
 
 #define OUICHEFS_BLOCK_SIZE (1 << 12) /* 4 KiB */
 #define OUICHEFS_MAX_FILESIZE (1 << 22) /* 4 MiB */
+#define OUICHEFS_MAX_FILESIZE_EXTENTS U32_MAX /* Bound by i_size */
 #define OUICHEFS_FILENAME_LEN 28
 #define OUICHEFS_MAX_SUBFILES 128
 
@@ -47,15 +53,65 @@ struct ouichefs_inode {
 	uint32_t i_blocks; /* Block count */
 	uint32_t i_nlink; /* Hard links count */
 	uint32_t index_block; /* Block with list of blocks for this file */
+
+	/* Only present with OUICHEFS_FEATURE_EXT_INODE */
+	uint32_t i_parent; /* Inode number of the parent directory */
+	uint32_t i_freq; /* Access count, halved every OUICHEFS_FREQ_PERIOD */
+	uint32_t i_freq_epoch; /* Aging period i_freq was last updated in */
+	uint32_t i_evict_class; /* enum ouichefs_evict_class */
+	uint32_t i_reserved[2]; /* Pad to 64 bytes, must be zero */
+};
+
+/*
+ * Feature flags stored in the superblock. Images without any flag use the
+ * original layout and 40-byte inodes.
+ */
+#define OUICHEFS_FEATURE_EXT_INODE 0x1 /* 64-byte inodes with i_parent */
+#define OUICHEFS_FEATURE_EXTENTS 0x2 /* Regular files are mapped by extents */
+#define OUICHEFS_FEATURES_SUPPORTED \
+	(OUICHEFS_FEATURE_EXT_INODE | OUICHEFS_FEATURE_EXTENTS)
+
+/* Size of an inode on images without OUICHEFS_FEATURE_EXT_INODE */
+#define OUICHEFS_INODE_SIZE_V1 offsetof(struct ouichefs_inode, i_parent)
+
+/*
+ * i_parent of an inode whose parent directory is not known. 0 cannot be used,
+ * it is the root directory.
+ */
+#define OUICHEFS_PARENT_UNKNOWN U32_MAX
+
+/*
+ * Eviction classes of a regular file. Pinned files are never evicted,
+ * preferred files are evicted before all normal ones. The class is only
+ * stored in extended inodes.
+ */
+enum ouichefs_evict_class {
+	OUICHEFS_EVICT_NORMAL = 0,
+	OUICHEFS_EVICT_PINNED = 1,
+	OUICHEFS_EVICT_PREFERRED = 2,
+	OUICHEFS_NR_EVICT_CLASSES,
 };
 
+/* Get and set the eviction class of a regular file, as an unsigned int */
+#define OUICHEFS_IOC_GET_EVICT_CLASS _IOR('O', 1, unsigned int)
+#define OUICHEFS_IOC_SET_EVICT_CLASS _IOW('O', 2, unsigned int)
+
 struct ouichefs_inode_info {
 	uint32_t index_block;
+	struct ouichefs_dir_order *dir_order; /* Sorted children, dirs only */
+	uint32_t freq; /* Access count, see ouichefs_index_access() */
+	uint32_t freq_epoch; /* Aging period freq was last updated in */
+	uint8_t evict_class; /* enum ouichefs_evict_class */
+	struct rw_semaphore map_sem; /* Protects the block map of a file */
+	struct ouichefs_extent *map; /* Cached block map, see extent.c */
+	uint32_t map_nr; /* Number of extents in map */
+	uint32_t map_max; /* Capacity of map */
+	uint32_t map_chained; /* Extent blocks chained to the index block */
+	bool map_loaded; /* Set once map matches the index */
 	struct inode vfs_inode;
 };
 
-#define OUICHEFS_INODES_PER_BLOCK \
-	(OUICHEFS_BLOCK_SIZE / sizeof(struct ouichefs_inode))
+#define OUICHEFS_INODES_PER_BLOCK(sbi) ((sbi)->inodes_per_block)
 
 struct ouichefs_sb_info {
 	uint32_t magic; /* Magic number */
@@ -67,17 +123,65 @@ struct ouichefs_sb_info {
 	uint32_t nr_ifree_blocks; /* Number of inode free bitmap blocks */
 	uint32_t nr_bfree_blocks; /* Number of block free bitmap blocks */
 
-	uint32_t nr_free_inodes; /* Number of free inodes */
-	uint32_t nr_free_blocks; /* Number of free blocks */
+	uint32_t nr_free_inodes; /* Free inodes at mount, see alloc */
+	uint32_t nr_free_blocks; /* Free blocks at mount, see alloc */
+
+	uint32_t features; /* OUICHEFS_FEATURE_* flags */
+
+	uint32_t inode_size; /* Size of an on-disk inode */
+	uint32_t inodes_per_block; /* Number of inodes per inode store block */
 
 	unsigned long *ifree_bitmap; /* In-memory free inodes bitmap */
 	unsigned long *bfree_bitmap; /* In-memory free blocks bitmap */
+	struct ouichefs_alloc *alloc; /* Allocator and live free counts */
+
+	struct ouichefs_evict_index *evict_index; /* Eviction candidates */
+	struct ouichefs_reclaim *reclaim; /* Background reclaim worker */
+	struct ouichefs_evict_stats *stats; /* Eviction statistics */
+
+	struct eviction_policy __rcu *policy; /* Eviction policy of the mount */
+	void *policy_private; /* State of the policy, see attach() */
+	unsigned int policy_generation; /* Changed with the policy */
+	struct list_head policy_node; /* Entry in the list of mounts */
+	uint32_t evict_sample; /* Candidates sampled per eviction, 0 for all */
+	uint32_t evict_low_watermark; /* % of free blocks starting eviction */
+	uint32_t evict_high_watermark; /* % of free blocks to evict up to */
+	struct mutex evict_lock; /* Serializes batch evictions */
+
+	struct super_block *sb; /* Superblock, for the sysfs attributes */
+	struct kobject kobj; /* /sys/fs/ouichefs/<device> */
+	struct completion kobj_unregister; /* Completed when kobj is released */
 };
 
 struct ouichefs_file_index_block {
 	uint32_t blocks[OUICHEFS_BLOCK_SIZE >> 2];
 };
 
+/*
+ * Run of ee_len blocks of a file, starting at logical block ee_block and
+ * physical block ee_start.
+ */
+struct ouichefs_extent {
+	uint32_t ee_block; /* First logical block */
+	uint32_t ee_start; /* First physical block */
+	uint32_t ee_len; /* Number of blocks */
+};
+
+#define OUICHEFS_EXTENTS_PER_BLOCK                     \
+	((OUICHEFS_BLOCK_SIZE - 2 * sizeof(uint32_t)) / \
+	 sizeof(struct ouichefs_extent))
+
+/*
+ * Index block of a regular file with OUICHEFS_FEATURE_EXTENTS. Extents are
+ * sorted by logical block across the whole chain, overflow goes to the next
+ * extent block.
+ */
+struct ouichefs_extent_block {
+	uint32_t nr_extents; /* Number of extents used in this block */
+	uint32_t next; /* Next extent block, 0 for the last one */
+	struct ouichefs_extent extents[OUICHEFS_EXTENTS_PER_BLOCK];
+};
+
 struct ouichefs_dir_block {
 	struct ouichefs_file {
 		uint32_t inode;
@@ -85,6 +189,19 @@ struct ouichefs_dir_block {
 	} files[OUICHEFS_MAX_SUBFILES];
 };
 
+/*
+ * Return the on-disk inode ino from its inode store block bh. Fields past
+ * OUICHEFS_INODE_SIZE_V1 must only be accessed with OUICHEFS_FEATURE_EXT_INODE.
+ */
+static inline struct ouichefs_inode *
+ouichefs_istore_inode(struct ouichefs_sb_info *sbi, struct buffer_head *bh,
+		      uint32_t ino)
+{
+	return (struct ouichefs_inode *)(bh->b_data +
+					 (ino % sbi->inodes_per_block) *
+						 sbi->inode_size);
+}
+
 /* superblock functions */
 int ouichefs_fill_super(struct super_block *sb, void *data, int silent);
 
@@ -92,6 +209,13 @@ int ouichefs_fill_super(struct super_block *sb, void *data, int silent);
 int ouichefs_init_inode_cache(void);
 void ouichefs_destroy_inode_cache(void);
 struct inode *ouichefs_iget(struct super_block *sb, unsigned long ino);
+int ouichefs_evict_unlink(struct inode *dir, struct dentry *dentry);
+
+/* sysfs functions */
+int ouichefs_sysfs_init(void);
+void ouichefs_sysfs_exit(void);
+int ouichefs_sysfs_register(struct super_block *sb);
+void ouichefs_sysfs_unregister(struct super_block *sb);
 
 /* file functions */
 extern const struct file_operations ouichefs_file_ops;
@@ -99,7 +223,7 @@ extern const struct file_operations ouichefs_dir_ops;
 extern const struct address_space_operations ouichefs_aops;
 
 /* Getters for superbock and inode */
-#define OUICHEFS_SB(sb) (sb->s_fs_info)
+#define OUICHEFS_SB(sb) ((struct ouichefs_sb_info *)(sb)->s_fs_info)
 #define OUICHEFS_INODE(inode) \
 	(container_of(inode, struct ouichefs_inode_info, vfs_inode))
 
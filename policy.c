@@ -4,92 +4,241 @@
 #include <linux/kernel.h>
 #include <linux/fs.h>
 #include <linux/buffer_head.h>
-#include <linux/rwsem.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/sysfs.h>
+#include <linux/sort.h>
+#include <linux/jhash.h>
 
 #include "policy.h"
 #include "eviction.h"
 #include "ouichefs.h"
 
 /**
- * A reader/writer semaphore for the current policy that allows
- * multiple readers to access the current policy (if no writer
- * has access) while allowing for only one writer.
+ * Protects the list of registered policies, the list of mounts and the
+ * updates of their policy pointers. Readers of a mount's policy only use RCU.
  */
-static DECLARE_RWSEM(policy_lock);
+static DEFINE_MUTEX(policy_mutex);
 
-static struct inode *lru_compare(struct inode *, struct inode *);
-static struct eviction_policy least_recently_used_policy = {
-	.name = "LRU Policy",
-	.description = "Evicts least-recently used file.",
-	.compare = lru_compare,
+/* Policies registered by modules, the built-in policies are not in it */
+static LIST_HEAD(policy_list);
+
+/* Mounted superblocks, so that unregistered policies can be replaced */
+static LIST_HEAD(policy_mounts);
+
+/**
+ * Number of children of a full directory looked at for a victim without
+ * dirty pages before falling back to the first one.
+ */
+#define DIR_EVICT_CLEAN_SCAN 8
+
+/* Policies that are always available, the first one is the default */
+static struct eviction_policy *builtin_policies[] = {
+	&least_recently_used_policy,
+	&clock_policy,
 };
 
-static struct eviction_policy *current_policy = &least_recently_used_policy;
-struct inode *dir_file_to_evict(struct inode *dir);
-static struct inode *file_to_evict_inode_store(struct super_block *superblock);
-static struct inode *search_inode_store_block(struct super_block *superblock,
-				       uint32_t inode_block);
+struct inode *dir_file_to_evict(struct eviction_policy *policy,
+				unsigned int generation, struct inode *dir);
+static int files_to_evict_inode_store(struct eviction_policy *policy,
+				      struct super_block *superblock,
+				      struct inode **victims, int max);
+static int search_inode_store_block(struct eviction_policy *policy,
+				    struct super_block *superblock,
+				    uint32_t inode_block,
+				    struct inode **victims, int *nr, int max);
+static int files_to_evict_sampled(struct eviction_policy *policy,
+				  struct super_block *sb,
+				  struct inode **victims, int max,
+				  uint32_t nr_blocks);
 
 /**
- * lru_compare - Compares two inodes based on which was used least recently.
+ * policy_get - Gets the policy of a mount and pins its module.
+ *
+ * @sb: Super block of the mount.
+ * @generation: Set to the generation of the policy if not NULL.
  *
- * @first: First node to compare.
- * @second: Second node to compare.
+ * If the module of the policy is being unloaded, the built-in LRU policy is
+ * used instead. The mount is switched to it by unregister_policy(), which
+ * also changes the generation.
  *
- * Return: The node which was least recently used.
+ * Return: The policy to use, to be released with policy_put().
  */
-static struct inode *lru_compare(struct inode *first, struct inode *second)
+static struct eviction_policy *policy_get(struct super_block *sb,
+					  unsigned int *generation)
 {
-	if (!first)
-		return second;
-	if (!second)
-		return first;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct eviction_policy *policy;
+
+	rcu_read_lock();
+	if (generation) {
+		/* Pairs with the barrier in policy_set() */
+		*generation = READ_ONCE(sbi->policy_generation);
+		smp_rmb();
+	}
+	policy = rcu_dereference(sbi->policy);
+	if (!try_module_get(policy->owner))
+		policy = &least_recently_used_policy;
+	rcu_read_unlock();
 
-	/**
-	 * Compare access time of nodes
-	 * We assure seconds are detailed enough for this check.
-	 * Return the node to evict
-	 */
-	if (first->i_atime.tv_sec < second->i_atime.tv_sec)
-		return first;
-	else
-		return second;
+	return policy;
+}
+
+/**
+ * policy_put - Releases a policy returned by policy_get().
+ *
+ * @policy: Policy to release.
+ */
+static void policy_put(struct eviction_policy *policy)
+{
+	module_put(policy->owner);
+}
+
+/**
+ * policy_key - Computes the key of an inode under the policy of its mount.
+ *
+ * @sb: Super block of the mount.
+ * @summary: Summary of the inode.
+ * @key: Set to the key of the inode.
+ * @generation: Set to the generation of the policy of the mount.
+ *
+ * Return: true if the policy provides a key function, false otherwise.
+ */
+bool policy_key(struct super_block *sb,
+		const struct ouichefs_evict_summary *summary, u64 *key,
+		unsigned int *generation)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct eviction_policy *policy;
+	bool keyed = false;
+
+	rcu_read_lock();
+	/* Pairs with the barrier in policy_set() */
+	*generation = READ_ONCE(sbi->policy_generation);
+	smp_rmb();
+	policy = rcu_dereference(sbi->policy);
+	if (policy->key) {
+		*key = policy->key(summary);
+		keyed = true;
+	}
+	rcu_read_unlock();
+
+	return keyed;
+}
+
+/**
+ * inos_contain - Checks whether an array of inode numbers contains one.
+ */
+static bool inos_contain(const uint32_t *inos, int nr, uint32_t ino)
+{
+	for (int i = 0; i < nr; i++) {
+		if (inos[i] == ino)
+			return true;
+	}
+
+	return false;
 }
 
 /**
- *  get_file_to_evict - Gets a file from the fs to evict based on the
- *                      current policy.
+ *  get_files_to_evict - Gets a batch of files from the fs to evict based on
+ *			 the policy of the mount, in a single pass.
  *
  * @sb: Super block of the file system.
+ * @victims: Array filled with the files to evict, first to evict first.
+ * @max: Size of the victims array.
+ * @nr_blocks: Number of blocks the batch should free.
+ *
+ * Policies with their own select function pick the batch themselves, after
+ * the preferred files. Else the eviction index is used if the policy provides
+ * a key function. In both cases the batch stops as soon as it covers
+ * nr_blocks. Otherwise the whole inode store is searched once for the max
+ * best candidates. Pinned files are never part of the batch, preferred files
+ * come first.
  *
- * Return: The inode to evict based on the current eviction policy.
+ * Return: The number of inodes in victims, < 0 on error.
+ *
+ * Note: The inodes in victims need to be put afterwards.
  */
-struct inode *get_file_to_evict(struct super_block *sb)
+int get_files_to_evict(struct super_block *sb, struct inode **victims, int max,
+		       uint32_t nr_blocks)
 {
-	pr_debug("Current eviction policy is '%s'", current_policy->name);
-	struct inode *evict;
+	unsigned int generation;
+	struct eviction_policy *policy = policy_get(sb, &generation);
+	uint32_t *inos, blocks = 0;
+	int nr = 0, count = 0;
+
+	pr_debug("Current eviction policy is '%s'", policy->name);
+
+	/* Policies with their own order are not sampled */
+	if (OUICHEFS_SB(sb)->evict_sample && !policy->select) {
+		count = files_to_evict_sampled(policy, sb, victims, max,
+					       nr_blocks);
+		policy_put(policy);
+		return count;
+	}
 
-	down_read(&policy_lock);
-	evict = file_to_evict_inode_store(sb);
-	up_read(&policy_lock);
+	if (!policy->select && !policy->key) {
+		count = files_to_evict_inode_store(policy, sb, victims, max);
+		policy_put(policy);
+		return count;
+	}
 
-	if (!evict) {
-		pr_warn("file_to_evict_inode_store did not return a file.\n");
-		return NULL;
+	inos = kmalloc_array(max, sizeof(*inos), GFP_KERNEL);
+	if (!inos) {
+		policy_put(policy);
+		return -ENOMEM;
 	}
 
-	if (!S_ISREG(evict->i_mode)) {
-		pr_warn("file_to_evict_inode_store did not return a file.\n");
-		iput(evict);
-		return NULL;
+	if (policy->select) {
+		int preferred = ouichefs_index_preferred(sb, inos, max,
+							 nr_blocks, &blocks);
+		int more = 0;
+
+		nr = preferred;
+		if (nr < max && blocks < nr_blocks)
+			more = policy->select(sb, inos + nr, max - nr,
+					      nr_blocks - blocks);
+
+		/* Skip the preferred files the policy picked again */
+		for (int i = preferred; i < preferred + more; i++) {
+			if (!inos_contain(inos, preferred, inos[i]))
+				inos[nr++] = inos[i];
+		}
+	} else {
+		nr = ouichefs_index_collect(sb, policy->key, generation, inos,
+					    max, nr_blocks);
+	}
+	policy_put(policy);
+
+	for (int i = 0; i < nr; i++) {
+		struct inode *evict = ouichefs_iget(sb, inos[i]);
+
+		if (IS_ERR(evict))
+			continue;
+
+		if (!S_ISREG(evict->i_mode)) {
+			pr_warn("The eviction index returned a non-regular file.\n");
+			iput(evict);
+			continue;
+		}
+		/* The class may have changed since the batch was chosen */
+		if (OUICHEFS_INODE(evict)->evict_class ==
+		    OUICHEFS_EVICT_PINNED) {
+			iput(evict);
+			continue;
+		}
+		victims[count++] = evict;
 	}
+	kfree(inos);
 
-	return evict;
+	return count;
 }
 
 /**
  * dir_get_file_to_evict - Searches for a file in a directory to evict based on
- *			   the current eviction policy.
+ *			   the eviction policy of its mount.
  *
  * @dir: directory to search for file to evict.
  *
@@ -100,7 +249,8 @@ struct inode *get_file_to_evict(struct super_block *sb)
  **/
 struct inode *dir_get_file_to_evict(struct inode *dir)
 {
-	pr_debug("Current eviction policy is '%s'", current_policy->name);
+	struct eviction_policy *policy;
+	unsigned int generation;
 	struct inode *remove;
 
 	/* Check if given dir is null. */
@@ -115,26 +265,290 @@ struct inode *dir_get_file_to_evict(struct inode *dir)
 		return ERR_PTR(-ENOTDIR);
 	}
 
-	down_read(&policy_lock);
-	remove = dir_file_to_evict(dir);
-	up_read(&policy_lock);
+	policy = policy_get(dir->i_sb, &generation);
+	pr_debug("Current eviction policy is '%s'", policy->name);
+	remove = dir_file_to_evict(policy, generation, dir);
+	policy_put(policy);
+
+	return remove;
+}
+
+static int dir_child_cmp(const void *a, const void *b)
+{
+	const struct ouichefs_dir_child *first = a, *second = b;
+
+	if (first->rank != second->rank)
+		return first->rank < second->rank ? -1 : 1;
+	if (first->key != second->key)
+		return first->key < second->key ? -1 : 1;
+
+	return first->ino < second->ino ? -1 : first->ino > second->ino;
+}
+
+/**
+ * dir_order_build - sorts the regular-file children of a directory by key.
+ *
+ * @policy: policy to rank the files with.
+ * @generation: generation of the policy.
+ * @dir: directory to sort the children of.
+ * @order: order to fill.
+ *
+ * The children are ranked by their cached summaries, no child is read with
+ * iget. Preferred children come first, pinned ones are left out.
+ *
+ * Return: 0 on success, < 0 on error.
+ */
+static int dir_order_build(struct eviction_policy *policy,
+			   unsigned int generation, struct inode *dir,
+			   struct ouichefs_dir_order *order)
+{
+	struct super_block *sb = dir->i_sb;
+	struct ouichefs_evict_summary summary;
+	struct ouichefs_dir_block *dblock;
+	struct buffer_head *bh;
+
+	bh = sb_bread(sb, OUICHEFS_INODE(dir)->index_block);
+	if (!bh) {
+		pr_warn("The buffer head could not be read.\n");
+		return -EIO;
+	}
+	dblock = (struct ouichefs_dir_block *)bh->b_data;
+
+	/* Changes made while sorting make the order invalid again */
+	order->generation = generation;
+	order->child_seq = ouichefs_index_child_seq(sb, dir->i_ino);
+	order->nr = 0;
+
+	for (int i = 0; i < OUICHEFS_MAX_SUBFILES; i++) {
+		uint32_t ino = dblock->files[i].inode;
+
+		if (!ino)
+			break;
+
+		/* Only regular files that are not pinned are candidates */
+		ouichefs_stat_add(sb, OUICHEFS_STAT_INODES_SCANNED, 1);
+		if (!ouichefs_index_summary(sb, ino, &summary))
+			continue;
+
+		order->children[order->nr].ino = ino;
+		order->children[order->nr].rank =
+			ouichefs_evict_class_rank(summary.evict_class);
+		order->children[order->nr++].key = policy->key(&summary);
+	}
+	brelse(bh);
+
+	sort(order->children, order->nr, sizeof(*order->children),
+	     dir_child_cmp, NULL);
+
+	return 0;
+}
+
+/**
+ * dir_order_valid - checks whether the cached order of a directory still
+ *		     starts with the file to evict.
+ *
+ * @policy: policy the order should be sorted by.
+ * @generation: generation of the policy.
+ * @dir: directory of the order.
+ * @order: order to check.
+ *
+ * Creates and unlinks keep the order up to date. Any other change of a key
+ * that moves a child forward changes the child sequence of the directory.
+ * Keys that only grow keep the head the smallest one, unless it is the head
+ * itself that changed.
+ *
+ * Return: true if the first child of the order can be evicted.
+ */
+static bool dir_order_valid(struct eviction_policy *policy,
+			    unsigned int generation, struct inode *dir,
+			    struct ouichefs_dir_order *order)
+{
+	struct ouichefs_evict_summary summary;
+
+	if (order->nr < 0 || order->generation != generation ||
+	    order->child_seq != ouichefs_index_child_seq(dir->i_sb,
+							 dir->i_ino))
+		return false;
+
+	if (!order->nr)
+		return true;
+
+	return ouichefs_index_summary(dir->i_sb, order->children[0].ino,
+				      &summary) &&
+	       policy->key(&summary) == order->children[0].key;
+}
+
+/**
+ * dir_file_to_evict_keyed - gets the file with the smallest key under a policy
+ *			     in a directory.
+ *
+ * @policy: policy to rank the files with.
+ * @generation: generation of the policy.
+ * @dir: directory to search.
+ *
+ * The directory keeps its children sorted, so that a permanently full
+ * directory finds its victim in constant time. The first children are read
+ * with iget until one has no dirty pages or pages under writeback, else the
+ * first of them is the victim. Pinned and mapped children are skipped.
+ *
+ * Return: pointer to inode of file to evict, NULL if no file could be found.
+ *
+ * Note: We assume that the directory is locked.
+ */
+static struct inode *dir_file_to_evict_keyed(struct eviction_policy *policy,
+					     unsigned int generation,
+					     struct inode *dir)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(dir);
+	struct ouichefs_dir_order *order = ci->dir_order;
+	struct inode *remove;
+	int ret;
+
+	if (!order) {
+		order = kmalloc(sizeof(*order), GFP_KERNEL);
+		if (!order)
+			return ERR_PTR(-ENOMEM);
+		order->nr = -1;
+		ci->dir_order = order;
+	}
+
+	if (!dir_order_valid(policy, generation, dir, order)) {
+		pr_debug("Sorting the children of directory %lu.\n",
+			 dir->i_ino);
+		ret = dir_order_build(policy, generation, dir, order);
+		if (ret)
+			return ERR_PTR(ret);
+	}
+
+	if (!order->nr)
+		return NULL;
 
+	remove = NULL;
+	for (int i = 0; i < min(order->nr, DIR_EVICT_CLEAN_SCAN); i++) {
+		struct inode *next;
+
+		next = ouichefs_iget(dir->i_sb, order->children[i].ino);
+		if (IS_ERR(next))
+			continue;
+
+		/*
+		 * The class may have changed since the order was sorted.
+		 * Mapped files are busy.
+		 */
+		if (OUICHEFS_INODE(next)->evict_class ==
+		    OUICHEFS_EVICT_PINNED ||
+		    mapping_mapped(next->i_mapping)) {
+			iput(next);
+			continue;
+		}
+
+		if (!remove) {
+			remove = next;
+		} else if (!ouichefs_evict_would_stall(next)) {
+			iput(remove);
+			remove = next;
+		} else {
+			iput(next);
+			continue;
+		}
+		if (!ouichefs_evict_would_stall(remove))
+			break;
+	}
 
 	return remove;
 }
 
+/**
+ * ouichefs_dir_order_insert - adds a new child to the cached order of its
+ *			       directory.
+ *
+ * @dir: directory the child was created in.
+ * @inode: new child.
+ *
+ * Note: We assume that the directory is locked.
+ */
+void ouichefs_dir_order_insert(struct inode *dir, struct inode *inode)
+{
+	struct ouichefs_dir_order *order = OUICHEFS_INODE(dir)->dir_order;
+	struct ouichefs_evict_summary summary;
+	struct eviction_policy *policy;
+	unsigned int generation;
+	struct ouichefs_dir_child child;
+	int pos;
+
+	if (!order || order->nr < 0 || !S_ISREG(inode->i_mode) ||
+	    OUICHEFS_INODE(inode)->evict_class == OUICHEFS_EVICT_PINNED)
+		return;
+
+	policy = policy_get(dir->i_sb, &generation);
+	if (!policy->key || order->generation != generation ||
+	    order->nr == OUICHEFS_MAX_SUBFILES) {
+		order->nr = -1;
+		policy_put(policy);
+		return;
+	}
+
+	ouichefs_inode_summary(inode, &summary);
+	child.ino = inode->i_ino;
+	child.rank = ouichefs_evict_class_rank(summary.evict_class);
+	child.key = policy->key(&summary);
+	policy_put(policy);
+
+	for (pos = order->nr; pos > 0; pos--) {
+		if (dir_child_cmp(&order->children[pos - 1], &child) <= 0)
+			break;
+		order->children[pos] = order->children[pos - 1];
+	}
+	order->children[pos] = child;
+	order->nr++;
+}
+
+/**
+ * ouichefs_dir_order_remove - removes an unlinked child from the cached order
+ *			       of its directory.
+ *
+ * @dir: directory the child was unlinked from.
+ * @ino: inode number of the child.
+ *
+ * Note: We assume that the directory is locked.
+ */
+void ouichefs_dir_order_remove(struct inode *dir, uint32_t ino)
+{
+	struct ouichefs_dir_order *order = OUICHEFS_INODE(dir)->dir_order;
+
+	if (!order || order->nr <= 0)
+		return;
+
+	for (int i = 0; i < order->nr; i++) {
+		if (order->children[i].ino != ino)
+			continue;
+
+		memmove(&order->children[i], &order->children[i + 1],
+			(order->nr - i - 1) * sizeof(*order->children));
+		order->nr--;
+		return;
+	}
+}
+
 /**
  * dir_file_to_evict - searches a given directory for a file to evict based on
- *		       the current policy.
+ *		       a policy.
  *
+ * @policy: policy to rank the files with.
+ * @generation: generation of the policy.
  * @dir: directory to search.
  *
- * Return: pointer to inode of file to evict, NULL if no file could be found.
+ * Without a key function, files with dirty pages or pages under writeback are
+ * only chosen if every file of the directory has some.
  *
- * Note: We assure that the policy is already locked for reading.
+ * Return: pointer to inode of file to evict, NULL if no file could be found.
  */
-struct inode *dir_file_to_evict(struct inode *dir)
+struct inode *dir_file_to_evict(struct eviction_policy *policy,
+				unsigned int generation, struct inode *dir)
 {
+	if (policy->key)
+		return dir_file_to_evict_keyed(policy, generation, dir);
+
 	/* Read the directory index block on disk */
 	struct ouichefs_inode_info *ci = OUICHEFS_INODE(dir);
 	struct super_block *superblock = dir->i_sb;
@@ -149,6 +563,10 @@ struct inode *dir_file_to_evict(struct inode *dir)
 
 
 	struct inode *remove = NULL;
+	bool remove_stalls = false, stalls;
+	int remove_rank = 0, rank;
+	uint8_t evict_class;
+
 	/* Iterate over the index block */
 	for (int i = 0; i < OUICHEFS_MAX_SUBFILES; i++) {
 		struct ouichefs_file *f = &dblock->files[i];
@@ -167,23 +585,46 @@ struct inode *dir_file_to_evict(struct inode *dir)
 		 */
 		struct inode *inode = ouichefs_iget(superblock, f->inode);
 
+		ouichefs_stat_add(superblock, OUICHEFS_STAT_INODES_SCANNED, 1);
+
 		/* Check till first null inode */
 		if (!inode) {
 			pr_warn("The directory is not full.\n");
 			break;
 		}
 
-		/* Check that the node is a file */
-		if (!S_ISREG(inode->i_mode)) {
+		/* Check that the node is a file that may be evicted */
+		evict_class = OUICHEFS_INODE(inode)->evict_class;
+		if (!S_ISREG(inode->i_mode) ||
+		    evict_class == OUICHEFS_EVICT_PINNED ||
+		    mapping_mapped(inode->i_mapping)) {
 			iput(inode);
 			continue;
 		}
 
-		if (!remove) {
+		rank = ouichefs_evict_class_rank(evict_class);
+		stalls = ouichefs_evict_would_stall(inode);
+		if (!remove || rank < remove_rank) {
+			if (remove)
+				iput(remove);
 			remove = inode;
+			remove_rank = rank;
+			remove_stalls = stalls;
+			continue;
+		}
+		if (rank > remove_rank) {
+			iput(inode);
 			continue;
 		}
-		if (current_policy->compare(remove, inode) == inode) {
+		/* Files that would stall on I/O lose against clean ones */
+		if (remove_stalls != stalls) {
+			if (remove_stalls)
+				swap(remove, inode);
+			remove_stalls = false;
+			iput(inode);
+			continue;
+		}
+		if (policy->compare(remove, inode) == inode) {
 			iput(remove);
 			remove = inode;
 		} else {
@@ -202,105 +643,146 @@ struct inode *dir_file_to_evict(struct inode *dir)
 }
 
 /**
- * file_to_evict_inode_store - searches the inode store of a given super block
- *			       for a file to evict based on the current policy.
+ * batch_insert - inserts an inode in a batch of victims sorted by a policy,
+ *		  keeping only the max first victims.
  *
- * @superblock: superblock of the inode store to search.
+ * @policy: policy to sort the batch with.
+ * @victims: batch of victims, the first one is evicted first.
+ * @nr: number of victims in the batch.
+ * @max: maximum number of victims in the batch.
+ * @inode: inode to insert.
  *
- * Return: pointer to file to evict, NULL if no file could be found.
+ * Note: The inode is put if it does not make it into the batch.
+ */
+static void batch_insert(struct eviction_policy *policy,
+			 struct inode **victims, int *nr, int max,
+			 struct inode *inode)
+{
+	int rank, pos = *nr;
+
+	rank = ouichefs_evict_class_rank(OUICHEFS_INODE(inode)->evict_class);
+
+	/* Preferred files go before all others, then the policy decides */
+	while (pos > 0) {
+		int prev_rank = ouichefs_evict_class_rank(
+			OUICHEFS_INODE(victims[pos - 1])->evict_class);
+
+		if (prev_rank < rank ||
+		    (prev_rank == rank &&
+		     policy->compare(victims[pos - 1], inode) != inode))
+			break;
+		pos--;
+	}
+
+	if (pos >= max) {
+		iput(inode);
+		return;
+	}
+
+	/* Drop the last victim to make room */
+	if (*nr == max) {
+		iput(victims[max - 1]);
+		(*nr)--;
+	}
+
+	memmove(&victims[pos + 1], &victims[pos],
+		(*nr - pos) * sizeof(*victims));
+	victims[pos] = inode;
+	(*nr)++;
+}
+
+/**
+ * files_to_evict_inode_store - searches the inode store of a given super block
+ *				for the files to evict based on a policy.
+ *
+ * @policy: policy to rank the files with.
+ * @superblock: superblock of the inode store to search.
+ * @victims: array filled with the files to evict, first to evict first.
+ * @max: size of the victims array.
  *
- * Note: We assume that the current policy has already been locked for reading.
+ * Return: number of files in victims, < 0 on error.
  */
-static struct inode *file_to_evict_inode_store(struct super_block *superblock)
+static int files_to_evict_inode_store(struct eviction_policy *policy,
+				      struct super_block *superblock,
+				      struct inode **victims, int max)
 {
 	if (!superblock) {
 		pr_warn("The given superblock was NULL.\n");
-		return NULL;
+		return 0;
 	}
 
 	/* Search inode store for inode to evict */
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(superblock);
+	int nr = 0;
 
 	/* Loop through all inode store blocks */
-	struct inode *remove = NULL;
-
-	for (int inode_block = 0; inode_block < sbi->nr_istore_blocks;
+	for (int inode_block = 1; inode_block <= sbi->nr_istore_blocks;
 				 inode_block++) {
-		struct inode *inode = search_inode_store_block(superblock,
-							       inode_block + 1);
-		if (!remove) {
-			remove = inode;
-			continue;
-		}
-
-		if (!inode || IS_ERR(inode))
-			continue;
+		int errc = search_inode_store_block(policy, superblock,
+						    inode_block, victims, &nr,
+						    max);
 
-		if (current_policy->compare(remove, inode) == inode) {
-			iput(remove);
-			remove = inode;
-		} else {
-			iput(inode);
-		}
+		if (errc)
+			pr_warn("Could not search inode store block %d.\n",
+				inode_block);
 
 		/* Check if no more alive inodes are available */
 		if (find_next_zero_bit(sbi->ifree_bitmap, sbi->nr_inodes,
-			((inode_block) - 1) * OUICHEFS_INODES_PER_BLOCK)
+			inode_block * OUICHEFS_INODES_PER_BLOCK(sbi))
 			== sbi->nr_inodes)
 			break;
 	}
 
-	return remove;
+	return nr;
 }
 
 /**
- *  search_inode_store_block - searches a block of the inode store for the
- *			       file to evict based on the current policy.
+ *  search_inode_store_block - searches a block of the inode store for
+ *			       files to evict based on a policy.
  *
+ * @policy: policy to rank the files with.
  * @superblock: superblock of the filesystem
  * @inode_block: index of the inode block in the inode store
+ * @victims: batch the candidates of this block are inserted in
+ * @nr: number of victims in the batch
+ * @max: maximum number of victims in the batch
  *
- * Return: pointer to inode to remove, NULL if non could be found.
+ * Return: 0 on success, < 0 on error.
  */
-static struct inode *search_inode_store_block(struct super_block *superblock,
-					      uint32_t inode_block)
+static int search_inode_store_block(struct eviction_policy *policy,
+				    struct super_block *superblock,
+				    uint32_t inode_block,
+				    struct inode **victims, int *nr, int max)
 {
 	if (!superblock)
-		return NULL;
+		return -EINVAL;
 
 	if (inode_block < 1)
-		return NULL;
+		return -EINVAL;
 
 	struct buffer_head *bh = sb_bread(superblock, inode_block);
 
 	if (!bh)
-		return ERR_PTR(-EIO);
+		return -EIO;
+	ouichefs_stat_add(superblock, OUICHEFS_STAT_ISTORE_READS, 1);
 
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(superblock);
-	struct ouichefs_inode *disk_inode = (struct ouichefs_inode *)bh->b_data;
-	struct inode *remove = NULL;
-	uint32_t ino;
+	uint32_t ino, scanned = 0;
 
 	istore_for_each_inode(ino, sbi, inode_block) {
 		pr_debug("Checking inode with ino %d\n", ino);
-		uint32_t inode_shift = ino -
-				(inode_block - 1) * OUICHEFS_INODES_PER_BLOCK;
-		struct ouichefs_inode *current_inode = disk_inode + inode_shift;
-
-
-		/**
-		 * Something would be very wrong if this happened.
-		 * We'll just ignore it.
-		 */
-		if (!current_inode)
-			continue;
+		struct ouichefs_inode *current_inode =
+			ouichefs_istore_inode(sbi, bh, ino);
 
 		/* Skip empty inodes */
 		if (current_inode->index_block == 0)
 			continue;
+		scanned++;
 
-		/* Only regular files can be evicted. */
-		if (!S_ISREG(current_inode->i_mode))
+		/* Only regular files can be evicted, pinned ones are skipped */
+		if (!S_ISREG(current_inode->i_mode) ||
+		    ouichefs_index_class(superblock, ino) ==
+		    OUICHEFS_EVICT_PINNED)
 			continue;
 
 		struct inode *inode = ouichefs_iget(superblock, ino);
@@ -308,70 +790,561 @@ static struct inode *search_inode_store_block(struct super_block *superblock,
 		if (!inode || IS_ERR(inode))
 			continue;
 
-		if (!remove) {
-			remove = inode;
+		batch_insert(policy, victims, nr, max, inode);
+	}
+
+	brelse(bh);
+	ouichefs_stat_add(superblock, OUICHEFS_STAT_INODES_SCANNED, scanned);
+	return 0;
+}
+
+/**
+ * sample_best - picks the best victim among drawn candidates.
+ *
+ * @policy: policy to rank the candidates with.
+ * @sb: super block of the file system.
+ * @victims: victims already picked, they are not picked again.
+ * @count: number of victims already picked.
+ * @inos: inode numbers of the drawn candidates.
+ * @summaries: index summaries of the drawn candidates.
+ * @nr: number of drawn candidates.
+ * @blocks: set to the number of blocks of the victim.
+ *
+ * Preferred files go first, then keyed policies rank the candidates by their
+ * summaries and only the victim is read with iget, other policies compare the
+ * candidates' inodes.
+ *
+ * Return: the victim, NULL if all candidates were already picked.
+ */
+static struct inode *sample_best(struct eviction_policy *policy,
+				 struct super_block *sb,
+				 struct inode **victims, int count,
+				 const uint32_t *inos,
+				 const struct ouichefs_evict_summary *summaries,
+				 int nr, uint32_t *blocks)
+{
+	struct inode *best = NULL, *inode;
+	int best_rank = 0, best_i = -1;
+	u64 best_key = 0;
+
+	for (int i = 0; i < nr; i++) {
+		int rank = ouichefs_evict_class_rank(summaries[i].evict_class);
+		bool picked = false;
+		u64 key;
+
+		for (int j = 0; j < count && !picked; j++)
+			picked = victims[j]->i_ino == inos[i];
+		if (picked)
+			continue;
+
+		if (policy->key) {
+			key = policy->key(&summaries[i]);
+			if (best_i < 0 || rank < best_rank ||
+			    (rank == best_rank && key < best_key)) {
+				best_i = i;
+				best_rank = rank;
+				best_key = key;
+			}
 			continue;
 		}
 
-		if (current_policy->compare(remove, inode) == inode) {
-			iput(remove);
-			remove = inode;
+		inode = ouichefs_iget(sb, inos[i]);
+		if (IS_ERR(inode))
+			continue;
+		if (!best || rank < best_rank ||
+		    (rank == best_rank &&
+		     policy->compare(best, inode) == inode)) {
+			if (best)
+				iput(best);
+			best = inode;
+			best_i = i;
+			best_rank = rank;
 		} else {
 			iput(inode);
 		}
 	}
 
-	brelse(bh);
-	return remove;
+	if (best_i < 0)
+		return NULL;
+
+	if (!best) {
+		best = ouichefs_iget(sb, inos[best_i]);
+		if (IS_ERR(best))
+			return NULL;
+	}
+	*blocks = summaries[best_i].blocks;
+	return best;
 }
 
+/**
+ * files_to_evict_sampled - picks every victim as the best of a random sample
+ *			    of the files.
+ *
+ * @policy: policy to rank the files with.
+ * @sb: super block of the file system.
+ * @victims: array filled with the files to evict, first to evict first.
+ * @max: size of the victims array.
+ * @nr_blocks: number of blocks the files should free together.
+ *
+ * Each victim is the best of evict_sample candidates drawn uniformly from the
+ * eviction index, which approximates the order of a full scan at a cost that
+ * does not depend on the size of the volume. No inode store block is read,
+ * the candidates are ranked by the summaries the index is kept up to date
+ * with.
+ *
+ * Return: number of files in victims, < 0 on error.
+ */
+static int files_to_evict_sampled(struct eviction_policy *policy,
+				  struct super_block *sb,
+				  struct inode **victims, int max,
+				  uint32_t nr_blocks)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_evict_summary *summaries;
+	uint32_t *inos, blocks = 0, victim_blocks;
+	struct inode *victim;
+	int nr, count = 0;
+
+	inos = kmalloc_array(sbi->evict_sample, sizeof(*inos), GFP_KERNEL);
+	summaries = kmalloc_array(sbi->evict_sample, sizeof(*summaries),
+				  GFP_KERNEL);
+	if (!inos || !summaries) {
+		count = -ENOMEM;
+		goto free;
+	}
+
+	while (count < max && blocks < nr_blocks) {
+		nr = ouichefs_index_draw(sb, inos, summaries,
+					 sbi->evict_sample);
+		ouichefs_stat_add(sb, OUICHEFS_STAT_INODES_SCANNED, nr);
+
+		victim = sample_best(policy, sb, victims, count, inos,
+				     summaries, nr, &victim_blocks);
+		if (!victim)
+			break;
+		victims[count++] = victim;
+		blocks += victim_blocks;
+	}
 
+free:
+	kfree(summaries);
+	kfree(inos);
+	return count;
+}
 
 /**
+ * policy_find - Looks up a policy by name.
+ *
+ * @name: Name of the policy.
+ *
+ * Return: The policy, NULL if no such policy is registered.
+ *
+ * Note: We assume that policy_mutex is held.
+ */
+static struct eviction_policy *policy_find(const char *name)
+{
+	struct eviction_policy *policy;
+
+	for (int i = 0; i < ARRAY_SIZE(builtin_policies); i++) {
+		if (!strcmp(name, builtin_policies[i]->name))
+			return builtin_policies[i];
+	}
+
+	list_for_each_entry(policy, &policy_list, list) {
+		if (!strcmp(name, policy->name))
+			return policy;
+	}
+
+	return NULL;
+}
+
+/**
+ * policy_set - Switches a mount to another policy.
+ *
+ * @sbi: Super block info of the mount.
+ * @policy: New policy of the mount.
+ *
+ * The generation is changed after the policy is published, so that a key
+ * computed with the new policy is never labelled with the old generation.
+ *
+ * Note: We assume that policy_mutex is held.
+ */
+static void policy_set(struct ouichefs_sb_info *sbi,
+		       struct eviction_policy *policy)
+{
+	rcu_assign_pointer(sbi->policy, policy);
+	smp_wmb();
+	WRITE_ONCE(sbi->policy_generation, sbi->policy_generation + 1);
+}
+
+/**
+ * policy_switch - Switches a mount to another policy and moves the state of
+ *		   the policies.
+ *
+ * @sbi: Super block info of the mount.
+ * @policy: New policy of the mount.
+ *
+ * If either policy keeps state, the mount uses the stateless LRU policy until
+ * the old policy no longer runs for it. Its state is then freed and replaced
+ * by the one of the new policy, which gets all files with insert().
+ *
+ * Note: We assume that policy_mutex is held.
+ *
+ * Return: 0 on success, < 0 if the new policy could not be attached.
+ */
+static int policy_switch(struct ouichefs_sb_info *sbi,
+			 struct eviction_policy *policy)
+{
+	struct eviction_policy *old = rcu_dereference_protected(
+		sbi->policy, lockdep_is_held(&policy_mutex));
+	void *private = NULL;
+
+	if (old == policy)
+		return 0;
+
+	if (policy->attach) {
+		private = policy->attach(sbi->sb);
+		if (IS_ERR(private))
+			return PTR_ERR(private);
+	}
+
+	if (old->attach || policy->attach) {
+		policy_set(sbi, &least_recently_used_policy);
+
+		/* Wait for the hooks, then for select() of a running batch */
+		synchronize_rcu();
+		mutex_lock(&sbi->evict_lock);
+		mutex_unlock(&sbi->evict_lock);
+
+		if (old->detach)
+			old->detach(sbi->policy_private);
+		sbi->policy_private = private;
+	}
+
+	/* Publishes policy_private along with the policy */
+	policy_set(sbi, policy);
+	if (policy->insert)
+		ouichefs_policy_seed(sbi->sb);
+
+	return 0;
+}
+
+/**
+ * ouichefs_policy_attach - Sets the initial policy of a mount.
+ *
+ * @sb: Super block being mounted.
+ * @name: Name of the policy, NULL for the default LRU policy.
+ *
+ * The files are passed to the policy by ouichefs_policy_seed() once the
+ * eviction index is built.
+ *
+ * Return: 0 on success, -EINVAL if no such policy is registered, < 0 if the
+ *	   policy could not be attached.
+ */
+int ouichefs_policy_attach(struct super_block *sb, const char *name)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct eviction_policy *policy = &least_recently_used_policy;
+	void *private = NULL;
+
+	mutex_lock(&policy_mutex);
+	if (name) {
+		policy = policy_find(name);
+		if (!policy) {
+			mutex_unlock(&policy_mutex);
+			pr_err("Unknown eviction policy '%s'\n", name);
+			return -EINVAL;
+		}
+	}
+	if (policy->attach) {
+		private = policy->attach(sb);
+		if (IS_ERR(private)) {
+			mutex_unlock(&policy_mutex);
+			return PTR_ERR(private);
+		}
+	}
+	sbi->policy_private = private;
+	RCU_INIT_POINTER(sbi->policy, policy);
+	list_add(&sbi->policy_node, &policy_mounts);
+	mutex_unlock(&policy_mutex);
+
+	return 0;
+}
+
+/**
+ * ouichefs_policy_detach - Forgets a mount at unmount and frees the state of
+ *			    its policy.
+ *
+ * @sb: Super block being unmounted.
+ */
+void ouichefs_policy_detach(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct eviction_policy *policy;
+
+	mutex_lock(&policy_mutex);
+	list_del(&sbi->policy_node);
+	policy = rcu_dereference_protected(sbi->policy,
+					   lockdep_is_held(&policy_mutex));
+	if (policy->detach)
+		policy->detach(sbi->policy_private);
+	sbi->policy_private = NULL;
+	mutex_unlock(&policy_mutex);
+}
+
+static void policy_seed_one(struct super_block *sb, uint32_t ino, void *data)
+{
+	struct eviction_policy *policy = data;
+
+	policy->insert(sb, ino, 0);
+}
+
+/**
+ * ouichefs_policy_seed - Passes all regular files of a mount to its policy.
+ *
+ * @sb: Super block of the mount.
+ *
+ * The files are inserted in the current eviction order, first to evict first.
+ */
+void ouichefs_policy_seed(struct super_block *sb)
+{
+	struct eviction_policy *policy = policy_get(sb, NULL);
+
+	if (policy->insert)
+		ouichefs_index_for_each(sb, policy_seed_one, policy);
+	policy_put(policy);
+}
+
+/**
+ * ouichefs_policy_private - Gets the state of the policy of a mount.
+ *
+ * @sb: Super block of the mount.
+ *
+ * Only valid in the functions of the policy, see attach().
+ *
+ * Return: The state returned by attach().
+ */
+void *ouichefs_policy_private(struct super_block *sb)
+{
+	return READ_ONCE(OUICHEFS_SB(sb)->policy_private);
+}
+EXPORT_SYMBOL(ouichefs_policy_private);
+
+/**
+ * policy_hooks - Gets the policy of a mount to call one of its hooks.
+ *
+ * @sbi: Super block info of the mount.
+ *
+ * Note: We assume that the RCU read lock is held.
+ */
+static struct eviction_policy *policy_hooks(struct ouichefs_sb_info *sbi)
+{
+	struct eviction_policy *policy = rcu_dereference(sbi->policy);
+
+	/* Pairs with rcu_assign_pointer(), orders the load of policy_private */
+	smp_rmb();
+	return policy;
+}
+
+/**
+ * policy_name_hash - Hashes the parent and name of a file.
+ *
+ * Return: The hash, never 0.
+ */
+static u32 policy_name_hash(struct inode *dir, struct dentry *dentry)
+{
+	return jhash(dentry->d_name.name, dentry->d_name.len, dir->i_ino) | 1;
+}
+
+/**
+ * ouichefs_policy_created - Tells the policy of a mount about a new file.
+ *
+ * @dir: Parent directory of the file.
+ * @dentry: Dentry of the file.
+ */
+void ouichefs_policy_created(struct inode *dir, struct dentry *dentry)
+{
+	struct inode *inode = d_inode(dentry);
+	struct eviction_policy *policy;
+
+	if (!S_ISREG(inode->i_mode))
+		return;
+
+	rcu_read_lock();
+	policy = policy_hooks(OUICHEFS_SB(dir->i_sb));
+	if (policy->insert)
+		policy->insert(dir->i_sb, inode->i_ino,
+			       policy_name_hash(dir, dentry));
+	rcu_read_unlock();
+}
+
+/**
+ * ouichefs_policy_accessed - Tells the policy of a mount about an access.
+ *
+ * @inode: Regular file that was read or written.
+ */
+void ouichefs_policy_accessed(struct inode *inode)
+{
+	struct eviction_policy *policy;
+
+	rcu_read_lock();
+	policy = policy_hooks(OUICHEFS_SB(inode->i_sb));
+	if (policy->access)
+		policy->access(inode->i_sb, inode->i_ino);
+	rcu_read_unlock();
+}
+
+/**
+ * ouichefs_policy_removed - Tells the policy of a mount that a file is gone.
+ *
+ * @dir: Parent directory of the file.
+ * @dentry: Dentry of the file, still positive.
+ * @evicted: Whether the file is evicted or deleted.
+ */
+void ouichefs_policy_removed(struct inode *dir, struct dentry *dentry,
+			     bool evicted)
+{
+	struct inode *inode = d_inode(dentry);
+	struct eviction_policy *policy;
+
+	if (!S_ISREG(inode->i_mode))
+		return;
+
+	rcu_read_lock();
+	policy = policy_hooks(OUICHEFS_SB(dir->i_sb));
+	if (policy->remove)
+		policy->remove(dir->i_sb, inode->i_ino,
+			       evicted ? policy_name_hash(dir, dentry) : 0);
+	rcu_read_unlock();
+}
+
+/**
+ * ouichefs_policy_select - Switches a mounted file system to another policy.
+ *
+ * @sb: Super block of the mount.
+ * @name: Name of the policy.
+ *
+ * Return: 0 on success, -EINVAL if no such policy is registered, < 0 if the
+ *	   policy could not be attached.
+ */
+int ouichefs_policy_select(struct super_block *sb, const char *name)
+{
+	struct eviction_policy *policy;
+	int ret = -EINVAL;
+
+	mutex_lock(&policy_mutex);
+	policy = policy_find(name);
+	if (policy)
+		ret = policy_switch(OUICHEFS_SB(sb), policy);
+	mutex_unlock(&policy_mutex);
+
+	return ret;
+}
+
+/**
+ * ouichefs_policy_name - Copies the name of the policy of a mount.
+ *
+ * @sb: Super block of the mount.
+ * @buf: Buffer of at least MAX_EVICTION_NAME bytes.
+ */
+void ouichefs_policy_name(struct super_block *sb, char *buf)
+{
+	rcu_read_lock();
+	strscpy(buf, rcu_dereference(OUICHEFS_SB(sb)->policy)->name,
+		MAX_EVICTION_NAME);
+	rcu_read_unlock();
+}
+
+/**
+ * ouichefs_policy_list - Prints the names of all available policies.
+ *
+ * @buf: sysfs buffer to print to.
+ *
+ * Return: number of bytes printed.
+ */
+ssize_t ouichefs_policy_list(char *buf)
+{
+	struct eviction_policy *policy;
+	ssize_t len;
+
+	mutex_lock(&policy_mutex);
+	len = sysfs_emit(buf, "%s", builtin_policies[0]->name);
+	for (int i = 1; i < ARRAY_SIZE(builtin_policies); i++)
+		len += sysfs_emit_at(buf, len, " %s",
+				     builtin_policies[i]->name);
+	list_for_each_entry(policy, &policy_list, list)
+		len += sysfs_emit_at(buf, len, " %s", policy->name);
+	len += sysfs_emit_at(buf, len, "\n");
+	mutex_unlock(&policy_mutex);
+
+	return len;
+}
+
+/**
+ * register_policy - makes a policy available to the mounts.
+ *
  * @policy: policy to register.
  *
  * Return: 0 is successfully registered, -POLICY_ALREADY_REGISTERED if a policy
- *	   is already registered.
+ *	   with the same name is already registered.
  *
  */
 int register_policy(struct eviction_policy *policy)
 {
+	int ret = 0;
+
 	if (!policy)
 		return -EFAULT;
 
-	if (!policy->compare)
+	/* Directories are always searched by key or compare */
+	if (!policy->compare && !policy->key)
 		return -EFAULT;
 
-	/* Check if another policy is already registered */
-	if (current_policy != &least_recently_used_policy) {
-		pr_debug("A policy is already registered.");
-		return -POLICY_ALREADY_REGISTERED;
+	mutex_lock(&policy_mutex);
+	if (policy_find(policy->name)) {
+		pr_debug("A policy named '%s' is already registered.",
+			 policy->name);
+		ret = -POLICY_ALREADY_REGISTERED;
+	} else {
+		list_add_tail(&policy->list, &policy_list);
 	}
+	mutex_unlock(&policy_mutex);
 
-
-	down_write(&policy_lock);
-	current_policy = policy;
-	up_write(&policy_lock);
-
-	return 0;
+	return ret;
 }
 EXPORT_SYMBOL(register_policy);
 
 /**
- *  unregister_policy - unregisters a given policy and restores the default
- *			policy.
+ *  unregister_policy - unregisters a given policy, the mounts using it are
+ *			switched back to the default policy.
  *
  * @policy: policy to unregister.
+ *
+ * Waits until no eviction uses the policy anymore.
  */
 void unregister_policy(struct eviction_policy *policy)
 {
-	if (policy != current_policy) {
-		pr_err("Tried to unregister a policy that is not in use.\n");
+	struct ouichefs_sb_info *sbi;
+
+	mutex_lock(&policy_mutex);
+	if (policy_find(policy->name) != policy) {
+		mutex_unlock(&policy_mutex);
+		pr_err("Tried to unregister a policy that is not registered.\n");
 		return;
 	}
 
-	down_write(&policy_lock);
-	current_policy = &least_recently_used_policy;
-	up_write(&policy_lock);
+	list_del(&policy->list);
+	list_for_each_entry(sbi, &policy_mounts, policy_node) {
+		if (rcu_access_pointer(sbi->policy) == policy)
+			policy_switch(sbi, &least_recently_used_policy);
+	}
+	mutex_unlock(&policy_mutex);
+
+	/*
+	 * Wait for the readers that dereferenced the policy before it was
+	 * replaced. Longer users hold a reference on the module of the policy,
+	 * so that it cannot be unloaded under them.
+	 */
+	synchronize_rcu();
 }
 EXPORT_SYMBOL(unregister_policy);
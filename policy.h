@@ -2,10 +2,86 @@
 #ifndef _OUICHEFS_POLICY_H
 #define _OUICHEFS_POLICY_H
 
+#include <linux/list.h>
+#include <linux/bitops.h>
+
 #define MAX_EVICTION_NAME 16
 #define MAX_EVICTION_DESCRIPTION 256
 
 #define POLICY_ALREADY_REGISTERED 3
+
+/**
+ * Summary of the inode fields a policy can rank files by. The eviction index
+ * keeps one per regular file so that candidates can be ranked without reading
+ * the inode store or calling iget.
+ */
+struct ouichefs_evict_summary {
+	uint32_t atime; /* Access time */
+	uint32_t mtime; /* Modification time */
+	uint32_t size; /* Size in bytes */
+	uint32_t blocks; /* Block count (incl. index block) */
+	uint32_t freq; /* Access count as of freq_epoch */
+	uint32_t freq_epoch; /* Aging period freq was last updated in */
+	uint8_t evict_class; /* enum ouichefs_evict_class */
+};
+
+/* Access counts are halved every period, in seconds */
+#define OUICHEFS_FREQ_PERIOD 3600
+/* Access counts saturate at this value */
+#define OUICHEFS_FREQ_MAX 0xffff
+
+/**
+ * policy_freq_decay - ages an access count.
+ *
+ * @freq: access count.
+ * @periods: number of aging periods that passed since it was updated.
+ *
+ * Return: the access count after periods halvings.
+ */
+static inline uint32_t policy_freq_decay(uint32_t freq, uint32_t periods)
+{
+	return periods >= 32 ? 0 : freq >> periods;
+}
+
+/**
+ * policy_log2 - base 2 logarithm in fixed point with 8 fractional bits.
+ *
+ * @x: value to take the logarithm of, > 0.
+ *
+ * The fractional bits are linearly interpolated, which keeps the result
+ * strictly increasing in x up to 2^9 and non-decreasing above.
+ */
+static inline uint32_t policy_log2(uint32_t x)
+{
+	uint32_t order = fls(x) - 1;
+	uint32_t frac;
+
+	if (order >= 8)
+		frac = x >> (order - 8);
+	else
+		frac = x << (8 - order);
+
+	return (order << 8) | (frac & 0xff);
+}
+
+/**
+ * policy_freq_rank - ranks a file by its current access count.
+ *
+ * @summary: summary of the file.
+ *
+ * The rank is log2 of the access count, plus one for every period between the
+ * epoch and freq_epoch. Decaying all counts by the same number of periods
+ * does not change their order, so ranks computed at different times can be
+ * compared: the file with the lowest rank has the lowest current count.
+ *
+ * Return: the rank in fixed point with 8 fractional bits.
+ */
+static inline uint32_t
+policy_freq_rank(const struct ouichefs_evict_summary *summary)
+{
+	return (summary->freq_epoch << 8) + policy_log2(summary->freq + 1);
+}
+
 /**
  * Struct defining an eviction policy for the rotating fs feature.
  * The struct implments a compare function which is used to find
@@ -15,6 +91,12 @@
  *
  * Additionally, comparing struct inodes instead of sturct ouichefs_inodes
  * is more inefficient but allows for more policies to be implemented.
+ *
+ * Policies should therefore rather provide a key function, which ranks files
+ * by their summary alone. The summaries are filled from the on-disk inodes at
+ * mount and kept up to date afterwards, so keyed policies never need to iget
+ * a candidate that is not evicted. At least one of compare() and key() must
+ * be provided.
  */
 struct eviction_policy {
 	/* Name of eviction policy */
@@ -23,22 +105,136 @@ struct eviction_policy {
 	/* Description of eviction policy*/
 	char description[MAX_EVICTION_DESCRIPTION];
 
+	/* Module implementing the policy, set to THIS_MODULE */
+	struct module *owner;
+
+	/* Entry in the list of registered policies */
+	struct list_head list;
+
 	/**
 	 * @inode1: First inode to compare.
 	 * @inode2: Second inode to compare.
 	 *
-	 * Comparison function used to search for file to evict.
+	 * Optional comparison function used to search for file to evict
+	 * if the policy does not provide a key function.
 	 * The function should return the inode which should be evicted.
 	 * The search alogirthm will pass the current to-be-evicted inode
 	 * as the first argument and the inode to compare with as the second.
 	 */
 	struct inode *(*compare)(struct inode *inode1, struct inode *inode2);
+
+	/**
+	 * @summary: Cached summary of the inode to rank.
+	 *
+	 * Optional key function. The file with the smallest key is evicted
+	 * first, so the ordering must agree with compare() if both are
+	 * provided. Policies providing it let the eviction index keep
+	 * candidates sorted incrementally and rank directory entries without
+	 * iget, others fall back to a search of the whole inode store.
+	 */
+	u64 (*key)(const struct ouichefs_evict_summary *summary);
+
+	/**
+	 * @sb: Super block to evict files from.
+	 * @inos: Array to fill with the inode numbers of the files to evict.
+	 * @max: Size of the inos array.
+	 * @nr_blocks: Number of blocks the files should free together.
+	 *
+	 * Optional function for policies that keep their own order instead
+	 * of ranking files. It returns the number of inode numbers in inos
+	 * and is used instead of key() and compare() for volume-wide
+	 * eviction. Directories are still searched with key() or compare().
+	 */
+	int (*select)(struct super_block *sb, uint32_t *inos, int max,
+		      uint32_t nr_blocks);
+
+	/**
+	 * @sb: Super block of the mount switching to the policy.
+	 *
+	 * Optional function for policies that keep state per mount. It
+	 * returns the state, or an ERR_PTR() on error, which the other
+	 * functions get with ouichefs_policy_private(). All regular files
+	 * are passed to insert() once the mount uses the policy.
+	 */
+	void *(*attach)(struct super_block *sb);
+
+	/**
+	 * @private: State returned by attach().
+	 *
+	 * Frees the state once the mount stopped using the policy. No other
+	 * function of the policy runs for the mount anymore.
+	 */
+	void (*detach)(void *private);
+
+	/**
+	 * @sb: Super block of the file.
+	 * @ino: Inode number of the file.
+	 * @name_hash: Hash of the parent and name of the file, 0 if the file
+	 *	       already existed when the mount switched to the policy.
+	 *
+	 * Optional, called when a regular file is created. A file created
+	 * with the name of an evicted one gets the same name_hash.
+	 */
+	void (*insert)(struct super_block *sb, uint32_t ino, u32 name_hash);
+
+	/**
+	 * @sb: Super block of the file.
+	 * @ino: Inode number of the file.
+	 *
+	 * Optional, called when a regular file is read or written.
+	 */
+	void (*access)(struct super_block *sb, uint32_t ino);
+
+	/**
+	 * @sb: Super block of the file.
+	 * @ino: Inode number of the file.
+	 * @name_hash: Hash of the parent and name if the file is evicted,
+	 *	       0 if it is deleted.
+	 *
+	 * Optional, called when a regular file is evicted or deleted. An
+	 * evicted file is also removed again with name_hash 0 when it is
+	 * unlinked.
+	 *
+	 * insert(), access() and remove() are called under rcu_read_lock()
+	 * and must not sleep.
+	 */
+	void (*remove)(struct super_block *sb, uint32_t ino, u32 name_hash);
 };
 
-struct inode *get_file_to_evict(struct super_block *parent);
+/* Policies built into the module, see policy_builtin.c */
+extern struct eviction_policy least_recently_used_policy;
+extern struct eviction_policy clock_policy;
+
+int get_files_to_evict(struct super_block *sb, struct inode **victims, int max,
+		       uint32_t nr_blocks);
 
 struct inode *dir_get_file_to_evict(struct inode *dir);
 
+bool policy_key(struct super_block *sb,
+		const struct ouichefs_evict_summary *summary, u64 *key,
+		unsigned int *generation);
+
+int ouichefs_policy_attach(struct super_block *sb, const char *name);
+
+void ouichefs_policy_detach(struct super_block *sb);
+
+void ouichefs_policy_seed(struct super_block *sb);
+
+void *ouichefs_policy_private(struct super_block *sb);
+
+void ouichefs_policy_created(struct inode *dir, struct dentry *dentry);
+
+void ouichefs_policy_accessed(struct inode *inode);
+
+void ouichefs_policy_removed(struct inode *dir, struct dentry *dentry,
+			     bool evicted);
+
+int ouichefs_policy_select(struct super_block *sb, const char *name);
+
+void ouichefs_policy_name(struct super_block *sb, char *buf);
+
+ssize_t ouichefs_policy_list(char *buf);
+
 int register_policy(struct eviction_policy *policy);
 
 void unregister_policy(struct eviction_policy *policy);
@@ -0,0 +1,93 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Eviction policies built into the module. This file does not depend on the
+ * rest of the module, so that the userspace simulator in sim/ can compile it
+ * as well.
+ */
+
+#include <linux/kernel.h>
+#include <linux/fs.h>
+
+#include "policy.h"
+#include "eviction.h"
+
+static struct inode *lru_compare(struct inode *, struct inode *);
+static u64 lru_key(const struct ouichefs_evict_summary *);
+struct eviction_policy least_recently_used_policy = {
+	.name = "lru",
+	.description = "Evicts least-recently used file.",
+	.compare = lru_compare,
+	.key = lru_key,
+};
+
+static struct inode *clock_compare(struct inode *, struct inode *);
+struct eviction_policy clock_policy = {
+	.name = "clock",
+	.description = "Evicts a file not referenced since the last sweep.",
+	.compare = clock_compare,
+	.select = ouichefs_index_clock,
+};
+
+/**
+ * lru_compare - Compares two inodes based on which was used least recently.
+ *
+ * @first: First node to compare.
+ * @second: Second node to compare.
+ *
+ * Return: The node which was least recently used.
+ */
+static struct inode *lru_compare(struct inode *first, struct inode *second)
+{
+	if (!first)
+		return second;
+	if (!second)
+		return first;
+
+	/**
+	 * Compare access time of nodes
+	 * We assure seconds are detailed enough for this check.
+	 * Return the node to evict
+	 */
+	if (first->i_atime.tv_sec < second->i_atime.tv_sec)
+		return first;
+	else
+		return second;
+}
+
+/**
+ * lru_key - Key of an inode under the LRU policy.
+ *
+ * @summary: Summary of the inode.
+ *
+ * Return: The access time, so that the least recently used file comes first.
+ */
+static u64 lru_key(const struct ouichefs_evict_summary *summary)
+{
+	return summary->atime;
+}
+
+/**
+ * clock_compare - Compares two inodes based on their reference bits.
+ *
+ * @first: First node to compare.
+ * @second: Second node to compare.
+ *
+ * Only used to search a single directory, the volume is swept by
+ * ouichefs_index_clock().
+ *
+ * Return: The second node if only the first one was referenced since the last
+ *	   sweep, the first node otherwise.
+ */
+static struct inode *clock_compare(struct inode *first, struct inode *second)
+{
+	if (!first)
+		return second;
+	if (!second)
+		return first;
+
+	if (ouichefs_index_referenced(first) &&
+	    !ouichefs_index_referenced(second))
+		return second;
+	else
+		return first;
+}
@@ -0,0 +1,389 @@
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/hash.h>
+#include <linux/log2.h>
+#include <linux/err.h>
+
+#include "../policy.h"
+#include "../eviction.h"
+#include "../ouichefs.h"
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("Adaptive Replacement Cache Policy Module");
+
+/*
+ * Adaptive Replacement Cache (ARC), counted in files.
+ *
+ * Files seen once since they were created are kept in T1, files accessed
+ * again in T2, both in LRU order. Evicted files are remembered by their name
+ * in the ghost lists B1 and B2, depending on the list they were evicted from.
+ * A file created again with the name of a ghost moves the target size p of
+ * T1 towards the list the ghost came from: a B1 hit means T1 was too small,
+ * a B2 hit that T2 was. Victims are taken from the LRU end of T1 while it is
+ * larger than p, from T2 otherwise.
+ */
+
+enum arc_list { ARC_NONE, ARC_T1, ARC_T2, ARC_B1, ARC_B2, ARC_NR_LISTS };
+
+/**
+ * struct arc_node - a resident file, indexed by inode number.
+ */
+struct arc_node {
+	struct list_head lru;
+	enum arc_list list;
+};
+
+/**
+ * struct arc_ghost - an evicted file.
+ */
+struct arc_ghost {
+	struct list_head lru;
+	struct hlist_node hash;
+	u32 name_hash;
+	enum arc_list list;
+};
+
+/**
+ * struct arc_state - ARC state of a mount.
+ *
+ * @lock: protects the whole state.
+ * @lists: the lists, indexed by enum arc_list, most recently used first.
+ * @nr: number of files in each list.
+ * @p: target number of files in T1.
+ * @nodes: resident files, indexed by inode number.
+ * @nr_nodes: number of inodes of the mount.
+ * @ghosts: ghost entries, as many as inodes.
+ * @free_ghosts: unused ghost entries.
+ * @buckets: ghosts hashed by name.
+ * @hash_bits: log2 of the number of buckets.
+ */
+struct arc_state {
+	spinlock_t lock;
+	struct list_head lists[ARC_NR_LISTS];
+	uint32_t nr[ARC_NR_LISTS];
+	uint32_t p;
+	struct arc_node *nodes;
+	uint32_t nr_nodes;
+	struct arc_ghost *ghosts;
+	struct list_head free_ghosts;
+	struct hlist_head *buckets;
+	unsigned int hash_bits;
+};
+
+static u64 arc_key(const struct ouichefs_evict_summary *);
+static int arc_select(struct super_block *, uint32_t *, int, uint32_t);
+static void *arc_attach(struct super_block *);
+static void arc_detach(void *);
+static void arc_insert(struct super_block *, uint32_t, u32);
+static void arc_access(struct super_block *, uint32_t);
+static void arc_remove(struct super_block *, uint32_t, u32);
+static struct eviction_policy arc_policy = {
+	.name = "arc",
+	.description = "Balances recency and frequency with ghost lists.",
+	.owner = THIS_MODULE,
+	.key = arc_key,
+	.select = arc_select,
+	.attach = arc_attach,
+	.detach = arc_detach,
+	.insert = arc_insert,
+	.access = arc_access,
+	.remove = arc_remove,
+};
+
+/**
+ * arc_key - Key of an inode, only used within a single directory.
+ *
+ * @summary: Summary of the inode.
+ *
+ * Return: The access time, full directories evict their least recently used
+ *	   file.
+ */
+static u64 arc_key(const struct ouichefs_evict_summary *summary)
+{
+	return summary->atime;
+}
+
+static inline uint32_t arc_resident(struct arc_state *arc)
+{
+	return arc->nr[ARC_T1] + arc->nr[ARC_T2];
+}
+
+/* Moves a resident file to the MRU end of a list */
+static void arc_node_move(struct arc_state *arc, struct arc_node *node,
+			  enum arc_list list)
+{
+	if (node->list != ARC_NONE) {
+		list_del(&node->lru);
+		arc->nr[node->list]--;
+	}
+	list_add(&node->lru, &arc->lists[list]);
+	arc->nr[list]++;
+	node->list = list;
+}
+
+static void arc_ghost_drop(struct arc_state *arc, struct arc_ghost *ghost)
+{
+	list_del(&ghost->lru);
+	hlist_del(&ghost->hash);
+	arc->nr[ghost->list]--;
+	ghost->list = ARC_NONE;
+	list_add(&ghost->lru, &arc->free_ghosts);
+}
+
+static struct arc_ghost *arc_ghost_find(struct arc_state *arc, u32 name_hash)
+{
+	struct arc_ghost *ghost;
+
+	hlist_for_each_entry(ghost,
+			     &arc->buckets[hash_32(name_hash, arc->hash_bits)],
+			     hash) {
+		if (ghost->name_hash == name_hash)
+			return ghost;
+	}
+
+	return NULL;
+}
+
+/*
+ * Keeps T1 and B1 within the resident files, and all ghosts within twice as
+ * many.
+ */
+static void arc_ghost_trim(struct arc_state *arc)
+{
+	uint32_t c = arc_resident(arc);
+
+	while (arc->nr[ARC_B1] && arc->nr[ARC_T1] + arc->nr[ARC_B1] > c)
+		arc_ghost_drop(arc, list_last_entry(&arc->lists[ARC_B1],
+						    struct arc_ghost, lru));
+	while (arc->nr[ARC_B2] && arc->nr[ARC_B1] + arc->nr[ARC_B2] > c)
+		arc_ghost_drop(arc, list_last_entry(&arc->lists[ARC_B2],
+						    struct arc_ghost, lru));
+}
+
+/**
+ * arc_insert - Adds a created file to T1, or to T2 if it was evicted shortly
+ *		before, adapting p.
+ */
+static void arc_insert(struct super_block *sb, uint32_t ino, u32 name_hash)
+{
+	struct arc_state *arc = ouichefs_policy_private(sb);
+	struct arc_ghost *ghost = NULL;
+	struct arc_node *node;
+	uint32_t delta;
+
+	if (ino >= arc->nr_nodes)
+		return;
+
+	spin_lock(&arc->lock);
+	node = &arc->nodes[ino];
+	if (node->list != ARC_NONE)
+		goto unlock;
+
+	if (name_hash)
+		ghost = arc_ghost_find(arc, name_hash);
+	if (!ghost) {
+		arc_node_move(arc, node, ARC_T1);
+		goto unlock;
+	}
+
+	if (ghost->list == ARC_B1) {
+		delta = max(arc->nr[ARC_B2] / arc->nr[ARC_B1], 1U);
+		arc->p = min(arc->p + delta, arc_resident(arc));
+	} else {
+		delta = max(arc->nr[ARC_B1] / arc->nr[ARC_B2], 1U);
+		arc->p = arc->p > delta ? arc->p - delta : 0;
+	}
+	arc_ghost_drop(arc, ghost);
+	arc_node_move(arc, node, ARC_T2);
+unlock:
+	spin_unlock(&arc->lock);
+}
+
+/**
+ * arc_access - Moves an accessed file to the MRU end of T2.
+ */
+static void arc_access(struct super_block *sb, uint32_t ino)
+{
+	struct arc_state *arc = ouichefs_policy_private(sb);
+	struct arc_node *node;
+
+	if (ino >= arc->nr_nodes)
+		return;
+
+	spin_lock(&arc->lock);
+	node = &arc->nodes[ino];
+	/* Files the policy does not know yet were seen once */
+	arc_node_move(arc, node, node->list == ARC_NONE ? ARC_T1 : ARC_T2);
+	spin_unlock(&arc->lock);
+}
+
+/**
+ * arc_remove - Forgets a removed file, and remembers it in B1 or B2 if it was
+ *		evicted.
+ */
+static void arc_remove(struct super_block *sb, uint32_t ino, u32 name_hash)
+{
+	struct arc_state *arc = ouichefs_policy_private(sb);
+	struct arc_ghost *ghost;
+	struct arc_node *node;
+	enum arc_list list;
+
+	if (ino >= arc->nr_nodes)
+		return;
+
+	spin_lock(&arc->lock);
+	node = &arc->nodes[ino];
+	list = node->list;
+	if (list == ARC_NONE)
+		goto unlock;
+
+	list_del(&node->lru);
+	arc->nr[list]--;
+	node->list = ARC_NONE;
+	if (!name_hash)
+		goto unlock;
+
+	/* A file evicted again replaces its older ghost */
+	ghost = arc_ghost_find(arc, name_hash);
+	if (ghost)
+		arc_ghost_drop(arc, ghost);
+
+	if (list_empty(&arc->free_ghosts))
+		goto trim;
+	ghost = list_first_entry(&arc->free_ghosts, struct arc_ghost, lru);
+	list_del(&ghost->lru);
+	ghost->name_hash = name_hash;
+	ghost->list = list == ARC_T1 ? ARC_B1 : ARC_B2;
+	list_add(&ghost->lru, &arc->lists[ghost->list]);
+	hlist_add_head(&ghost->hash,
+		       &arc->buckets[hash_32(name_hash, arc->hash_bits)]);
+	arc->nr[ghost->list]++;
+trim:
+	arc_ghost_trim(arc);
+unlock:
+	spin_unlock(&arc->lock);
+}
+
+/**
+ * arc_select - Picks the files to evict from the LRU ends of T1 and T2.
+ *
+ * @sb: Super block to evict files from.
+ * @inos: Array filled with the inode numbers of the files to evict.
+ * @max: Size of the inos array.
+ * @nr_blocks: Number of blocks the files should free together.
+ *
+ * The lists are only changed when the files are actually evicted.
+ *
+ * Return: The number of inode numbers in inos.
+ */
+static int arc_select(struct super_block *sb, uint32_t *inos, int max,
+		      uint32_t nr_blocks)
+{
+	struct arc_state *arc = ouichefs_policy_private(sb);
+	struct ouichefs_evict_summary summary;
+	struct list_head *pos[ARC_T2 + 1];
+	uint32_t left[ARC_T2 + 1];
+	uint32_t blocks = 0;
+	int nr = 0, count = 0;
+
+	spin_lock(&arc->lock);
+	pos[ARC_T1] = arc->lists[ARC_T1].prev;
+	pos[ARC_T2] = arc->lists[ARC_T2].prev;
+	left[ARC_T1] = arc->nr[ARC_T1];
+	left[ARC_T2] = arc->nr[ARC_T2];
+	while (nr < max && (left[ARC_T1] || left[ARC_T2])) {
+		enum arc_list list = ARC_T2;
+		struct arc_node *node;
+
+		if (left[ARC_T1] && (left[ARC_T1] > arc->p || !left[ARC_T2]))
+			list = ARC_T1;
+
+		node = list_entry(pos[list], struct arc_node, lru);
+		pos[list] = pos[list]->prev;
+		left[list]--;
+		inos[nr++] = node - arc->nodes;
+	}
+	spin_unlock(&arc->lock);
+
+	/* Stop once enough blocks are covered, skip removed files */
+	for (int i = 0; i < nr; i++) {
+		if (!ouichefs_index_summary(sb, inos[i], &summary))
+			continue;
+
+		inos[count++] = inos[i];
+		blocks += summary.blocks;
+		if (blocks >= nr_blocks)
+			break;
+	}
+
+	return count;
+}
+
+/**
+ * arc_attach - Allocates the ARC state of a mount.
+ *
+ * @sb: Super block of the mount.
+ *
+ * Return: The state, ERR_PTR(-ENOMEM) on error.
+ */
+static void *arc_attach(struct super_block *sb)
+{
+	uint32_t nr_nodes = OUICHEFS_SB(sb)->nr_inodes;
+	struct arc_state *arc;
+
+	arc = kzalloc(sizeof(*arc), GFP_KERNEL);
+	if (!arc)
+		return ERR_PTR(-ENOMEM);
+
+	arc->hash_bits = ilog2(roundup_pow_of_two(max(nr_nodes, 2U)));
+	arc->nodes = kvcalloc(nr_nodes, sizeof(*arc->nodes), GFP_KERNEL);
+	arc->ghosts = kvcalloc(nr_nodes, sizeof(*arc->ghosts), GFP_KERNEL);
+	arc->buckets = kvcalloc(1U << arc->hash_bits, sizeof(*arc->buckets),
+				GFP_KERNEL);
+	if (!arc->nodes || !arc->ghosts || !arc->buckets) {
+		arc_detach(arc);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	spin_lock_init(&arc->lock);
+	for (int i = 0; i < ARC_NR_LISTS; i++)
+		INIT_LIST_HEAD(&arc->lists[i]);
+	INIT_LIST_HEAD(&arc->free_ghosts);
+	for (uint32_t i = 0; i < nr_nodes; i++)
+		list_add(&arc->ghosts[i].lru, &arc->free_ghosts);
+	arc->nr_nodes = nr_nodes;
+
+	return arc;
+}
+
+/**
+ * arc_detach - Frees the ARC state of a mount.
+ *
+ * @private: State returned by arc_attach().
+ */
+static void arc_detach(void *private)
+{
+	struct arc_state *arc = private;
+
+	kvfree(arc->buckets);
+	kvfree(arc->ghosts);
+	kvfree(arc->nodes);
+	kfree(arc);
+}
+
+static int __init arc_policy_init(void)
+{
+	return register_policy(&arc_policy);
+}
+module_init(arc_policy_init);
+
+static void __exit arc_policy_exit(void)
+{
+	unregister_policy(&arc_policy);
+}
+module_exit(arc_policy_exit);
@@ -0,0 +1,55 @@
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/kernel.h>
+
+#include "../policy.h"
+#include "../ouichefs.h"
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("Greedy-Dual-Size-Frequency Policy Module");
+
+/* Keeps the priority positive for files of up to 2^16 blocks */
+#define GDSF_SIZE_BIAS (16 << 8)
+
+static u64 gdsf_key(const struct ouichefs_evict_summary *);
+static struct eviction_policy gdsf_policy = {
+	.name = "gdsf",
+	.description = "Evicts the file with the fewest accesses per block.",
+	.owner = THIS_MODULE,
+	.key = gdsf_key,
+};
+
+/**
+ * gdsf_key - Key of an inode under the Greedy-Dual-Size-Frequency policy.
+ *
+ * @summary: Summary of the inode.
+ *
+ * The priority of a file is its access count divided by its size in blocks,
+ * with the same cost for every miss. Large files therefore need more accesses
+ * to stay than small ones. The decay of the access counts replaces the
+ * inflation value of the original algorithm for aging. Files with the same
+ * priority are evicted least recently used first.
+ *
+ * Return: log2 of the priority in the upper half, the access time in the
+ *	   lower.
+ */
+static u64 gdsf_key(const struct ouichefs_evict_summary *summary)
+{
+	u32 priority = policy_freq_rank(summary) + GDSF_SIZE_BIAS -
+		       policy_log2(max_t(u32, summary->blocks, 1));
+
+	return (u64)priority << 32 | summary->atime;
+}
+
+static int __init gdsf_policy_init(void)
+{
+	return register_policy(&gdsf_policy);
+}
+module_init(gdsf_policy_init);
+
+static void __exit gdsf_policy_exit(void)
+{
+	unregister_policy(&gdsf_policy);
+}
+module_exit(gdsf_policy_exit);
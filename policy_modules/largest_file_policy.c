@@ -11,10 +11,13 @@ MODULE_AUTHOR("Sascha Thiemann");
 MODULE_DESCRIPTION("Largest File Policy Module");
 
 static struct inode *lf_compare(struct inode *, struct inode *);
+static u64 lf_key(const struct ouichefs_evict_summary *);
 static struct eviction_policy file_size_policy = {
-	.name = "LF Policy",
+	.name = "lf",
 	.description = "Evicts the largest file.",
+	.owner = THIS_MODULE,
 	.compare = lf_compare,
+	.key = lf_key,
 };
 
 /**
@@ -39,6 +42,18 @@ static struct inode *lf_compare(struct inode *first, struct inode *second)
 		return first;
 }
 
+/**
+ * lf_key - Key of an inode under the largest file policy.
+ *
+ * @summary: Summary of the inode.
+ *
+ * Return: The complement of the size, so that the largest file comes first.
+ */
+static u64 lf_key(const struct ouichefs_evict_summary *summary)
+{
+	return U32_MAX - summary->size;
+}
+
 static int __init largest_file_policy_init(void)
 {
 	int errc = register_policy(&file_size_policy);
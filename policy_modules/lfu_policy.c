@@ -0,0 +1,46 @@
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/kernel.h>
+
+#include "../policy.h"
+#include "../ouichefs.h"
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("Least Frequently Used Policy Module");
+
+static u64 lfu_key(const struct ouichefs_evict_summary *);
+static struct eviction_policy lfu_policy = {
+	.name = "lfu",
+	.description = "Evicts the least frequently used file.",
+	.owner = THIS_MODULE,
+	.key = lfu_key,
+};
+
+/**
+ * lfu_key - Key of an inode under the least frequently used policy.
+ *
+ * @summary: Summary of the inode.
+ *
+ * The access counts decay over time, so files that used to be hot are
+ * eventually evicted. Files with the same count are evicted least recently
+ * used first.
+ *
+ * Return: The frequency rank in the upper half, the access time in the lower.
+ */
+static u64 lfu_key(const struct ouichefs_evict_summary *summary)
+{
+	return (u64)policy_freq_rank(summary) << 32 | summary->atime;
+}
+
+static int __init lfu_policy_init(void)
+{
+	return register_policy(&lfu_policy);
+}
+module_init(lfu_policy_init);
+
+static void __exit lfu_policy_exit(void)
+{
+	unregister_policy(&lfu_policy);
+}
+module_exit(lfu_policy_exit);
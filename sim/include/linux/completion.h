@@ -0,0 +1,7 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _SIM_LINUX_COMPLETION_H
+#define _SIM_LINUX_COMPLETION_H
+
+#include <linux/kernel.h>
+
+#endif /* _SIM_LINUX_COMPLETION_H */
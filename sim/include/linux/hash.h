@@ -0,0 +1,14 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _SIM_LINUX_HASH_H
+#define _SIM_LINUX_HASH_H
+
+#include <linux/kernel.h>
+
+#define GOLDEN_RATIO_32 0x61C88647
+
+static inline u32 hash_32(u32 val, unsigned int bits)
+{
+	return (val * GOLDEN_RATIO_32) >> (32 - bits);
+}
+
+#endif /* _SIM_LINUX_HASH_H */
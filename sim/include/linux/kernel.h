@@ -0,0 +1,144 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Minimal userspace stand-ins for the kernel headers used by the eviction
+ * policies, so that the simulator can compile them unchanged. Only what the
+ * policies and the headers they include need is provided.
+ */
+#ifndef _SIM_LINUX_KERNEL_H
+#define _SIM_LINUX_KERNEL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int64_t s64;
+
+#define U32_MAX ((u32)~0U)
+#define U64_MAX ((u64)~0ULL)
+
+#define __rcu
+#define __init
+#define __exit
+
+#define max_t(type, x, y) ((type)(x) > (type)(y) ? (type)(x) : (type)(y))
+#define min_t(type, x, y) ((type)(x) < (type)(y) ? (type)(x) : (type)(y))
+#define max(x, y) ((x) > (y) ? (x) : (y))
+#define min(x, y) ((x) < (y) ? (x) : (y))
+
+static inline int fls(unsigned int x)
+{
+	return x ? 32 - __builtin_clz(x) : 0;
+}
+
+#define container_of(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+
+#define pr_debug(fmt, ...) do { } while (0)
+#define pr_info(fmt, ...) fprintf(stderr, fmt, ##__VA_ARGS__)
+#define pr_warn(fmt, ...) fprintf(stderr, fmt, ##__VA_ARGS__)
+#define pr_err(fmt, ...) fprintf(stderr, fmt, ##__VA_ARGS__)
+
+#define S_IFMT 00170000
+#define S_IFREG 0100000
+#define S_IFDIR 0040000
+#define S_ISREG(m) (((m) & S_IFMT) == S_IFREG)
+#define S_ISDIR(m) (((m) & S_IFMT) == S_IFDIR)
+
+#define ENOMEM 12
+#define EFAULT 14
+
+struct list_head {
+	struct list_head *next, *prev;
+};
+
+typedef struct { int counter; } atomic_t;
+typedef struct { s64 counter; } atomic64_t;
+
+static inline void atomic64_add(s64 i, atomic64_t *v)
+{
+	v->counter += i;
+}
+
+struct rb_node {
+	struct rb_node *rb_left, *rb_right;
+};
+
+struct rb_root_cached {
+	struct rb_node *rb_node, *rb_leftmost;
+};
+
+struct mutex {
+	int locked;
+};
+
+struct kobject {
+	int refcount;
+};
+
+struct completion {
+	unsigned int done;
+};
+
+struct work_struct {
+	int pending;
+};
+
+typedef struct {
+	int waiters;
+} wait_queue_head_t;
+
+struct timespec64 {
+	s64 tv_sec;
+	long tv_nsec;
+};
+
+struct super_block {
+	void *s_fs_info;
+};
+
+/* Only the fields read by the policies */
+struct inode {
+	unsigned long i_ino;
+	u32 i_mode;
+	loff_t i_size;
+	blkcnt_t i_blocks;
+	struct timespec64 i_atime;
+	struct timespec64 i_mtime;
+	struct timespec64 i_ctime;
+	struct super_block *i_sb;
+};
+
+struct buffer_head {
+	char *b_data;
+};
+
+struct dentry;
+struct file_operations;
+struct address_space_operations;
+struct module;
+
+#define THIS_MODULE ((struct module *)NULL)
+
+/* Policy modules register themselves when the simulator starts */
+#define module_init(fn) \
+	static void __attribute__((constructor)) __sim_init_##fn(void) \
+	{ \
+		if (fn()) \
+			fprintf(stderr, "%s failed\n", #fn); \
+	}
+#define module_exit(fn) \
+	static void __attribute__((unused)) (*__sim_exit_##fn)(void) = fn
+
+#define MODULE_LICENSE(x)
+#define MODULE_AUTHOR(x)
+#define MODULE_DESCRIPTION(x)
+#define EXPORT_SYMBOL(sym)
+
+#endif /* _SIM_LINUX_KERNEL_H */
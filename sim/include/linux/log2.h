@@ -0,0 +1,10 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _SIM_LINUX_LOG2_H
+#define _SIM_LINUX_LOG2_H
+
+#include <linux/kernel.h>
+
+#define ilog2(n) (fls(n) - 1)
+#define roundup_pow_of_two(n) ((n) <= 1 ? 1U : 1U << fls((n) - 1))
+
+#endif /* _SIM_LINUX_LOG2_H */
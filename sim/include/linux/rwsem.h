@@ -0,0 +1,18 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _SIM_LINUX_RWSEM_H
+#define _SIM_LINUX_RWSEM_H
+
+#include <linux/kernel.h>
+
+/* The simulator is single threaded */
+struct rw_semaphore {
+	int count;
+};
+
+#define init_rwsem(sem) ((sem)->count = 0)
+#define down_read(sem) ((sem)->count++)
+#define up_read(sem) ((sem)->count--)
+#define down_write(sem) ((sem)->count = -1)
+#define up_write(sem) ((sem)->count = 0)
+
+#endif /* _SIM_LINUX_RWSEM_H */
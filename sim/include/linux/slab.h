@@ -0,0 +1,15 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _SIM_LINUX_SLAB_H
+#define _SIM_LINUX_SLAB_H
+
+#include <stdlib.h>
+#include <linux/kernel.h>
+
+#define GFP_KERNEL 0
+
+#define kzalloc(size, flags) calloc(1, size)
+#define kvcalloc(n, size, flags) calloc(n, size)
+#define kfree(ptr) free(ptr)
+#define kvfree(ptr) free(ptr)
+
+#endif /* _SIM_LINUX_SLAB_H */
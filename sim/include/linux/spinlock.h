@@ -0,0 +1,16 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _SIM_LINUX_SPINLOCK_H
+#define _SIM_LINUX_SPINLOCK_H
+
+#include <linux/kernel.h>
+
+/* The simulator is single threaded */
+typedef struct {
+	int locked;
+} spinlock_t;
+
+#define spin_lock_init(lock) ((lock)->locked = 0)
+#define spin_lock(lock) ((lock)->locked = 1)
+#define spin_unlock(lock) ((lock)->locked = 0)
+
+#endif /* _SIM_LINUX_SPINLOCK_H */
@@ -0,0 +1,852 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * ouichefs-sim - replays an access trace against the eviction policies.
+ *
+ * The built-in policies and the policy modules are compiled unchanged against
+ * the headers in include/. The simulator models a volume of a given number of
+ * blocks: files use their data blocks plus an index block, and a batch of
+ * files is evicted once the free blocks drop below the low watermark, until
+ * they are back above the high watermark, as the reclaim worker does.
+ *
+ * A trace has one access per line:
+ *
+ *	<time> <op> <id> [size]
+ *
+ * where <time> is in seconds, <op> is create, read, write or delete (or their
+ * first letter), <id> identifies the file and [size] is its size in bytes
+ * after a create or write. Lines starting with '#' are ignored. A read or
+ * write of an evicted file is a miss and brings the file back.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/err.h>
+
+#include "../policy.h"
+#include "../eviction.h"
+#include "../ouichefs.h"
+
+#define SIM_MAX_POLICIES 16
+
+/**
+ * struct sim_file - file of the simulated volume.
+ *
+ * @inode: inode handed to the policies, i_ino is the file id.
+ * @size: last known size, kept after the file is evicted.
+ * @live: set while the file is on the volume.
+ * @known: set once the file was created.
+ * @referenced: CLOCK reference bit.
+ * @freq: access count as of @freq_epoch.
+ * @freq_epoch: aging period @freq was last updated in.
+ */
+struct sim_file {
+	struct inode inode;
+	uint32_t size;
+	bool live;
+	bool known;
+	bool referenced;
+	uint32_t freq;
+	uint32_t freq_epoch;
+};
+
+/**
+ * struct sim_access - one line of the trace.
+ */
+struct sim_access {
+	uint32_t time;
+	char op;
+	uint32_t id;
+	uint32_t size;
+};
+
+/**
+ * struct sim_result - outcome of replaying the trace under one policy.
+ */
+struct sim_result {
+	unsigned long reads;
+	unsigned long hits;
+	unsigned long misses; /* Reads and writes of evicted files */
+	unsigned long evictions; /* Batches evicted */
+	unsigned long files_evicted;
+	unsigned long long bytes_evicted;
+	unsigned long long scanned; /* Candidates looked at by the policy */
+	unsigned long dropped; /* Accesses to files larger than the volume */
+	double seconds;
+};
+
+static struct eviction_policy *policies[SIM_MAX_POLICIES];
+static int nr_policies;
+
+static struct ouichefs_sb_info sim_sbi;
+static struct super_block sim_sb = { .s_fs_info = &sim_sbi };
+static struct sim_file *files;
+static uint32_t nr_files;
+static uint32_t capacity = 1024; /* Volume size in blocks */
+static uint32_t free_blocks;
+static uint32_t low_watermark = EVICTION_LOW_WATERMARK; /* In percent */
+static uint32_t high_watermark = EVICTION_HIGH_WATERMARK;
+static uint32_t sample; /* Candidates drawn per eviction, 0 for all */
+static uint32_t clock_hand;
+static struct sim_result *result;
+
+/*
+ * Policy registry, mirrors the one of the module. Policy modules register
+ * themselves from their module_init() function before main() runs.
+ */
+
+static struct eviction_policy *policy_find(const char *name)
+{
+	for (int i = 0; i < nr_policies; i++)
+		if (!strcmp(policies[i]->name, name))
+			return policies[i];
+
+	return NULL;
+}
+
+int register_policy(struct eviction_policy *policy)
+{
+	if (!policy || (!policy->compare && !policy->key))
+		return -EFAULT;
+	if (policy_find(policy->name))
+		return -POLICY_ALREADY_REGISTERED;
+	if (nr_policies == SIM_MAX_POLICIES)
+		return -ENOMEM;
+
+	policies[nr_policies++] = policy;
+	return 0;
+}
+
+void unregister_policy(struct eviction_policy *policy)
+{
+	for (int i = 0; i < nr_policies; i++) {
+		if (policies[i] != policy)
+			continue;
+		memmove(&policies[i], &policies[i + 1],
+			(nr_policies - i - 1) * sizeof(*policies));
+		nr_policies--;
+		return;
+	}
+}
+
+static void __attribute__((constructor)) register_builtin_policies(void)
+{
+	register_policy(&least_recently_used_policy);
+	register_policy(&clock_policy);
+}
+
+/*
+ * Stand-ins for the eviction index and policy functions the policies call.
+ */
+
+static inline uint32_t file_blocks(uint32_t size)
+{
+	/* Data blocks plus the index block */
+	return (size + OUICHEFS_BLOCK_SIZE - 1) / OUICHEFS_BLOCK_SIZE + 1;
+}
+
+bool ouichefs_index_referenced(struct inode *inode)
+{
+	return container_of(inode, struct sim_file, inode)->referenced;
+}
+
+int ouichefs_index_clock(struct super_block *sb, uint32_t *inos, int max,
+			 uint32_t nr_blocks)
+{
+	uint32_t blocks = 0;
+	int count = 0;
+
+	if (!nr_files)
+		return 0;
+
+	for (uint32_t n = 0; n < 2 * nr_files && count < max; n++) {
+		struct sim_file *file = &files[clock_hand];
+		uint32_t ino = clock_hand;
+
+		clock_hand = (clock_hand + 1) % nr_files;
+		if (!file->live)
+			continue;
+		if (count && ino == inos[0])
+			break;
+
+		result->scanned++;
+		if (file->referenced) {
+			file->referenced = false;
+			continue;
+		}
+
+		inos[count++] = ino;
+		blocks += file->inode.i_blocks;
+		if (blocks >= nr_blocks)
+			break;
+	}
+
+	return count;
+}
+
+static void file_summary(struct sim_file *file,
+			 struct ouichefs_evict_summary *summary)
+{
+	summary->atime = file->inode.i_atime.tv_sec;
+	summary->mtime = file->inode.i_mtime.tv_sec;
+	summary->size = file->inode.i_size;
+	summary->blocks = file->inode.i_blocks;
+	summary->freq = file->freq;
+	summary->freq_epoch = file->freq_epoch;
+	summary->evict_class = OUICHEFS_EVICT_NORMAL;
+}
+
+bool ouichefs_index_summary(struct super_block *sb, uint32_t ino,
+			    struct ouichefs_evict_summary *summary)
+{
+	if (ino >= nr_files || !files[ino].live)
+		return false;
+
+	result->scanned++;
+	file_summary(&files[ino], summary);
+	return true;
+}
+
+void *ouichefs_policy_private(struct super_block *sb)
+{
+	return OUICHEFS_SB(sb)->policy_private;
+}
+
+/*
+ * Hooks of stateful policies, called as ouichefs_policy_created(),
+ * ouichefs_policy_accessed() and ouichefs_policy_removed() do. The file id
+ * stands for the name of the file, evicted files are brought back with the
+ * same one.
+ */
+
+static void policy_created(struct eviction_policy *policy,
+			   struct sim_file *file)
+{
+	if (policy->insert)
+		policy->insert(&sim_sb, file->inode.i_ino,
+			       file->inode.i_ino + 1);
+}
+
+static void policy_accessed(struct eviction_policy *policy,
+			    struct sim_file *file)
+{
+	if (policy->access)
+		policy->access(&sim_sb, file->inode.i_ino);
+}
+
+static void policy_removed(struct eviction_policy *policy,
+			   struct sim_file *file, bool evicted)
+{
+	if (policy->remove)
+		policy->remove(&sim_sb, file->inode.i_ino,
+			       evicted ? file->inode.i_ino + 1 : 0);
+}
+
+/* Counts an access as ouichefs_index_access() does */
+static void file_access(struct sim_file *file, uint32_t time)
+{
+	uint32_t now = time / OUICHEFS_FREQ_PERIOD;
+
+	if (now < file->freq_epoch)
+		now = file->freq_epoch;
+	file->freq = policy_freq_decay(file->freq, now - file->freq_epoch);
+	if (file->freq < OUICHEFS_FREQ_MAX)
+		file->freq++;
+	file->freq_epoch = now;
+}
+
+/*
+ * Victim selection
+ */
+
+struct sim_candidate {
+	u64 key;
+	uint32_t ino;
+};
+
+static struct eviction_policy *cmp_policy;
+
+static int candidate_cmp_key(const void *a, const void *b)
+{
+	const struct sim_candidate *first = a, *second = b;
+
+	if (first->key != second->key)
+		return first->key < second->key ? -1 : 1;
+	return first->ino < second->ino ? -1 : first->ino > second->ino;
+}
+
+/* Orders two candidates with compare(), ties are broken by inode number */
+static int candidate_cmp_compare(const void *a, const void *b)
+{
+	const struct sim_candidate *first = a, *second = b;
+	struct inode *x = &files[first->ino].inode;
+	struct inode *y = &files[second->ino].inode;
+	struct inode *xy = cmp_policy->compare(x, y);
+	struct inode *yx = cmp_policy->compare(y, x);
+
+	if (xy == x && yx == x)
+		return -1;
+	if (xy == y && yx == y)
+		return 1;
+	return first->ino < second->ino ? -1 : first->ino > second->ino;
+}
+
+/* Returns true if the candidate a is evicted before b */
+static bool candidate_before(struct eviction_policy *policy,
+			     struct sim_candidate *a, struct sim_candidate *b)
+{
+	if (policy->key)
+		return candidate_cmp_key(a, b) < 0;
+
+	cmp_policy = policy;
+	return candidate_cmp_compare(a, b) < 0;
+}
+
+/**
+ * select_sampled - chooses the files to evict in sampled mode, as
+ *		    files_to_evict_sampled() does.
+ *
+ * @policy: policy to rank the files with.
+ * @candidates: the live files, reordered.
+ * @nr: number of live files.
+ * @inos: array filled with the victims, in order.
+ * @nr_blocks: number of blocks the victims should free together.
+ *
+ * Every victim is the best of sample files drawn among the live files that
+ * were not picked yet.
+ *
+ * Return: the number of victims.
+ */
+static int select_sampled(struct eviction_policy *policy,
+			  struct sim_candidate *candidates, uint32_t nr,
+			  uint32_t *inos, uint32_t nr_blocks)
+{
+	uint32_t blocks = 0;
+	int count = 0;
+
+	while (nr && blocks < nr_blocks) {
+		uint32_t draw = sample < nr ? sample : nr, best = 0;
+		struct sim_candidate tmp;
+
+		/* Partial Fisher-Yates shuffle */
+		for (uint32_t i = 0; i < draw; i++) {
+			uint32_t pick = i + random() % (nr - i);
+
+			tmp = candidates[i];
+			candidates[i] = candidates[pick];
+			candidates[pick] = tmp;
+			if (policy->key) {
+				struct ouichefs_evict_summary summary;
+
+				file_summary(&files[candidates[i].ino],
+					     &summary);
+				candidates[i].key = policy->key(&summary);
+			}
+			if (candidate_before(policy, &candidates[i],
+					     &candidates[best]))
+				best = i;
+		}
+		result->scanned += draw;
+
+		inos[count] = candidates[best].ino;
+		blocks += files[inos[count++]].inode.i_blocks;
+
+		/* Do not draw the victim again */
+		candidates[best] = candidates[--nr];
+	}
+
+	return count;
+}
+
+/**
+ * select_victims - chooses the files to evict, as get_files_to_evict() does.
+ *
+ * @policy: policy to rank the files with.
+ * @inos: array of nr_files entries filled with the victims, in order.
+ * @nr_blocks: number of blocks the victims should free together.
+ *
+ * Return: the number of victims.
+ */
+static int select_victims(struct eviction_policy *policy, uint32_t *inos,
+			  uint32_t nr_blocks)
+{
+	struct sim_candidate *candidates;
+	uint32_t nr = 0, blocks = 0;
+	int count = 0;
+
+	if (policy->select)
+		return policy->select(&sim_sb, inos, nr_files, nr_blocks);
+
+	candidates = malloc(nr_files * sizeof(*candidates));
+	if (!candidates)
+		return -ENOMEM;
+
+	for (uint32_t ino = 0; ino < nr_files; ino++)
+		if (files[ino].live)
+			candidates[nr++].ino = ino;
+
+	if (sample && sample < nr) {
+		count = select_sampled(policy, candidates, nr, inos,
+				       nr_blocks);
+		free(candidates);
+		return count;
+	}
+
+	result->scanned += nr;
+	if (policy->key) {
+		for (uint32_t i = 0; i < nr; i++) {
+			struct ouichefs_evict_summary summary;
+
+			file_summary(&files[candidates[i].ino], &summary);
+			candidates[i].key = policy->key(&summary);
+		}
+		qsort(candidates, nr, sizeof(*candidates), candidate_cmp_key);
+	} else {
+		cmp_policy = policy;
+		qsort(candidates, nr, sizeof(*candidates),
+		      candidate_cmp_compare);
+	}
+
+	while (count < nr && blocks < nr_blocks) {
+		inos[count] = candidates[count].ino;
+		blocks += files[inos[count++]].inode.i_blocks;
+	}
+
+	free(candidates);
+	return count;
+}
+
+/*
+ * Volume
+ */
+
+static void file_drop(struct sim_file *file)
+{
+	free_blocks += file->inode.i_blocks;
+	file->live = false;
+	file->referenced = false;
+}
+
+static int evict(struct eviction_policy *policy)
+{
+	uint32_t target = (uint64_t)capacity * high_watermark / 100;
+	uint32_t needed = 1;
+	uint32_t *inos;
+	int nr, evicted = 0;
+
+	if (free_blocks < target)
+		needed = target - free_blocks;
+
+	inos = malloc(nr_files * sizeof(*inos));
+	if (!inos)
+		return -ENOMEM;
+
+	nr = select_victims(policy, inos, needed);
+	for (int i = 0; i < nr; i++) {
+		struct sim_file *file = &files[inos[i]];
+
+		/* Stop once the high watermark is reached */
+		if (evicted && free_blocks >= target)
+			break;
+		result->files_evicted++;
+		result->bytes_evicted += file->inode.i_size;
+		policy_removed(policy, file, true);
+		file_drop(file);
+		evicted++;
+	}
+	result->evictions++;
+
+	free(inos);
+	return evicted ? 0 : -ENOSPC;
+}
+
+/**
+ * file_resize - sets the size of a live file, evicting other files first if
+ *		 the volume would drop below the low watermark.
+ *
+ * Return: 0 on success, -ENOSPC if the file does not fit on the volume.
+ */
+static int file_resize(struct eviction_policy *policy, struct sim_file *file,
+		       uint32_t size)
+{
+	uint32_t low = (uint64_t)capacity * low_watermark / 100;
+	uint32_t blocks = file_blocks(size);
+
+	if (blocks > capacity - low) {
+		result->dropped++;
+		if (file->live) {
+			policy_removed(policy, file, false);
+			file_drop(file);
+		}
+		return -ENOSPC;
+	}
+
+	if (file->live)
+		file_drop(file);
+	while (free_blocks < blocks || free_blocks - blocks < low)
+		if (evict(policy))
+			return -ENOSPC;
+
+	file->inode.i_size = size;
+	file->inode.i_blocks = blocks;
+	file->size = size;
+	file->live = true;
+	file->known = true;
+	free_blocks -= blocks;
+	return 0;
+}
+
+/**
+ * file_create - creates a file, or brings back an evicted one as a new file
+ *		 as the module would.
+ *
+ * Return: 0 on success, -ENOSPC if the file does not fit on the volume.
+ */
+static int file_create(struct eviction_policy *policy, struct sim_file *file,
+		       uint32_t size, uint32_t time)
+{
+	if (file_resize(policy, file, size))
+		return -ENOSPC;
+
+	file->inode.i_atime.tv_sec = time;
+	file->inode.i_mtime.tv_sec = time;
+	file->inode.i_ctime.tv_sec = time;
+	file->freq = 0;
+	file->freq_epoch = time / OUICHEFS_FREQ_PERIOD;
+	policy_created(policy, file);
+	return 0;
+}
+
+static int replay_one(struct eviction_policy *policy,
+		      const struct sim_access *access)
+{
+	struct sim_file *file = &files[access->id];
+	uint32_t size = access->size ? access->size : file->size;
+
+	switch (access->op) {
+	case 'c':
+		file_create(policy, file, size, access->time);
+		return 0;
+	case 'r':
+		result->reads++;
+		if (file->live) {
+			result->hits++;
+		} else {
+			if (file->known)
+				result->misses++;
+			if (file_create(policy, file, size, access->time))
+				return 0;
+		}
+		file->inode.i_atime.tv_sec = access->time;
+		file->referenced = true;
+		file_access(file, access->time);
+		policy_accessed(policy, file);
+		return 0;
+	case 'w':
+		if (!file->live) {
+			if (file->known)
+				result->misses++;
+			if (file_create(policy, file, size, access->time))
+				return 0;
+		} else if (size != file->inode.i_size &&
+			   file_resize(policy, file, size)) {
+			return 0;
+		}
+		file->inode.i_mtime.tv_sec = access->time;
+		file->inode.i_ctime.tv_sec = access->time;
+		file->referenced = true;
+		file_access(file, access->time);
+		policy_accessed(policy, file);
+		return 0;
+	case 'd':
+		if (file->live) {
+			policy_removed(policy, file, false);
+			file_drop(file);
+		}
+		file->known = false;
+		return 0;
+	}
+
+	return -EINVAL;
+}
+
+/**
+ * replay - replays the trace on an empty volume.
+ */
+static void replay(struct eviction_policy *policy,
+		   const struct sim_access *trace, size_t nr_accesses,
+		   struct sim_result *res)
+{
+	struct timespec start, end;
+
+	memset(res, 0, sizeof(*res));
+	memset(files, 0, nr_files * sizeof(*files));
+	for (uint32_t ino = 0; ino < nr_files; ino++) {
+		files[ino].inode.i_ino = ino;
+		files[ino].inode.i_mode = S_IFREG | 0644;
+		files[ino].inode.i_sb = &sim_sb;
+	}
+	free_blocks = capacity;
+	clock_hand = 0;
+	result = res;
+	sim_sbi.nr_inodes = nr_files;
+	sim_sbi.policy_private = NULL;
+	if (policy->attach) {
+		sim_sbi.policy_private = policy->attach(&sim_sb);
+		if (IS_ERR(sim_sbi.policy_private)) {
+			fprintf(stderr, "%s: cannot attach\n", policy->name);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (size_t i = 0; i < nr_accesses; i++)
+		replay_one(policy, &trace[i]);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (policy->detach)
+		policy->detach(sim_sbi.policy_private);
+
+	res->seconds = (end.tv_sec - start.tv_sec) +
+		       (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+/*
+ * Traces
+ */
+
+static int parse_op(const char *op)
+{
+	static const char * const ops[] = { "create", "read", "write",
+					    "delete" };
+
+	for (int i = 0; i < 4; i++)
+		if (!strcmp(op, ops[i]) || (op[0] == ops[i][0] && !op[1]))
+			return ops[i][0];
+
+	return 0;
+}
+
+static struct sim_access *read_trace(FILE *fp, size_t *nr)
+{
+	struct sim_access *trace = NULL;
+	size_t alloc = 0, line_nr = 0;
+	char line[256];
+
+	*nr = 0;
+	while (fgets(line, sizeof(line), fp)) {
+		struct sim_access access = { 0 };
+		unsigned long time, id, size = 0;
+		char op[16];
+		int fields;
+
+		line_nr++;
+		if (line[0] == '#' || line[strspn(line, " \t\n")] == '\0')
+			continue;
+
+		fields = sscanf(line, "%lu %15s %lu %lu", &time, op, &id,
+				&size);
+		access.op = fields >= 3 ? parse_op(op) : 0;
+		if (!access.op || id >= UINT32_MAX || size > UINT32_MAX) {
+			fprintf(stderr, "line %zu: invalid access\n", line_nr);
+			free(trace);
+			return NULL;
+		}
+		access.time = time;
+		access.id = id;
+		access.size = size;
+
+		if (*nr == alloc) {
+			struct sim_access *tmp;
+
+			alloc = alloc ? 2 * alloc : 4096;
+			tmp = realloc(trace, alloc * sizeof(*trace));
+			if (!tmp) {
+				free(trace);
+				return NULL;
+			}
+			trace = tmp;
+		}
+		trace[(*nr)++] = access;
+		if (access.id >= nr_files)
+			nr_files = access.id + 1;
+	}
+
+	return trace;
+}
+
+/**
+ * generate_trace - prints a synthetic trace.
+ *
+ * @nr_accesses: number of accesses.
+ * @nr_ids: number of files.
+ *
+ * Files are created with a size drawn uniformly up to 64 KiB, then read and
+ * rewritten with a Zipf-like popularity (the i-th most popular file is
+ * accessed about 1/i as often as the most popular one).
+ */
+static void generate_trace(unsigned long nr_accesses, uint32_t nr_ids)
+{
+	double *cdf = malloc(nr_ids * sizeof(*cdf));
+	double total = 0;
+
+	if (!cdf) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	for (uint32_t i = 0; i < nr_ids; i++) {
+		total += 1.0 / (i + 1);
+		cdf[i] = total;
+	}
+
+	printf("# %lu accesses to %u files\n", nr_accesses, nr_ids);
+	for (unsigned long t = 0; t < nr_accesses; t++) {
+		double u = (double)random() / RAND_MAX * total;
+		uint32_t lo = 0, hi = nr_ids - 1;
+
+		while (lo < hi) {
+			uint32_t mid = lo + (hi - lo) / 2;
+
+			if (cdf[mid] < u)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		if (t < nr_ids)
+			printf("%lu create %u %ld\n", t, (uint32_t)t,
+			       random() % (64 << 10));
+		else if (random() % 10)
+			printf("%lu read %u\n", t, lo);
+		else
+			printf("%lu write %u %ld\n", t, lo,
+			       random() % (64 << 10));
+	}
+
+	free(cdf);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options] [trace]\n"
+		"       %s -g <accesses> [-f <files>]\n"
+		"Replays an access trace (stdin by default) against the eviction policies.\n"
+		"  -c <blocks>    volume size in 4 KiB blocks (default 1024)\n"
+		"  -l <percent>   low watermark (default 20)\n"
+		"  -H <percent>   high watermark (default 30)\n"
+		"  -p <policy>    only replay with this policy (default all)\n"
+		"  -s <K>         pick each victim as the best of K random files\n"
+		"  -S <seed>      random seed (default 1)\n"
+		"  -g <accesses>  print a synthetic trace instead\n"
+		"  -f <files>     number of files of the synthetic trace\n",
+		prog, prog);
+}
+
+int main(int argc, char **argv)
+{
+	const char *policy_name = NULL;
+	unsigned long generate = 0;
+	uint32_t nr_ids = 0;
+	struct sim_access *trace;
+	struct sim_result res;
+	size_t nr_accesses;
+	FILE *fp = stdin;
+	int opt;
+
+	srandom(1);
+	while ((opt = getopt(argc, argv, "c:l:H:p:s:S:g:f:h")) != -1) {
+		switch (opt) {
+		case 'c':
+			capacity = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			low_watermark = strtoul(optarg, NULL, 0);
+			break;
+		case 'H':
+			high_watermark = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			policy_name = optarg;
+			break;
+		case 's':
+			sample = strtoul(optarg, NULL, 0);
+			break;
+		case 'S':
+			srandom(strtoul(optarg, NULL, 0));
+			break;
+		case 'g':
+			generate = strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			nr_ids = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+
+	if (generate) {
+		generate_trace(generate, nr_ids ? nr_ids : generate / 10 + 1);
+		return EXIT_SUCCESS;
+	}
+
+	if (!capacity || low_watermark >= high_watermark ||
+	    high_watermark > 100) {
+		fprintf(stderr, "invalid volume size or watermarks\n");
+		return EXIT_FAILURE;
+	}
+	if (policy_name && !policy_find(policy_name)) {
+		fprintf(stderr, "unknown policy '%s'\n", policy_name);
+		return EXIT_FAILURE;
+	}
+
+	if (optind < argc) {
+		fp = fopen(argv[optind], "r");
+		if (!fp) {
+			perror(argv[optind]);
+			return EXIT_FAILURE;
+		}
+	}
+	trace = read_trace(fp, &nr_accesses);
+	if (fp != stdin)
+		fclose(fp);
+	if (!trace)
+		return EXIT_FAILURE;
+
+	files = calloc(nr_files ? nr_files : 1, sizeof(*files));
+	if (!files) {
+		perror("calloc");
+		return EXIT_FAILURE;
+	}
+
+	printf("%zu accesses to %u files, %u blocks, watermarks %u%%/%u%%",
+	       nr_accesses, nr_files, capacity, low_watermark, high_watermark);
+	if (sample)
+		printf(", sample %u", sample);
+	printf("\n%-8s %10s %8s %8s %10s %10s %12s %12s %9s\n", "policy",
+	       "reads", "hit%", "misses", "batches", "evicted", "bytes",
+	       "scanned", "time(s)");
+
+	for (int i = 0; i < nr_policies; i++) {
+		if (policy_name && strcmp(policies[i]->name, policy_name))
+			continue;
+
+		replay(policies[i], trace, nr_accesses, &res);
+		printf("%-8s %10lu %7.2f%% %8lu %10lu %10lu %12llu %12llu %9.3f\n",
+		       policies[i]->name, res.reads,
+		       res.reads ? 100.0 * res.hits / res.reads : 0.0,
+		       res.misses, res.evictions, res.files_evicted,
+		       res.bytes_evicted, res.scanned, res.seconds);
+		if (res.dropped)
+			fprintf(stderr, "%s: %lu accesses to files larger than the volume ignored\n",
+				policies[i]->name, res.dropped);
+	}
+
+	free(files);
+	free(trace);
+	return EXIT_SUCCESS;
+}
@@ -12,8 +12,13 @@
 #include <linux/buffer_head.h>
 #include <linux/slab.h>
 #include <linux/statfs.h>
+#include <linux/parser.h>
+#include <linux/seq_file.h>
 
 #include "ouichefs.h"
+#include "bitmap.h"
+#include "eviction.h"
+#include "extent.h"
 
 static struct kmem_cache *ouichefs_inode_cache;
 
@@ -41,6 +46,16 @@ static struct inode *ouichefs_alloc_inode(struct super_block *sb)
 	if (!ci)
 		return NULL;
 	inode_init_once(&ci->vfs_inode);
+	ci->dir_order = NULL;
+	ci->freq = 0;
+	ci->freq_epoch = 0;
+	ci->evict_class = OUICHEFS_EVICT_NORMAL;
+	init_rwsem(&ci->map_sem);
+	ci->map = NULL;
+	ci->map_nr = 0;
+	ci->map_max = 0;
+	ci->map_chained = 0;
+	ci->map_loaded = false;
 	return &ci->vfs_inode;
 }
 
@@ -49,6 +64,8 @@ static void ouichefs_destroy_inode(struct inode *inode)
 	struct ouichefs_inode_info *ci;
 
 	ci = OUICHEFS_INODE(inode);
+	kfree(ci->dir_order);
+	ouichefs_extent_release(inode);
 	kmem_cache_free(ouichefs_inode_cache, ci);
 }
 
@@ -61,8 +78,7 @@ static int ouichefs_write_inode(struct inode *inode,
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
 	struct buffer_head *bh;
 	uint32_t ino = inode->i_ino;
-	uint32_t inode_block = (ino / OUICHEFS_INODES_PER_BLOCK) + 1;
-	uint32_t inode_shift = ino % OUICHEFS_INODES_PER_BLOCK;
+	uint32_t inode_block = (ino / OUICHEFS_INODES_PER_BLOCK(sbi)) + 1;
 
 	if (ino >= sbi->nr_inodes)
 		return 0;
@@ -70,8 +86,7 @@ static int ouichefs_write_inode(struct inode *inode,
 	bh = sb_bread(sb, inode_block);
 	if (!bh)
 		return -EIO;
-	disk_inode = (struct ouichefs_inode *)bh->b_data;
-	disk_inode += inode_shift;
+	disk_inode = ouichefs_istore_inode(sbi, bh, ino);
 
 	/* update the mode using what the generic inode has */
 	disk_inode->i_mode = inode->i_mode;
@@ -84,6 +99,12 @@ static int ouichefs_write_inode(struct inode *inode,
 	disk_inode->i_blocks = inode->i_blocks;
 	disk_inode->i_nlink = inode->i_nlink;
 	disk_inode->index_block = ci->index_block;
+	if (sbi->features & OUICHEFS_FEATURE_EXT_INODE) {
+		disk_inode->i_parent = ouichefs_index_parent(sb, ino);
+		disk_inode->i_freq = READ_ONCE(ci->freq);
+		disk_inode->i_freq_epoch = READ_ONCE(ci->freq_epoch);
+		disk_inode->i_evict_class = READ_ONCE(ci->evict_class);
+	}
 
 	mark_buffer_dirty(bh);
 	sync_dirty_buffer(bh);
@@ -109,8 +130,11 @@ static int sync_sb_info(struct super_block *sb, int wait)
 	disk_sb->nr_istore_blocks = sbi->nr_istore_blocks;
 	disk_sb->nr_ifree_blocks = sbi->nr_ifree_blocks;
 	disk_sb->nr_bfree_blocks = sbi->nr_bfree_blocks;
-	disk_sb->nr_free_inodes = sbi->nr_free_inodes;
-	disk_sb->nr_free_blocks = sbi->nr_free_blocks;
+	disk_sb->nr_free_inodes =
+		percpu_counter_sum_positive(&sbi->alloc->free_inodes);
+	disk_sb->nr_free_blocks =
+		percpu_counter_sum_positive(&sbi->alloc->free_blocks);
+	disk_sb->features = sbi->features;
 
 	mark_buffer_dirty(bh);
 	if (wait)
@@ -134,9 +158,7 @@ static int sync_ifree(struct super_block *sb, int wait)
 		if (!bh)
 			return -EIO;
 
-		memcpy(bh->b_data,
-		       (void *)sbi->ifree_bitmap + i * OUICHEFS_BLOCK_SIZE,
-		       OUICHEFS_BLOCK_SIZE);
+		ouichefs_alloc_copy_ifree(sbi, i, bh->b_data);
 
 		mark_buffer_dirty(bh);
 		if (wait)
@@ -153,7 +175,8 @@ static int sync_bfree(struct super_block *sb, int wait)
 	struct buffer_head *bh;
 	int i, idx;
 
-	/* Flush free blocks bitmask */
+	/* Give the blocks reserved by the CPUs back, then flush the bitmask */
+	ouichefs_alloc_drain(sbi);
 	for (i = 0; i < sbi->nr_bfree_blocks; i++) {
 		idx = sbi->nr_istore_blocks + sbi->nr_ifree_blocks + i + 1;
 
@@ -161,9 +184,7 @@ static int sync_bfree(struct super_block *sb, int wait)
 		if (!bh)
 			return -EIO;
 
-		memcpy(bh->b_data,
-		       (void *)sbi->bfree_bitmap + i * OUICHEFS_BLOCK_SIZE,
-		       OUICHEFS_BLOCK_SIZE);
+		ouichefs_alloc_copy_bfree(sbi, i, bh->b_data);
 
 		mark_buffer_dirty(bh);
 		if (wait)
@@ -179,6 +200,11 @@ static void ouichefs_put_super(struct super_block *sb)
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
 
 	if (sbi) {
+		ouichefs_reclaim_destroy(sb);
+		ouichefs_index_destroy(sb);
+		ouichefs_policy_detach(sb);
+		ouichefs_stats_destroy(sb);
+		ouichefs_alloc_destroy(sbi);
 		kfree(sbi->ifree_bitmap);
 		kfree(sbi->bfree_bitmap);
 		kfree(sbi);
@@ -210,15 +236,32 @@ static int ouichefs_statfs(struct dentry *dentry, struct kstatfs *stat)
 	stat->f_type = OUICHEFS_MAGIC;
 	stat->f_bsize = OUICHEFS_BLOCK_SIZE;
 	stat->f_blocks = sbi->nr_blocks;
-	stat->f_bfree = sbi->nr_free_blocks;
-	stat->f_bavail = sbi->nr_free_blocks;
-	stat->f_files = sbi->nr_inodes - sbi->nr_free_inodes;
-	stat->f_ffree = sbi->nr_free_inodes;
+	stat->f_bfree = percpu_counter_sum_positive(&sbi->alloc->free_blocks);
+	stat->f_bavail = stat->f_bfree;
+	stat->f_ffree = percpu_counter_sum_positive(&sbi->alloc->free_inodes);
+	stat->f_files = sbi->nr_inodes - stat->f_ffree;
 	stat->f_namelen = OUICHEFS_FILENAME_LEN;
 
 	return 0;
 }
 
+static int ouichefs_show_options(struct seq_file *m, struct dentry *root)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(root->d_sb);
+	char policy[MAX_EVICTION_NAME];
+
+	ouichefs_policy_name(root->d_sb, policy);
+	seq_show_option(m, "policy", policy);
+	if (sbi->evict_sample)
+		seq_printf(m, ",sample=%u", sbi->evict_sample);
+	if (sbi->evict_low_watermark != EVICTION_LOW_WATERMARK)
+		seq_printf(m, ",low=%u", sbi->evict_low_watermark);
+	if (sbi->evict_high_watermark != EVICTION_HIGH_WATERMARK)
+		seq_printf(m, ",high=%u", sbi->evict_high_watermark);
+
+	return 0;
+}
+
 static struct super_operations ouichefs_super_ops = {
 	.put_super = ouichefs_put_super,
 	.alloc_inode = ouichefs_alloc_inode,
@@ -226,8 +269,80 @@ static struct super_operations ouichefs_super_ops = {
 	.write_inode = ouichefs_write_inode,
 	.sync_fs = ouichefs_sync_fs,
 	.statfs = ouichefs_statfs,
+	.show_options = ouichefs_show_options,
 };
 
+enum { Opt_policy, Opt_sample, Opt_low, Opt_high, Opt_err };
+
+static const match_table_t tokens = {
+	{ Opt_policy, "policy=%s" },
+	{ Opt_sample, "sample=%u" },
+	{ Opt_low, "low=%u" },
+	{ Opt_high, "high=%u" },
+	{ Opt_err, NULL },
+};
+
+/*
+ * Parse the mount options. The name of the eviction policy is returned in
+ * policy and needs to be freed by the caller.
+ */
+static int ouichefs_parse_options(struct ouichefs_sb_info *sbi, char *options,
+				  char **policy)
+{
+	substring_t args[MAX_OPT_ARGS];
+	unsigned int sample, percent;
+	char *p;
+
+	if (!options)
+		return 0;
+
+	while ((p = strsep(&options, ",")) != NULL) {
+		if (!*p)
+			continue;
+
+		switch (match_token(p, tokens, args)) {
+		case Opt_policy:
+			kfree(*policy);
+			*policy = match_strdup(&args[0]);
+			if (!*policy)
+				return -ENOMEM;
+			break;
+		case Opt_sample:
+			if (match_uint(&args[0], &sample) ||
+			    sample > EVICTION_SAMPLE_MAX) {
+				pr_err("Invalid sample size '%s'\n", p);
+				return -EINVAL;
+			}
+			sbi->evict_sample = sample;
+			break;
+		case Opt_low:
+			if (match_uint(&args[0], &percent) || percent > 100) {
+				pr_err("Invalid watermark '%s'\n", p);
+				return -EINVAL;
+			}
+			sbi->evict_low_watermark = percent;
+			break;
+		case Opt_high:
+			if (match_uint(&args[0], &percent) || percent > 100) {
+				pr_err("Invalid watermark '%s'\n", p);
+				return -EINVAL;
+			}
+			sbi->evict_high_watermark = percent;
+			break;
+		default:
+			pr_err("Unknown mount option '%s'\n", p);
+			return -EINVAL;
+		}
+	}
+
+	if (sbi->evict_low_watermark >= sbi->evict_high_watermark) {
+		pr_err("The low watermark must be below the high watermark\n");
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
 /* Fill the struct superblock from partition superblock */
 int ouichefs_fill_super(struct super_block *sb, void *data, int silent)
 {
@@ -235,6 +350,7 @@ int ouichefs_fill_super(struct super_block *sb, void *data, int silent)
 	struct ouichefs_sb_info *csb = NULL;
 	struct ouichefs_sb_info *sbi = NULL;
 	struct inode *root_inode = NULL;
+	char *policy = NULL;
 	int ret = 0, i;
 
 	/* Init sb */
@@ -256,6 +372,14 @@ int ouichefs_fill_super(struct super_block *sb, void *data, int silent)
 		goto release;
 	}
 
+	/* Refuse images using features this module does not know about */
+	if (csb->features & ~OUICHEFS_FEATURES_SUPPORTED) {
+		pr_err("Unsupported features %#x\n",
+		       csb->features & ~OUICHEFS_FEATURES_SUPPORTED);
+		ret = -EINVAL;
+		goto release;
+	}
+
 	/* Alloc sb_info */
 	sbi = kzalloc(sizeof(struct ouichefs_sb_info), GFP_KERNEL);
 	if (!sbi) {
@@ -269,9 +393,28 @@ int ouichefs_fill_super(struct super_block *sb, void *data, int silent)
 	sbi->nr_bfree_blocks = csb->nr_bfree_blocks;
 	sbi->nr_free_inodes = csb->nr_free_inodes;
 	sbi->nr_free_blocks = csb->nr_free_blocks;
+	sbi->features = csb->features;
+	sbi->evict_low_watermark = EVICTION_LOW_WATERMARK;
+	sbi->evict_high_watermark = EVICTION_HIGH_WATERMARK;
+	mutex_init(&sbi->evict_lock);
+	sbi->sb = sb;
 	sb->s_fs_info = sbi;
 
 	brelse(bh);
+	bh = NULL;
+
+	ret = ouichefs_parse_options(sbi, data, &policy);
+	if (ret)
+		goto free_sbi;
+
+	if (sbi->features & OUICHEFS_FEATURE_EXTENTS)
+		sb->s_maxbytes = OUICHEFS_MAX_FILESIZE_EXTENTS;
+
+	if (sbi->features & OUICHEFS_FEATURE_EXT_INODE)
+		sbi->inode_size = sizeof(struct ouichefs_inode);
+	else
+		sbi->inode_size = OUICHEFS_INODE_SIZE_V1;
+	sbi->inodes_per_block = OUICHEFS_BLOCK_SIZE / sbi->inode_size;
 
 	/* Alloc and copy ifree_bitmap */
 	sbi->ifree_bitmap =
@@ -293,6 +436,7 @@ int ouichefs_fill_super(struct super_block *sb, void *data, int silent)
 		       bh->b_data, OUICHEFS_BLOCK_SIZE);
 
 		brelse(bh);
+		bh = NULL;
 	}
 
 	/* Alloc and copy bfree_bitmap */
@@ -315,13 +459,45 @@ int ouichefs_fill_super(struct super_block *sb, void *data, int silent)
 		       bh->b_data, OUICHEFS_BLOCK_SIZE);
 
 		brelse(bh);
+		bh = NULL;
 	}
 
+	/* Set up the allocator, it owns the free counts from now on */
+	ret = ouichefs_alloc_init(sbi, sbi->nr_free_blocks,
+				  sbi->nr_free_inodes);
+	if (ret)
+		goto free_bfree;
+
+	ret = ouichefs_stats_init(sb);
+	if (ret)
+		goto free_alloc;
+
+	/* Select the eviction policy, the index is keyed with it */
+	ret = ouichefs_policy_attach(sb, policy);
+	if (ret)
+		goto free_stats;
+
+	/* Build the eviction index from the inode store */
+	ret = ouichefs_index_init(sb);
+	if (ret)
+		goto free_policy;
+	ouichefs_policy_seed(sb);
+
+	/* Set up the background reclaim worker */
+	ret = ouichefs_reclaim_init(sb);
+	if (ret)
+		goto free_index;
+
+	/* Create /sys/fs/ouichefs/<device> */
+	ret = ouichefs_sysfs_register(sb);
+	if (ret)
+		goto free_reclaim;
+
 	/* Create root inode */
 	root_inode = ouichefs_iget(sb, 0);
 	if (IS_ERR(root_inode)) {
 		ret = PTR_ERR(root_inode);
-		goto free_bfree;
+		goto free_sysfs;
 	}
 	inode_init_owner(&nop_mnt_idmap, root_inode, NULL, root_inode->i_mode);
 	sb->s_root = d_make_root(root_inode);
@@ -330,18 +506,33 @@ int ouichefs_fill_super(struct super_block *sb, void *data, int silent)
 		goto iput;
 	}
 
+	kfree(policy);
 	return 0;
 
 iput:
 	iput(root_inode);
+free_sysfs:
+	ouichefs_sysfs_unregister(sb);
+free_reclaim:
+	ouichefs_reclaim_destroy(sb);
+free_index:
+	ouichefs_index_destroy(sb);
+free_policy:
+	ouichefs_policy_detach(sb);
+free_stats:
+	ouichefs_stats_destroy(sb);
+free_alloc:
+	ouichefs_alloc_destroy(sbi);
 free_bfree:
 	kfree(sbi->bfree_bitmap);
 free_ifree:
 	kfree(sbi->ifree_bitmap);
 free_sbi:
 	kfree(sbi);
+	sb->s_fs_info = NULL;
 release:
 	brelse(bh);
+	kfree(policy);
 
 	return ret;
 }
@@ -0,0 +1,311 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * sysfs interface of ouiche_fs.
+ *
+ * /sys/fs/ouichefs/policies lists the eviction policies that can be selected,
+ * and every mounted partition has its own directory /sys/fs/ouichefs/<device>
+ * holding its eviction settings and statistics.
+ */
+
+#define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
+
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/kobject.h>
+#include <linux/sysfs.h>
+#include <linux/math64.h>
+
+#include "eviction.h"
+#include "ouichefs.h"
+
+/* /sys/fs/ouichefs */
+static struct kobject *ouichefs_kobj;
+
+/**
+ * struct ouichefs_attr - attribute of the directory of a partition.
+ *
+ * @attr: the sysfs attribute.
+ * @show: prints the value of the attribute for a superblock.
+ * @store: sets the value of the attribute for a superblock.
+ */
+struct ouichefs_attr {
+	struct attribute attr;
+	ssize_t (*show)(struct super_block *sb, char *buf);
+	ssize_t (*store)(struct super_block *sb, const char *buf,
+			 size_t count);
+};
+
+#define OUICHEFS_ATTR_RW(_name)                                            \
+	static struct ouichefs_attr ouichefs_attr_##_name =                \
+		__ATTR(_name, 0644, _name##_show, _name##_store)
+#define OUICHEFS_ATTR_RO(_name)                                            \
+	static struct ouichefs_attr ouichefs_attr_##_name =                \
+		__ATTR(_name, 0444, _name##_show, NULL)
+
+/*
+ * Writing a positive value runs a batch eviction, reading shows whether one
+ * is running.
+ */
+static ssize_t eviction_enabled_show(struct super_block *sb, char *buf)
+{
+	return sysfs_emit(buf, "%d\n",
+			  mutex_is_locked(&OUICHEFS_SB(sb)->evict_lock));
+}
+
+static ssize_t eviction_enabled_store(struct super_block *sb, const char *buf,
+				      size_t count)
+{
+	int value;
+	int rc = kstrtoint(buf, 10, &value);
+
+	if (rc || value <= 0) {
+		pr_err("invalid value\n");
+		return -EINVAL;
+	}
+
+	trigger_eviction(sb);
+	return count;
+}
+OUICHEFS_ATTR_RW(eviction_enabled);
+
+static ssize_t policy_show(struct super_block *sb, char *buf)
+{
+	char name[MAX_EVICTION_NAME];
+
+	ouichefs_policy_name(sb, name);
+	return sysfs_emit(buf, "%s\n", name);
+}
+
+static ssize_t policy_store(struct super_block *sb, const char *buf,
+			    size_t count)
+{
+	char name[MAX_EVICTION_NAME];
+	size_t len = strcspn(buf, "\n");
+	int ret;
+
+	if (len >= MAX_EVICTION_NAME)
+		return -EINVAL;
+	memcpy(name, buf, len);
+	name[len] = '\0';
+
+	ret = ouichefs_policy_select(sb, name);
+	return ret ? ret : count;
+}
+OUICHEFS_ATTR_RW(policy);
+
+/*
+ * The low watermark must stay below the high one, so raising both needs the
+ * high watermark to be written first.
+ */
+static ssize_t low_watermark_show(struct super_block *sb, char *buf)
+{
+	return sysfs_emit(buf, "%u\n",
+			  READ_ONCE(OUICHEFS_SB(sb)->evict_low_watermark));
+}
+
+static ssize_t low_watermark_store(struct super_block *sb, const char *buf,
+				   size_t count)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	unsigned int value;
+
+	if (kstrtouint(buf, 10, &value) ||
+	    value >= READ_ONCE(sbi->evict_high_watermark))
+		return -EINVAL;
+
+	WRITE_ONCE(sbi->evict_low_watermark, value);
+	return count;
+}
+OUICHEFS_ATTR_RW(low_watermark);
+
+static ssize_t high_watermark_show(struct super_block *sb, char *buf)
+{
+	return sysfs_emit(buf, "%u\n",
+			  READ_ONCE(OUICHEFS_SB(sb)->evict_high_watermark));
+}
+
+static ssize_t high_watermark_store(struct super_block *sb, const char *buf,
+				    size_t count)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	unsigned int value;
+
+	if (kstrtouint(buf, 10, &value) || value > 100 ||
+	    value <= READ_ONCE(sbi->evict_low_watermark))
+		return -EINVAL;
+
+	WRITE_ONCE(sbi->evict_high_watermark, value);
+	return count;
+}
+OUICHEFS_ATTR_RW(high_watermark);
+
+/*
+ * Statistics of the background reclaim worker.
+ */
+static ssize_t reclaim_wakeups_show(struct super_block *sb, char *buf)
+{
+	struct ouichefs_reclaim *rc = OUICHEFS_SB(sb)->reclaim;
+
+	return sysfs_emit(buf, "%lld\n", atomic64_read(&rc->nr_wakeups));
+}
+OUICHEFS_ATTR_RO(reclaim_wakeups);
+
+static ssize_t reclaim_runs_show(struct super_block *sb, char *buf)
+{
+	struct ouichefs_reclaim *rc = OUICHEFS_SB(sb)->reclaim;
+
+	return sysfs_emit(buf, "%lld\n", atomic64_read(&rc->nr_runs));
+}
+OUICHEFS_ATTR_RO(reclaim_runs);
+
+static ssize_t reclaim_runtime_us_show(struct super_block *sb, char *buf)
+{
+	struct ouichefs_reclaim *rc = OUICHEFS_SB(sb)->reclaim;
+
+	return sysfs_emit(buf, "%lld\n",
+			  div_s64(atomic64_read(&rc->runtime_ns),
+				  NSEC_PER_USEC));
+}
+OUICHEFS_ATTR_RO(reclaim_runtime_us);
+
+/* Bytes of the files that are never evicted */
+static ssize_t pinned_bytes_show(struct super_block *sb, char *buf)
+{
+	return sysfs_emit(buf, "%llu\n", ouichefs_index_pinned_bytes(sb));
+}
+OUICHEFS_ATTR_RO(pinned_bytes);
+
+static struct attribute *ouichefs_sb_attrs[] = {
+	&ouichefs_attr_eviction_enabled.attr,
+	&ouichefs_attr_policy.attr,
+	&ouichefs_attr_low_watermark.attr,
+	&ouichefs_attr_high_watermark.attr,
+	&ouichefs_attr_reclaim_wakeups.attr,
+	&ouichefs_attr_reclaim_runs.attr,
+	&ouichefs_attr_reclaim_runtime_us.attr,
+	&ouichefs_attr_pinned_bytes.attr,
+	NULL,
+};
+ATTRIBUTE_GROUPS(ouichefs_sb);
+
+static ssize_t ouichefs_attr_show(struct kobject *kobj, struct attribute *attr,
+				  char *buf)
+{
+	struct ouichefs_sb_info *sbi =
+		container_of(kobj, struct ouichefs_sb_info, kobj);
+	struct ouichefs_attr *a = container_of(attr, struct ouichefs_attr, attr);
+
+	return a->show(sbi->sb, buf);
+}
+
+static ssize_t ouichefs_attr_store(struct kobject *kobj,
+				   struct attribute *attr, const char *buf,
+				   size_t count)
+{
+	struct ouichefs_sb_info *sbi =
+		container_of(kobj, struct ouichefs_sb_info, kobj);
+	struct ouichefs_attr *a = container_of(attr, struct ouichefs_attr, attr);
+
+	return a->store(sbi->sb, buf, count);
+}
+
+static const struct sysfs_ops ouichefs_attr_ops = {
+	.show = ouichefs_attr_show,
+	.store = ouichefs_attr_store,
+};
+
+static void ouichefs_sb_release(struct kobject *kobj)
+{
+	struct ouichefs_sb_info *sbi =
+		container_of(kobj, struct ouichefs_sb_info, kobj);
+
+	complete(&sbi->kobj_unregister);
+}
+
+static const struct kobj_type ouichefs_sb_ktype = {
+	.default_groups = ouichefs_sb_groups,
+	.sysfs_ops = &ouichefs_attr_ops,
+	.release = ouichefs_sb_release,
+};
+
+/**
+ * ouichefs_sysfs_register - creates the sysfs directory of a partition.
+ *
+ * @sb: superblock of the file system being mounted.
+ *
+ * Return: 0 on success, < 0 on error.
+ */
+int ouichefs_sysfs_register(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	int ret;
+
+	init_completion(&sbi->kobj_unregister);
+	ret = kobject_init_and_add(&sbi->kobj, &ouichefs_sb_ktype,
+				   ouichefs_kobj, "%s", sb->s_id);
+	if (ret) {
+		kobject_put(&sbi->kobj);
+		wait_for_completion(&sbi->kobj_unregister);
+	}
+
+	return ret;
+}
+
+/**
+ * ouichefs_sysfs_unregister - removes the sysfs directory of a partition.
+ *
+ * @sb: superblock of the file system.
+ *
+ * Waits for the attribute handlers that are running, so that no batch
+ * eviction started from sysfs holds inodes of the superblock afterwards.
+ */
+void ouichefs_sysfs_unregister(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+
+	if (!sbi)
+		return;
+
+	kobject_del(&sbi->kobj);
+	kobject_put(&sbi->kobj);
+	wait_for_completion(&sbi->kobj_unregister);
+}
+
+static ssize_t policies_show(struct kobject *kobj, struct kobj_attribute *attr,
+			     char *buf)
+{
+	return ouichefs_policy_list(buf);
+}
+
+static struct kobj_attribute policies_attr = __ATTR_RO(policies);
+
+/**
+ * ouichefs_sysfs_init - creates /sys/fs/ouichefs.
+ *
+ * Return: 0 on success, < 0 on error.
+ */
+int ouichefs_sysfs_init(void)
+{
+	int ret;
+
+	ouichefs_kobj = kobject_create_and_add("ouichefs", fs_kobj);
+	if (!ouichefs_kobj)
+		return -ENOMEM;
+
+	ret = sysfs_create_file(ouichefs_kobj, &policies_attr.attr);
+	if (ret) {
+		kobject_put(ouichefs_kobj);
+		ouichefs_kobj = NULL;
+	}
+
+	return ret;
+}
+
+/**
+ * ouichefs_sysfs_exit - removes /sys/fs/ouichefs.
+ */
+void ouichefs_sysfs_exit(void)
+{
+	kobject_put(ouichefs_kobj);
+	ouichefs_kobj = NULL;
+}